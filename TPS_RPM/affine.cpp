@@ -0,0 +1,390 @@
+// This file is for the affine-only registration of rpm::estimate, see RpmConfig::affine_only.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "affine.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+#include "parallel.h"
+
+namespace {
+    typedef std::chrono::steady_clock Clock;
+
+    // Target points per grid cell.
+    const double points_per_cell = 4;
+
+    inline double _seconds_since(const Clock::time_point start) {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+}
+
+rpm::NeighborGrid::NeighborGrid(const MatrixXd &points_, const vector<char> &excluded)
+        : points(points_.leftCols(2)), origin(Vector2d::Zero()) {
+    if (points_.cols() < 2 || (!excluded.empty() && int(excluded.size()) != points_.rows())) {
+        throw std::invalid_argument("rpm::NeighborGrid needs 2d points and one excluded flag per point!");
+    }
+
+    vector<int> rows;
+    rows.reserve(points.rows());
+    for (int i = 0; i < points.rows(); i++) {
+        if (excluded.empty() || !excluded[i]) {
+            rows.push_back(i);
+        }
+    }
+    const int P = int(rows.size());
+    if (P == 0) {
+        cell_begin.assign(2, 0);
+        return;
+    }
+
+    origin = points.row(rows[0]).transpose();
+    Vector2d last = origin;
+    for (int i : rows) {
+        origin = origin.cwiseMin(points.row(i).transpose());
+        last = last.cwiseMax(points.row(i).transpose());
+    }
+    const Vector2d extent = last - origin;
+
+    // Square cells of points_per_cell points on average for points spread over the box,
+    // the second term keeps the same count for points along a line.
+    cell_side = std::max(std::sqrt(extent(0) * extent(1) * points_per_cell / P),
+                         extent.maxCoeff() * points_per_cell / P);
+    if (!(cell_side > 0)) {
+        cell_side = 1;
+    }
+    cells_x = int(extent(0) / cell_side) + 1;
+    cells_y = int(extent(1) / cell_side) + 1;
+
+    // Counting sort of the points by cell.
+    vector<int> cell_of(P);
+    cell_begin.assign(size_t(cells_x) * cells_y + 1, 0);
+    for (int j = 0; j < P; j++) {
+        const int cx = std::min(int((points(rows[j], 0) - origin(0)) / cell_side), cells_x - 1);
+        const int cy = std::min(int((points(rows[j], 1) - origin(1)) / cell_side), cells_y - 1);
+        cell_of[j] = cy * cells_x + cx;
+        cell_begin[cell_of[j] + 1]++;
+    }
+    for (size_t c = 1; c < cell_begin.size(); c++) {
+        cell_begin[c] += cell_begin[c - 1];
+    }
+    point_order.resize(P);
+    vector<int> fill(cell_begin.begin(), cell_begin.end() - 1);
+    for (int j = 0; j < P; j++) {
+        point_order[fill[cell_of[j]]++] = rows[j];
+    }
+}
+
+void rpm::NeighborGrid::nearest(const Vector2d &p, const int k_, vector<pair<double, int> > &result) const {
+    result.clear();
+    const int k = std::min(k_, size());
+    if (k <= 0) {
+        return;
+    }
+
+    // Rings of cells around the cell of p, clamped to the grid.
+    const Vector2d f = (p - origin) / cell_side;
+    const int cx = int(std::min(std::max(std::floor(f(0)), 0.0), double(cells_x - 1)));
+    const int cy = int(std::min(std::max(std::floor(f(1)), 0.0), double(cells_y - 1)));
+
+    auto visit = [&](int x, int y) {
+        const int c = y * cells_x + x;
+        for (int i = cell_begin[c]; i < cell_begin[c + 1]; i++) {
+            const int row = point_order[i];
+            result.emplace_back((points.row(row).transpose() - p).squaredNorm(), row);
+        }
+    };
+
+    for (int r = 0;; r++) {
+        const int x0 = cx - r, x1 = cx + r, y0 = cy - r, y1 = cy + r;
+        for (int y = std::max(y0, 0); y <= std::min(y1, cells_y - 1); y++) {
+            if (y == y0 || y == y1) {
+                for (int x = std::max(x0, 0); x <= std::min(x1, cells_x - 1); x++) {
+                    visit(x, y);
+                }
+            } else {
+                if (x0 >= 0) {
+                    visit(x0, y);
+                }
+                if (x1 < cells_x) {
+                    visit(x1, y);
+                }
+            }
+        }
+
+        // Every point not visited yet lies beyond one of the box sides the grid still extends past.
+        double bound = std::numeric_limits<double>::infinity();
+        if (x0 > 0) {
+            bound = std::min(bound, p(0) - (origin(0) + x0 * cell_side));
+        }
+        if (x1 < cells_x - 1) {
+            bound = std::min(bound, origin(0) + (x1 + 1) * cell_side - p(0));
+        }
+        if (y0 > 0) {
+            bound = std::min(bound, p(1) - (origin(1) + y0 * cell_side));
+        }
+        if (y1 < cells_y - 1) {
+            bound = std::min(bound, origin(1) + (y1 + 1) * cell_side - p(1));
+        }
+
+        if (bound == std::numeric_limits<double>::infinity()) {
+            break;
+        }
+        if (int(result.size()) >= k) {
+            std::nth_element(result.begin(), result.begin() + (k - 1), result.end());
+            if (result[k - 1].first <= bound * bound) {
+                break;
+            }
+        }
+    }
+
+    std::partial_sort(result.begin(), result.begin() + k, result.end());
+    result.resize(k);
+}
+
+VectorXd rpm::SparseCorrespondence::rowSums() const {
+    VectorXd sums = VectorXd::Zero(K);
+    for (int k = 0; k < K; k++) {
+        for (int i = row_begin[k]; i < row_begin[k + 1]; i++) {
+            sums(k) += values[i];
+        }
+    }
+    return sums;
+}
+
+MatrixXd rpm::SparseCorrespondence::product(const MatrixXd &Y) const {
+    MatrixXd MY = MatrixXd::Zero(K, Y.cols());
+    for (int k = 0; k < K; k++) {
+        for (int i = row_begin[k]; i < row_begin[k + 1]; i++) {
+            MY.row(k) += values[i] * Y.row(cols[i]);
+        }
+    }
+    return MY;
+}
+
+MatrixXd rpm::SparseCorrespondence::toDense() const {
+    MatrixXd M = MatrixXd::Zero(K, N);
+    for (int k = 0; k < K; k++) {
+        for (int i = row_begin[k]; i < row_begin[k + 1]; i++) {
+            M(k, cols[i]) = values[i];
+        }
+    }
+    return M;
+}
+
+void rpm::sparse_correspondence(
+        const MatrixXd &XT,
+        const MatrixXd &Y,
+        const NeighborGrid &grid,
+        const int neighbors,
+        const double T,
+        const vector<pair<int, int> > &anchors,
+        SparseCorrespondence &M,
+        const RpmConfig &config,
+        RpmIterationStats *iteration_stats) {
+    if (XT.cols() != D + 1 || Y.cols() != D + 1) {
+        throw std::invalid_argument("Current only support 3d homogeneou points!");
+    }
+    if (neighbors <= 0) {
+        throw std::invalid_argument("sparse_correspondence() needs neighbors > 0!");
+    }
+
+    const int K = XT.rows(), N = Y.rows();
+    const double beta = 1.0 / T;
+    auto start = Clock::now();
+
+    vector<int> fixed_col(K, -1);
+    for (auto point_pair : anchors) {
+        fixed_col[point_pair.first] = point_pair.second;
+    }
+    const int K_free = K - int(anchors.size()), N_free = N - int(anchors.size());
+    const int row_entries = std::min(neighbors, grid.size());
+
+    M.K = K;
+    M.N = N;
+    M.row_begin.resize(K + 1);
+    M.row_begin[0] = 0;
+    for (int k = 0; k < K; k++) {
+        M.row_begin[k + 1] = M.row_begin[k] + (fixed_col[k] >= 0 ? 1 : row_entries);
+    }
+    M.cols.resize(M.row_begin[K]);
+    M.values.resize(M.row_begin[K]);
+
+    // Affinity of the row_entries nearest targets of each free row, 1 for the anchors.
+    parallel::parallel_for(0, K, parallel::grain_for(row_entries * 64), [&](int begin, int end) {
+        vector<pair<double, int> > nearest;
+        for (int k = begin; k < end; k++) {
+            const int i0 = M.row_begin[k];
+            if (fixed_col[k] >= 0) {
+                M.cols[i0] = fixed_col[k];
+                M.values[i0] = 1;
+                continue;
+            }
+            grid.nearest(XT.row(k).leftCols(D).transpose(), row_entries, nearest);
+            for (int j = 0; j < row_entries; j++) {
+                M.cols[i0 + j] = nearest[j].second;
+                M.values[i0 + j] = std::exp(beta * (config.alpha - nearest[j].first));
+            }
+        }
+    });
+    if (iteration_stats) {
+        iteration_stats->affinity_time += _seconds_since(start);
+        start = Clock::now();
+    }
+
+    // Softassign on M = diag(u) * A * diag(v) as in estimate_correspondence(), the outlier
+    // row and column are the constants 1 / (N_free + 1) and 1 / (K_free + 1).
+    const double outlier_col = 1.0 / (K_free + 1), outlier_row = 1.0 / (N_free + 1);
+    const double epsilon1 = config.epsilon1;
+    VectorXd u = VectorXd::Ones(K), v = VectorXd::Ones(N);
+    VectorXd row_sum(K), col_sum(N);
+    int iter = 0;
+    while (iter < config.I1) {
+        parallel::parallel_for(0, K, parallel::grain_for(row_entries * 4), [&](int begin, int end) {
+            for (int k = begin; k < end; k++) {
+                double sum = outlier_col;
+                for (int i = M.row_begin[k]; i < M.row_begin[k + 1]; i++) {
+                    sum += M.values[i] * v(M.cols[i]);
+                }
+                row_sum(k) = sum;
+            }
+        });
+
+        // After a full sweep the columns sum to 1, the row sums tell how far from converged M is.
+        if (config.sinkhorn_tolerance > 0 && iter > 0) {
+            double residual = 0;
+            for (int k = 0; k < K; k++) {
+                const double sum = u(k) * row_sum(k);
+                if (fixed_col[k] < 0 && sum >= epsilon1) {
+                    residual = std::max(residual, std::abs(sum - 1));
+                }
+            }
+            if (residual < config.sinkhorn_tolerance) {
+                break;
+            }
+        }
+
+        for (int k = 0; k < K; k++) {
+            if (fixed_col[k] < 0 && u(k) * row_sum(k) >= epsilon1) {
+                u(k) = 1.0 / row_sum(k);
+            }
+        }
+
+        // Columns gather from the rows that hold them.
+        col_sum.setConstant(outlier_row);
+        for (int k = 0; k < K; k++) {
+            if (fixed_col[k] >= 0) {
+                continue;
+            }
+            for (int i = M.row_begin[k]; i < M.row_begin[k + 1]; i++) {
+                col_sum(M.cols[i]) += u(k) * M.values[i];
+            }
+        }
+        for (int n = 0; n < N; n++) {
+            if (v(n) * col_sum(n) >= epsilon1) {
+                v(n) = 1.0 / col_sum(n);
+            }
+        }
+
+        iter++;
+    }
+
+    for (int k = 0; k < K; k++) {
+        if (fixed_col[k] >= 0) {
+            continue;
+        }
+        for (int i = M.row_begin[k]; i < M.row_begin[k + 1]; i++) {
+            M.values[i] *= u(k) * v(M.cols[i]);
+        }
+    }
+
+    if (iteration_stats) {
+        iteration_stats->sinkhorn_time += _seconds_since(start);
+        iteration_stats->sinkhorn_iterations += iter;
+    }
+}
+
+bool rpm::estimate_affine_transform(
+        const MatrixXd &X,
+        const MatrixXd &Y,
+        const SparseCorrespondence &M,
+        const double lambda,
+        ThinPlateSplineParams &params,
+        const RpmConfig &config) {
+    try {
+        if (X.cols() != D + 1 || Y.cols() != D + 1) {
+            throw std::invalid_argument("Current only support 3d homogeneou points!");
+        }
+
+        const int K = X.rows(), N = Y.rows();
+        if (M.K != K || M.N != N) {
+            throw std::invalid_argument("Matrix M size not same as X and Y!");
+        }
+
+        // y'_k, as the right hand side of estimate_transform()
+        MatrixXd Yk = M.product(Y);
+#ifdef RPM_USE_BOTHSIDE_OUTLIER_REJECTION
+        const VectorXd row_sums = M.rowSums();
+        for (int k = 0; k < K; k++) {
+            Yk.row(k) /= std::max(row_sums(k), config.epsilon1);
+        }
+        const double lambda_d = N * lambda * 0.01;
+#else
+        const double lambda_d = K * lambda * 0.01;
+#endif // RPM_USE_BOTHSIDE_OUTLIER_REJECTION
+
+        // R' * R = X' * X for the R of params, the normal equations of the d solve with w = 0.
+        Matrix3d A = X.transpose() * X;
+        Matrix3d b = X.transpose() * Yk;
+#ifdef RPM_REGULARIZE_AFFINE_PARAM  // Add regular term lambdaI * d = lambdaI * I
+        A += Matrix3d::Identity() * lambda_d * lambda_d;
+        b += Matrix3d::Identity() * lambda_d * lambda_d;
+#endif // RPM_REGULARIZE_AFFINE_PARAM
+
+        LDLT<Matrix3d> solver(A);
+        if (solver.info() != Eigen::Success) {
+            throw std::runtime_error("Param d ldlt decomposition failed!");
+        }
+        params.d = solver.solve(b);
+        if (solver.info() != Eigen::Success) {
+            throw std::runtime_error("Param d ldlt solve failed!");
+        }
+    }
+    catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+
+        return false;
+    }
+
+    return true;
+}
+
+double rpm::energy(
+        const MatrixXd &XT,
+        const MatrixXd &Y,
+        const SparseCorrespondence &M,
+        const double T,
+        const RpmConfig &config) {
+    if (M.K != XT.rows() || M.N != Y.rows()) {
+        throw std::invalid_argument("Matrix M size not same as X and Y!");
+    }
+
+    double match = 0, entropy = 0, mass = 0;
+    for (int k = 0; k < M.K; k++) {
+        for (int i = M.row_begin[k]; i < M.row_begin[k + 1]; i++) {
+            const double m = M.values[i];
+            if (m > 0) {
+                match += m * (Y.row(M.cols[i]).leftCols(D) - XT.row(k).leftCols(D)).squaredNorm();
+                entropy += m * std::log(m);
+                mass += m;
+            }
+        }
+    }
+    return match + T * entropy - config.alpha * mass;
+}
@@ -0,0 +1,106 @@
+// This file is for the affine-only registration of rpm::estimate, see RpmConfig::affine_only.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include "rpm.h"
+
+namespace rpm {
+    // Uniform grid over 2d points for k nearest neighbour queries. The cell side is chosen for
+    // a few points per cell, so a query near the points costs O(k) on evenly spread points.
+    //
+    // Only the first two columns of the points are used, homogeneous points can be passed as is.
+    class NeighborGrid {
+    public:
+        // Input:
+        //   points		indexed by row
+        //	 excluded	if not empty, rows with a non-zero entry are left out of the grid
+        explicit NeighborGrid(const MatrixXd &points, const vector<char> &excluded = vector<char>());
+
+        // The k nearest points of p as (squared distance, row), closest first. Fewer when the
+        // grid holds fewer than k points.
+        void nearest(const Vector2d &p, const int k, vector<pair<double, int> > &result) const;
+
+        int size() const { return int(point_order.size()); }
+
+    private:
+        MatrixXd points;
+        Vector2d origin;
+        double cell_side = 1;
+        int cells_x = 1, cells_y = 1;
+        // The points of cell (cx, cy) are point_order[cell_begin[c] .. cell_begin[c + 1]), c = cy * cells_x + cx.
+        vector<int> cell_begin, point_order;
+    };
+
+    // Row truncated K * N correspondence in compressed rows: row k holds (cols[i], values[i]) for
+    // i in [row_begin[k], row_begin[k + 1]), every other entry is 0.
+    struct SparseCorrespondence {
+        int K = 0, N = 0;
+        vector<int> row_begin, cols;
+        vector<double> values;
+
+        int nonZeros() const { return int(values.size()); }
+
+        VectorXd rowSums() const;
+
+        // M * Y
+        MatrixXd product(const MatrixXd &Y) const;
+
+        MatrixXd toDense() const;
+    };
+
+    // Correspondence of the transformed source points XT to their neighbors nearest targets of
+    // grid: the affinity exp((alpha - ||y_n - x_k||^2) / T) of those pairs, with the outlier row
+    // and column of estimate_correspondence(), normalized by softassign. O(K * neighbors) per sweep.
+    //
+    // Input:
+    //   XT, Y		transformed source and target points, homogeneous
+    //	 grid		over Y, without the targets of anchors
+    //	 anchors	distinct (k, n) pairs in range, row k gets m_kn = 1 and leaves the softassign
+    // Output:
+    //	 M			normalized correspondence
+    //	 iteration_stats	if not null, stage timings and softassign iterations are added to it
+    //
+    void sparse_correspondence(
+            const MatrixXd &XT,
+            const MatrixXd &Y,
+            const NeighborGrid &grid,
+            const int neighbors,
+            const double T,
+            const vector<pair<int, int> > &anchors,
+            SparseCorrespondence &M,
+            const RpmConfig &config = RpmConfig(),
+            RpmIterationStats *iteration_stats = nullptr
+    );
+
+    // The affine part of estimate_transform() with w held at 0: d minimizes
+    // sum_k ||x_k * d - y'_k||^2 (+ the affine regularization), y'_k the correspondence weighted
+    // target of x_k. Only the 3 * 3 moments X' * X and X' * Y' are formed, O(K + nonzeros of M).
+    //
+    // Input:
+    //   X, Y		source and target points set, homogeneous
+    //	 M			correspondence between X and Y
+    // Output:
+    //	 params		params.d, params.w untouched
+    // Returns true on success, false on failure
+    //
+    bool estimate_affine_transform(
+            const MatrixXd &X,
+            const MatrixXd &Y,
+            const SparseCorrespondence &M,
+            const double lambda,
+            ThinPlateSplineParams &params,
+            const RpmConfig &config = RpmConfig()
+    );
+
+    // TPS-RPM energy of an affine params with a sparse M, see energy().
+    double energy(
+            const MatrixXd &XT,
+            const MatrixXd &Y,
+            const SparseCorrespondence &M,
+            const double T,
+            const RpmConfig &config = RpmConfig());
+}
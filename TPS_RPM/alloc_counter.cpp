@@ -0,0 +1,129 @@
+// This file is for counting heap allocations in instrumented builds.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "alloc_counter.h"
+
+#include <cerrno>
+#include <cstddef>
+
+#if defined(RPM_COUNT_ALLOCATIONS) && defined(__GLIBC__)
+
+#include <atomic>
+#include <malloc.h>
+
+// The executable's definitions interpose the libc ones; operator new and Eigen's
+// aligned_malloc both end up here.
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t num, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *ptr);
+}
+
+namespace {
+    std::atomic<long long> allocations{0};
+    std::atomic<long long> live{0}, peak{0};
+
+    inline void *_allocated(void *ptr) {
+        if (ptr) {
+            const long long size = malloc_usable_size(ptr);
+            const long long bytes = live.fetch_add(size, std::memory_order_relaxed) + size;
+            long long high = peak.load(std::memory_order_relaxed);
+            while (bytes > high && !peak.compare_exchange_weak(high, bytes, std::memory_order_relaxed)) {
+            }
+        }
+        return ptr;
+    }
+
+    inline void _released(void *ptr) {
+        if (ptr) {
+            live.fetch_sub(malloc_usable_size(ptr), std::memory_order_relaxed);
+        }
+    }
+}
+
+extern "C" {
+void *malloc(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return _allocated(__libc_malloc(size));
+}
+
+void *calloc(size_t num, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return _allocated(__libc_calloc(num, size));
+}
+
+void *realloc(void *ptr, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    const long long old_bytes = ptr ? (long long) malloc_usable_size(ptr) : 0;
+    void *result = __libc_realloc(ptr, size);
+    if (result || size == 0) {
+        // Moved, resized or freed, the old block is gone either way.
+        live.fetch_sub(old_bytes, std::memory_order_relaxed);
+    }
+    return _allocated(result);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return _allocated(__libc_memalign(alignment, size));
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return _allocated(__libc_memalign(alignment, size));
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    *ptr = _allocated(__libc_memalign(alignment, size));
+    return *ptr ? 0 : ENOMEM;
+}
+
+void free(void *ptr) {
+    _released(ptr);
+    __libc_free(ptr);
+}
+}
+
+long long rpm::alloc_counter::count() {
+    return allocations.load(std::memory_order_relaxed);
+}
+
+long long rpm::alloc_counter::live_bytes() {
+    return live.load(std::memory_order_relaxed);
+}
+
+long long rpm::alloc_counter::peak_bytes() {
+    return peak.load(std::memory_order_relaxed);
+}
+
+long long rpm::alloc_counter::reset_peak() {
+    const long long bytes = live.load(std::memory_order_relaxed);
+    peak.store(bytes, std::memory_order_relaxed);
+    return bytes;
+}
+
+#else
+
+long long rpm::alloc_counter::count() {
+    return -1;
+}
+
+long long rpm::alloc_counter::live_bytes() {
+    return -1;
+}
+
+long long rpm::alloc_counter::peak_bytes() {
+    return -1;
+}
+
+long long rpm::alloc_counter::reset_peak() {
+    return -1;
+}
+
+#endif
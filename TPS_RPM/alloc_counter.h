@@ -0,0 +1,25 @@
+// This file is for counting heap allocations in instrumented builds.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+namespace rpm {
+    namespace alloc_counter {
+        // Heap allocations made by the whole process so far.
+        // Returns -1 unless built with RPM_COUNT_ALLOCATIONS on glibc, where malloc is wrapped.
+        long long count();
+
+        // Heap bytes in use (malloc_usable_size of the live blocks), -1 unless counted as above.
+        long long live_bytes();
+
+        // Highest live_bytes() since the last reset_peak(), -1 unless counted.
+        long long peak_bytes();
+
+        // Start a new high-water mark at the bytes in use now, returns them (-1 unless counted).
+        // The counts are process wide, allocations of other threads are included.
+        long long reset_peak();
+    }
+}
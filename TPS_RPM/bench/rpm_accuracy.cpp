@@ -0,0 +1,512 @@
+// This file is for checking registration accuracy against known synthetic warps.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+//
+// Usage:
+//   rpm_accuracy [--data-dir DIR] [--format text|csv] [--modes dense,prealign,...]
+//                [--rel-tol R] [--abs-tol A] [--seed S]
+//
+// Every scenario is a data_generate::SyntheticSpec: a source set under a known random
+// affine or TPS warp, with noise, outliers and occlusion added to build the target. Each mode runs
+// rpm::estimate and is scored on:
+//   error      mean distance between the estimated and true warp of the source points,
+//              in the unit box of the source
+//   precision  correct / predicted matches, a match is a row of M whose max exceeds 0.5
+//   recall     correct / ground-truth matches
+//   time       estimate wall-clock seconds
+// The exit code is 1 when any mode's error exceeds rel_tol * error(dense) + abs_tol, except on the
+// scenarios a mode lists as unchecked.
+//
+// The checks of the APIs built on the estimate run on fish_tps and are selected with --modes too:
+//   session    RpmSession against estimate_anytime(), with and without anchors
+//   tracker    RpmTracker frame-to-frame error against its cold first frame
+//   library    TemplateLibrary cache hit against a cold call
+//   planner    reduced centers plan of estimate_planned() against dense on the same centers
+//   downsample point count and mapping of data_process::downsample(), anchored rows kept as centers
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "rpm.h"
+#include "data_process.h"
+#include "tracker.h"
+#include "template_library.h"
+#include "planner.h"
+
+namespace {
+    struct Scenario {
+        string name;
+        data_generate::SyntheticSpec spec;
+    };
+
+    struct Mode {
+        string name;
+        std::function<void(rpm::RpmConfig &)> configure;
+        // Scenarios only reported, a known weakness of the mode rather than a regression.
+        vector<string> unchecked = {};
+        // Only the scenarios under this warp, all when empty.
+        string warp = "";
+    };
+
+    struct Score {
+        bool ok = false;
+        double error = 0, precision = 0, recall = 0, time = 0, quality = 0;
+        int iterations = 0;
+    };
+
+    struct Options {
+        string data_dir = "../data/";
+        string format = "text";
+        vector<string> modes;
+        double rel_tol = 1.5;
+        double abs_tol = 2e-3;
+        uint64_t seed = 2019;
+    };
+
+    // A check of an API built on the estimate, run on the fish_tps scenario after its modes. It fills
+    // score (error is what it measured) and returns whether it passed.
+    struct Check {
+        string name;
+        std::function<bool(const data_generate::SyntheticSet &set, double reference_error, const Options &options,
+                           Score &score)> run;
+    };
+
+    // Modes compared against the reference dense path, which must come first.
+    vector<Mode> _all_modes() {
+        return {
+                {"dense",    [](rpm::RpmConfig &) {}},
+                {"prealign", [](rpm::RpmConfig &config) { config.use_moment_prealign = true; }},
+                {"warm_start", [](rpm::RpmConfig &config) {
+                    config.sinkhorn_warm_start = true;
+                    config.sinkhorn_tolerance = 1e-2;
+                }},
+                {"float",      [](rpm::RpmConfig &config) { config.float_correspondence = true; }},
+                {"matrix_free", [](rpm::RpmConfig &config) { config.matrix_free_correspondence = true; }},
+                // The uniform outlier term of CPD does not hold against a quarter of outliers.
+                {"cpd",        [](rpm::RpmConfig &config) { config.use_cpd = true; }, {"fish_tps_outlier"}},
+                {"affine",     [](rpm::RpmConfig &config) { config.affine_only = true; }, {}, "affine"},
+                {"affine_prealign", [](rpm::RpmConfig &config) { config.use_affine_prealign = true; }},
+        };
+    }
+
+    Scenario _scenario(const string &name, const string &shape, const string &warp, double warp_scale,
+                       double noise, int outliers, int occlusion) {
+        Scenario scenario;
+        scenario.name = name;
+        scenario.spec.shape = shape;
+        scenario.spec.point_num = 80;
+        scenario.spec.warp = warp;
+        scenario.spec.warp_scale = warp_scale;
+        scenario.spec.noise = noise;
+        scenario.spec.outliers = outliers;
+        scenario.spec.occlusion = occlusion;
+        return scenario;
+    }
+
+    // The "fish" shape falls back to a random set when the data file is missing.
+    vector<Scenario> _all_scenarios(const MatrixXd &fish, uint64_t seed) {
+        const string fish_shape = fish.rows() > 0 ? "base" : "random";
+        vector<Scenario> scenarios = {
+                _scenario("fish_affine",           fish_shape, "affine", 0.3, 0.0,   0,  0),
+                _scenario("fish_tps",              fish_shape, "tps",    0.3, 0.0,   0,  0),
+                _scenario("fish_tps_noise",        fish_shape, "tps",    0.3, 0.01,  0,  0),
+                _scenario("fish_tps_outlier",      fish_shape, "tps",    0.3, 0.0,   20, 0),
+                _scenario("fish_tps_occlusion",    fish_shape, "tps",    0.3, 0.0,   0,  15),
+                _scenario("curve_tps_noise",       "curve",    "tps",    0.3, 0.005, 0,  0),
+                _scenario("random_tps_noise_outl", "random",   "tps",    0.2, 0.005, 10, 0),
+        };
+        for (Scenario &scenario : scenarios) {
+            scenario.spec.base = fish;
+            scenario.spec.seed = seed;
+        }
+        return scenarios;
+    }
+
+    // Mean distance between the estimated and the true warp of the source points, in the original
+    // coordinates where the source spans the unit box. params map the frame preprocess_trans gives.
+    double _warp_error(const data_generate::SyntheticSet &set, const Matrix3d &preprocess_trans,
+                       const rpm::ThinPlateSplineParams &params) {
+        const Matrix3d preprocess_trans_inv = preprocess_trans.inverse();
+        double error = 0;
+        for (int k = 0; k < set.X.rows(); k++) {
+            Vector2d x = set.X.row(k).transpose();
+            data_process::apply_transform(x, preprocess_trans);
+            Vector2d xt = params.applyTransform(x, true);
+            data_process::apply_transform(xt, preprocess_trans_inv);
+            error += (xt - set.X_warped.row(k).transpose()).norm();
+        }
+        return error / set.X.rows();
+    }
+
+    Score _run(const data_generate::SyntheticSet &set, const rpm::RpmConfig &config) {
+        const MatrixXd &X = set.X, &Y = set.Y;
+        const vector<int> &truth = set.truth;
+        Score score;
+
+        MatrixXd X_norm = X, Y_norm = Y;
+        const Matrix3d preprocess_trans = data_process::preprocess(X_norm, Y_norm);
+
+        rpm::ThinPlateSplineParams params(X_norm);
+        MatrixXd M;
+        rpm::RpmOutcome outcome;
+
+        auto t1 = std::chrono::steady_clock::now();
+        score.ok = rpm::estimate_anytime(X, Y, M, params, config, rpm::RpmBudget(), outcome);
+        auto t2 = std::chrono::steady_clock::now();
+        score.time = std::chrono::duration<double>(t2 - t1).count();
+        score.iterations = outcome.iterations;
+        score.quality = outcome.quality;
+        if (!score.ok) {
+            return score;
+        }
+
+        score.error = _warp_error(set, preprocess_trans, params);
+
+        // Hard matches from M.
+        int predicted = 0, correct = 0, expected = 0;
+        for (int k = 0; k < X.rows(); k++) {
+            if (truth[k] >= 0) {
+                expected++;
+            }
+            if (M.rows() != X.rows()) {
+                continue;
+            }
+            Eigen::Index n;
+            if (M.row(k).maxCoeff(&n) > 0.5) {
+                predicted++;
+                if (n == truth[k]) {
+                    correct++;
+                }
+            }
+        }
+        score.precision = predicted > 0 ? double(correct) / predicted : 0;
+        score.recall = expected > 0 ? double(correct) / expected : 0;
+
+        return score;
+    }
+
+    // Every tenth source point with its true match.
+    vector<pair<int, int> > _anchors(const data_generate::SyntheticSet &set) {
+        vector<pair<int, int> > anchors;
+        for (int k = 0; k < int(set.truth.size()); k += 10) {
+            if (set.truth[k] >= 0) {
+                anchors.emplace_back(k, set.truth[k]);
+            }
+        }
+        return anchors;
+    }
+
+    // RpmSession gives the estimate_anytime() model, with and without anchors and on consecutive calls.
+    // error is the largest difference of the transformed source or of M.
+    bool _check_session(const data_generate::SyntheticSet &set, double, const Options &, Score &score) {
+        auto t1 = std::chrono::steady_clock::now();
+        rpm::RpmSession session;
+        for (const vector<pair<int, int> > &anchors : {vector<pair<int, int> >(), _anchors(set)}) {
+            const rpm::RpmConfig config;
+            MatrixXd M_reference, M;
+            rpm::ThinPlateSplineParams params_reference(set.X), params(set.X);
+            rpm::RpmOutcome outcome_reference, outcome;
+            if (!rpm::estimate_anytime(set.X, set.Y, M_reference, params_reference, config, rpm::RpmBudget(),
+                                       outcome_reference, anchors)
+                || !session.estimate(set.X, set.Y, M, params, config, rpm::RpmBudget(), outcome, anchors)
+                || outcome.iterations != outcome_reference.iterations) {
+                return false;
+            }
+            score.error = std::max(score.error, (params.applyTransform() - params_reference.applyTransform())
+                    .cwiseAbs().maxCoeff());
+            score.error = std::max(score.error, (M - M_reference).cwiseAbs().maxCoeff());
+            score.iterations += outcome.iterations;
+        }
+        score.time = std::chrono::duration<double>(std::chrono::steady_clock::now() - t1).count();
+        score.ok = true;
+        // The session solves on a TpsSolveBasis, estimate_anytime() densely.
+        return score.error <= 1e-6;
+    }
+
+    // RpmTracker on the target of the scenario turning and drifting over 20 frames. error is the worst
+    // mean distance of the tracked source to its true position, which must stay within the tolerance
+    // of the cold first frame.
+    bool _check_tracker(const data_generate::SyntheticSet &set, double, const Options &options, Score &score) {
+        auto t1 = std::chrono::steady_clock::now();
+        rpm::RpmTracker tracker(set.X);
+        double first_error = 0;
+        for (int f = 0; f < 20; f++) {
+            const double angle = 0.01 * f;
+            Matrix2d rotation;
+            rotation << std::cos(angle), -std::sin(angle), std::sin(angle), std::cos(angle);
+            const RowVector2d shift(0.005 * f, -0.003 * f);
+            const MatrixXd Y = (set.Y * rotation.transpose()).rowwise() + shift;
+            const MatrixXd X_true = (set.X_warped * rotation.transpose()).rowwise() + shift;
+
+            rpm::TrackedFrame frame;
+            if (!tracker.track(Y, frame) || frame.warm != (f > 0)) {
+                return false;
+            }
+            const double error = (frame.XT - X_true).rowwise().norm().mean();
+            if (f == 0) {
+                first_error = error;
+            } else {
+                score.error = std::max(score.error, error);
+            }
+            score.iterations += frame.outcome.iterations;
+        }
+        score.time = std::chrono::duration<double>(std::chrono::steady_clock::now() - t1).count();
+        score.ok = true;
+        return score.error <= options.rel_tol * first_error + options.abs_tol;
+    }
+
+    // A TemplateLibrary estimate on a cached basis gives the one that built it and the one of a library
+    // that never saw the template. error is the largest difference of the transformed source or of M.
+    bool _check_library(const data_generate::SyntheticSet &set, double, const Options &, Score &score) {
+        auto t1 = std::chrono::steady_clock::now();
+        rpm::TemplateLibrary library, cold_library;
+        const int id = library.add(set.X), cold_id = cold_library.add(set.X);
+        rpm::TemplateMatch first, hit, cold;
+        if (!library.estimate(id, set.Y, first) || !library.estimate(id, set.Y, hit)
+            || !cold_library.estimate(cold_id, set.Y, cold) || first.cache_hit || !hit.cache_hit || cold.cache_hit) {
+            return false;
+        }
+        for (const rpm::TemplateMatch *match : {&first, &cold}) {
+            score.error = std::max(score.error, (hit.XT - match->XT).cwiseAbs().maxCoeff());
+            score.error = std::max(score.error, (hit.M - match->M).cwiseAbs().maxCoeff());
+        }
+        score.iterations = hit.outcome.iterations;
+        score.time = std::chrono::duration<double>(std::chrono::steady_clock::now() - t1).count();
+        score.ok = true;
+        // Bit identical on one thread, the scheduler may only reorder sums.
+        return score.error <= 1e-12;
+    }
+
+    // estimate_planned() in half the memory of the dense plan, which only keeps part of the source points
+    // as centers. error is the warp error, which must stay within rel_tol of the dense estimate on the
+    // same centers (no absolute slack, the dense error of all the points is far below it).
+    bool _check_planner(const data_generate::SyntheticSet &set, double, const Options &options, Score &score) {
+        const int K = set.X.rows(), N = set.Y.rows();
+        const size_t memory_limit = rpm::plan_estimate(K, N).peak_bytes / 2;
+
+        MatrixXd X_norm = set.X, Y_norm = set.Y;
+        const Matrix3d preprocess_trans = data_process::preprocess(X_norm, Y_norm);
+        MatrixXd M;
+        rpm::ThinPlateSplineParams params(X_norm);
+        rpm::RpmPlan plan;
+        rpm::RpmOutcome outcome;
+        auto t1 = std::chrono::steady_clock::now();
+        if (!rpm::estimate_planned(set.X, set.Y, M, params, rpm::RpmConfig(), memory_limit, rpm::RpmBudget(), plan,
+                                   outcome) || plan.strategy != rpm::RpmStrategy::reduced_centers
+            || plan.centers >= K || M.rows() != plan.centers) {
+            return false;
+        }
+        score.time = std::chrono::duration<double>(std::chrono::steady_clock::now() - t1).count();
+        score.iterations = outcome.iterations;
+        score.quality = outcome.quality;
+        score.error = _warp_error(set, preprocess_trans, params);
+        score.ok = true;
+
+        // The error the kept centers allow: the dense estimate with only those source points.
+        const MatrixXd X_centers = set.X(plan.center_rows, Eigen::all);
+        MatrixXd X_centers_norm = X_centers, Y_centers_norm = set.Y;
+        const Matrix3d centers_trans = data_process::preprocess(X_centers_norm, Y_centers_norm);
+        rpm::ThinPlateSplineParams params_centers(X_centers_norm);
+        if (!rpm::estimate_anytime(X_centers, set.Y, M, params_centers, rpm::RpmConfig(), rpm::RpmBudget(), outcome)) {
+            return false;
+        }
+        const double centers_error = _warp_error(set, centers_trans, params_centers);
+        return score.error <= options.rel_tol * centers_error;
+    }
+
+    // data_process::downsample() to half the source points with every method, then the reduced centers of
+    // estimate_planned() with anchors. error is the worst relative miss of the requested count, within 10%.
+    // Fails when a kept row does not represent itself or an anchored row is not a center.
+    bool _check_downsample(const data_generate::SyntheticSet &set, double, const Options &, Score &score) {
+        auto t1 = std::chrono::steady_clock::now();
+        const int K = set.X.rows();
+        for (const data_process::SampleMethod method : {data_process::SampleMethod::voxel,
+                                                        data_process::SampleMethod::poisson_disk,
+                                                        data_process::SampleMethod::curvature}) {
+            data_process::SampleOptions sample_options;
+            sample_options.method = method;
+            sample_options.sample_num = K / 2;
+            data_process::SampleMapping mapping;
+            MatrixXd X = set.X;
+            const int kept = data_process::downsample(X, sample_options, &mapping);
+            if (kept != X.rows() || int(mapping.kept.size()) != kept || int(mapping.owner.size()) != K) {
+                return false;
+            }
+            for (int i = 0; i < kept; i++) {
+                if (mapping.owner[mapping.kept[i]] != i || X.row(i) != set.X.row(mapping.kept[i])) {
+                    return false;
+                }
+            }
+            score.error = std::max(score.error, std::abs(kept - sample_options.sample_num)
+                                                / double(sample_options.sample_num));
+        }
+
+        const vector<pair<int, int> > anchors = _anchors(set);
+        const size_t memory_limit = rpm::plan_estimate(K, set.Y.rows()).peak_bytes / 2;
+        MatrixXd M;
+        rpm::ThinPlateSplineParams params(set.X);
+        rpm::RpmPlan plan;
+        rpm::RpmOutcome outcome;
+        if (!rpm::estimate_planned(set.X, set.Y, M, params, rpm::RpmConfig(), memory_limit, rpm::RpmBudget(), plan,
+                                   outcome, anchors) || plan.strategy != rpm::RpmStrategy::reduced_centers) {
+            return false;
+        }
+        for (auto point_pair : anchors) {
+            if (std::find(plan.center_rows.begin(), plan.center_rows.end(), point_pair.first)
+                == plan.center_rows.end()) {
+                return false;
+            }
+        }
+
+        score.time = std::chrono::duration<double>(std::chrono::steady_clock::now() - t1).count();
+        score.ok = true;
+        return score.error <= 0.1;
+    }
+
+    vector<Check> _all_checks() {
+        return {
+                {"session", _check_session},
+                {"tracker", _check_tracker},
+                {"library", _check_library},
+                {"planner", _check_planner},
+                {"downsample", _check_downsample},
+        };
+    }
+
+    void _report(const Options &options, const string &scenario, const string &name, const Score &score,
+                 const bool pass, const bool checked) {
+        if (options.format == "csv") {
+            std::cout << scenario << "," << name << "," << score.ok << "," << score.error << ","
+                      << score.precision << "," << score.recall << "," << score.time << ","
+                      << score.iterations << "," << score.quality << "," << pass << std::endl;
+        } else {
+            std::cout << std::left << std::setw(24) << scenario << std::setw(16) << name
+                      << std::right << std::setw(12) << std::setprecision(4) << score.error
+                      << std::setw(11) << score.precision << std::setw(9) << score.recall
+                      << std::setw(10) << score.time << "  " << (pass ? "ok" : "FAIL")
+                      << (checked ? "" : " (unchecked)") << std::endl;
+        }
+    }
+
+    vector<string> _split(const string &s) {
+        vector<string> items;
+        std::stringstream ss(s);
+        string item;
+        while (std::getline(ss, item, ',')) {
+            if (!item.empty()) {
+                items.push_back(item);
+            }
+        }
+        return items;
+    }
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        const string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--data-dir" && has_value) {
+            options.data_dir = argv[++i];
+            if (!options.data_dir.empty() && options.data_dir.back() != '/') {
+                options.data_dir += '/';
+            }
+        } else if (arg == "--format" && has_value) {
+            options.format = argv[++i];
+        } else if (arg == "--modes" && has_value) {
+            options.modes = _split(argv[++i]);
+        } else if (arg == "--rel-tol" && has_value) {
+            options.rel_tol = std::stod(argv[++i]);
+        } else if (arg == "--abs-tol" && has_value) {
+            options.abs_tol = std::stod(argv[++i]);
+        } else if (arg == "--seed" && has_value) {
+            options.seed = std::stoull(argv[++i]);
+        } else {
+            std::cerr << "usage: rpm_accuracy [--data-dir DIR] [--format text|csv] [--modes dense,prealign,...]"
+                         " [--rel-tol R] [--abs-tol A] [--seed S]" << std::endl;
+            return 2;
+        }
+    }
+
+    vector<Mode> modes;
+    for (const Mode &mode : _all_modes()) {
+        bool selected = options.modes.empty() || mode.name == "dense";
+        for (const string &name : options.modes) {
+            selected = selected || name == mode.name;
+        }
+        if (selected) {
+            modes.push_back(mode);
+        }
+    }
+
+    vector<Check> checks;
+    for (const Check &check : _all_checks()) {
+        bool selected = options.modes.empty();
+        for (const string &name : options.modes) {
+            selected = selected || name == check.name;
+        }
+        if (selected) {
+            checks.push_back(check);
+        }
+    }
+
+    MatrixXd fish;
+    data_generate::load(fish, options.data_dir + "fish_source.txt");
+
+    if (options.format == "csv") {
+        std::cout << "scenario,mode,ok,error,precision,recall,time,iterations,quality,pass" << std::endl;
+    } else {
+        std::cout << std::left << std::setw(24) << "scenario" << std::setw(16) << "mode"
+                  << std::right << std::setw(12) << "error" << std::setw(11) << "precision"
+                  << std::setw(9) << "recall" << std::setw(10) << "time" << "  result" << std::endl;
+    }
+
+    bool all_pass = true;
+    for (const Scenario &scenario : _all_scenarios(fish, options.seed)) {
+        data_generate::SyntheticSet set;
+        if (!data_generate::generate(scenario.spec, set)) {
+            all_pass = false;
+            continue;
+        }
+
+        double reference_error = 0;
+        for (const Mode &mode : modes) {
+            if (!mode.warp.empty() && mode.warp != scenario.spec.warp) {
+                continue;
+            }
+            rpm::RpmConfig config;
+            mode.configure(config);
+            Score score = _run(set, config);
+
+            if (mode.name == "dense") {
+                reference_error = score.error;
+            }
+            const bool pass = score.ok && score.error <= options.rel_tol * reference_error + options.abs_tol;
+            const bool checked = std::find(mode.unchecked.begin(), mode.unchecked.end(), scenario.name)
+                                 == mode.unchecked.end();
+            all_pass = all_pass && (pass || !checked);
+            _report(options, scenario.name, mode.name, score, pass, checked);
+        }
+
+        if (scenario.name != "fish_tps") {
+            continue;
+        }
+        for (const Check &check : checks) {
+            Score score;
+            const bool pass = check.run(set, reference_error, options, score) && score.ok;
+            all_pass = all_pass && pass;
+            _report(options, scenario.name, check.name, score, pass, true);
+        }
+    }
+
+    return all_pass ? 0 : 1;
+}
@@ -0,0 +1,90 @@
+// This file is for checking that RpmSession makes no heap allocation after the first iteration.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+//
+// Usage:
+//   rpm_alloc_check [--points K] [--seed S]
+//
+// Built with EIGEN_RUNTIME_NO_MALLOC and assertions on, so Eigen aborts on any of its allocations
+// inside the session's later iterations, and with RPM_COUNT_ALLOCATIONS, so the allocations of the
+// rest are counted in RpmIterationStats::allocations (glibc only, otherwise they read -1 and only
+// the Eigen assertion checks). Two consecutive estimates run on one session, the exit code is 1
+// when an iteration after the first of either call allocated.
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+
+#include "rpm.h"
+#include "data_process.h"
+
+namespace {
+    // Returns the allocations made after the first iteration, -1 when the estimate failed.
+    long long _later_allocations(rpm::RpmSession &session, const data_generate::SyntheticSet &set,
+                                 const vector<pair<int, int> > &anchors) {
+        rpm::RpmStats stats;
+        rpm::RpmInstrumentation instrumentation;
+        instrumentation.stats = &stats;
+        rpm::RpmConfig config;
+        config.instrumentation = &instrumentation;
+
+        MatrixXd M;
+        rpm::ThinPlateSplineParams params(set.X);
+        rpm::RpmOutcome outcome;
+        if (!session.estimate(set.X, set.Y, M, params, config, rpm::RpmBudget(), outcome, anchors)) {
+            return -1;
+        }
+
+        long long allocations = 0;
+        for (size_t i = 1; i < stats.iterations.size(); i++) {
+            allocations += std::max(stats.iterations[i].allocations, 0LL);
+        }
+        return allocations;
+    }
+}
+
+int main(int argc, char **argv) {
+    data_generate::SyntheticSpec spec;
+    spec.shape = "curve";
+    spec.point_num = 100;
+    spec.warp = "tps";
+    spec.noise = 0.005;
+    spec.seed = 2019;
+    for (int i = 1; i < argc; i++) {
+        const string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--points" && has_value) {
+            spec.point_num = std::stoi(argv[++i]);
+        } else if (arg == "--seed" && has_value) {
+            spec.seed = std::stoull(argv[++i]);
+        } else {
+            std::cerr << "usage: rpm_alloc_check [--points K] [--seed S]" << std::endl;
+            return 2;
+        }
+    }
+
+    data_generate::SyntheticSet set;
+    if (!data_generate::generate(spec, set)) {
+        return 1;
+    }
+    vector<pair<int, int> > anchors;
+    for (int k = 0; k < int(set.truth.size()); k += 10) {
+        if (set.truth[k] >= 0) {
+            anchors.emplace_back(k, set.truth[k]);
+        }
+    }
+
+    // The second call reuses the buffers and the basis of the first, with known matches on top.
+    rpm::RpmSession session;
+    bool pass = true;
+    for (const vector<pair<int, int> > &call_anchors : {vector<pair<int, int> >(), anchors}) {
+        const long long allocations = _later_allocations(session, set, call_anchors);
+        std::cout << "anchors " << call_anchors.size() << ": " << allocations
+                  << " allocations after the first iteration" << std::endl;
+        pass = pass && allocations == 0;
+    }
+
+    return pass ? 0 : 1;
+}
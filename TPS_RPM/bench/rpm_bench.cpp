@@ -0,0 +1,476 @@
+// This file is for benchmarking the TPS-RPM engine stages and end-to-end registrations.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+//
+// Usage:
+//   rpm_bench [--format json|csv] [--data-dir DIR] [--sizes 100,1000,...] [--reps N]
+//             [--max-dense POINTS] [--max-estimate POINTS] [--out FILE] [--trace FILE] [--counters]
+//
+// Stage benchmarks time each engine function in isolation on synthetic sets,
+// end-to-end benchmarks run rpm::estimate on the data files and synthetic sets.
+// Stage sizes above --max-dense are reported as skipped, the dense K * N and K * K
+// matrices would not fit in memory. End-to-end sizes above --max-estimate are
+// skipped as well, a full schedule does hundreds of O(K^3) solves. The CPD backend only
+// needs the dense solves on the source, so above --max-estimate it registers a source of
+// --max-estimate points to the full target. The affine-only registration is O(K + N) per
+// iteration and always runs on the full sets.
+// --trace writes the spans of the whole run as Chrome trace JSON, the stages are only in it
+// when rpm_core is built with RPM_TRACE (see trace.h).
+// --counters adds the hardware counters of each stage of the end-to-end runs to the JSON report,
+// -1 for the events the host does not expose (see perf_counters.h).
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "rpm.h"
+#include "data_process.h"
+#include "parallel.h"
+#include "perf_counters.h"
+#include "trace.h"
+
+namespace {
+    struct BenchResult {
+        string group;    // stage, end_to_end
+        string name;
+        string dataset;
+        int K = 0, N = 0;
+        int reps = 0;
+        double min = 0, median = 0, mean = 0;  // seconds
+        // end_to_end only
+        int iterations = 0, sinkhorn_iterations = 0;
+        double quality = 0;
+        double sinkhorn_time = 0, solve_time = 0, affinity_time = 0, apply_time = 0;
+        // With --counters, indexed by rpm::perf_counters::Stage, of the last rep
+        vector<rpm::perf_counters::Counts> stage_counters;
+        bool ok = true;
+        string note;
+    };
+
+    struct BenchOptions {
+        string format = "json";
+        string data_dir = "../data/";
+        string out;
+        string trace;
+        bool counters = false;
+        vector<int> sizes = {100, 1000, 10000, 100000};
+        int reps = 5;
+        int max_dense = 4000;
+        int max_estimate = 1000;
+    };
+
+    typedef std::chrono::steady_clock Clock;
+
+    void _summarize(vector<double> times, BenchResult &result) {
+        result.reps = times.size();
+        if (times.empty()) {
+            return;
+        }
+        std::sort(times.begin(), times.end());
+        result.min = times.front();
+        result.median = times[times.size() / 2];
+        double sum = 0;
+        for (double t : times) {
+            sum += t;
+        }
+        result.mean = sum / times.size();
+    }
+
+    // Time body() reps times, setup() runs before each rep outside the timing.
+    BenchResult _time(const string &name, const string &dataset, int K, int N, int reps,
+                      const std::function<void()> &setup, const std::function<void()> &body) {
+        BenchResult result;
+        result.group = "stage";
+        result.name = name;
+        result.dataset = dataset;
+        result.K = K;
+        result.N = N;
+
+        vector<double> times;
+        for (int i = 0; i < reps; i++) {
+            if (setup) {
+                setup();
+            }
+            auto t1 = Clock::now();
+            body();
+            auto t2 = Clock::now();
+            times.push_back(std::chrono::duration<double>(t2 - t1).count());
+        }
+        _summarize(times, result);
+        return result;
+    }
+
+    BenchResult _skipped(const string &group, const string &name, const string &dataset, int K, int N,
+                         const string &note) {
+        BenchResult result;
+        result.group = group;
+        result.name = name;
+        result.dataset = dataset;
+        result.K = K;
+        result.N = N;
+        result.ok = false;
+        result.note = note;
+        return result;
+    }
+
+    // Target set: the source under a mild affine warp plus noise, the same for every run.
+    void _synthetic_pair(int n, MatrixXd &X, MatrixXd &Y) {
+        data_generate::SyntheticSpec spec;
+        spec.shape = "random";
+        spec.point_num = n;
+        spec.warp = "affine";
+        spec.warp_scale = 0.2;
+        spec.noise = 0.005;
+        spec.seed = 2019;
+
+        data_generate::SyntheticSet set;
+        data_generate::generate(spec, set);
+        X = set.X;
+        Y = set.Y;
+    }
+
+    // Normalized homogeneous copies, as rpm::estimate sees them.
+    void _normalized(const MatrixXd &X_, const MatrixXd &Y_, MatrixXd &X, MatrixXd &Y) {
+        X = X_;
+        Y = Y_;
+        data_process::preprocess(X, Y);
+        data_process::homo(X);
+        data_process::homo(Y);
+    }
+
+    void _bench_stages(const BenchOptions &options, vector<BenchResult> &results) {
+        for (int n : options.sizes) {
+            const string dataset = "synthetic_" + std::to_string(n);
+            if (n > options.max_dense) {
+                for (const char *name : {"tps_params_ctor", "estimate_correspondence", "estimate_correspondence_float",
+                                         "soft_assign", "estimate_transform", "apply_transform",
+                                         "apply_transform_points", "apply_transform_point"}) {
+                    results.push_back(_skipped("stage", name, dataset, n, n, "exceeds --max-dense"));
+                }
+                continue;
+            }
+
+            MatrixXd X_, Y_, X, Y;
+            _synthetic_pair(n, X_, Y_);
+            _normalized(X_, Y_, X, Y);
+
+            rpm::RpmConfig config;
+            double max_dist = 0, average_dist = 0;
+            rpm::distance_stats(X, Y, max_dist, average_dist);
+            rpm::set_T_start(config, average_dist, 1);
+            const double T = config.T_start * 0.1, lambda = config.lambda_start * 0.1;
+            const vector<pair<int, int> > no_matches;
+
+            rpm::ThinPlateSplineParams params(X);
+            results.push_back(_time("tps_params_ctor", dataset, n, n, options.reps, nullptr, [&] {
+                rpm::ThinPlateSplineParams p(X);
+            }));
+
+            MatrixXd M;
+            results.push_back(_time("estimate_correspondence", dataset, n, n, options.reps, nullptr, [&] {
+                rpm::estimate_correspondence(X, Y, no_matches, params, T, config.T_start, M, config);
+            }));
+
+            MatrixXf M_f;
+            results.push_back(_time("estimate_correspondence_float", dataset, n, n, options.reps, nullptr, [&] {
+                rpm::estimate_correspondence(X, Y, no_matches, params, T, config.T_start, M_f, config);
+            }));
+
+            // Raw affinity with the outlier row and column, normalized in place by each rep.
+            MatrixXd affinity = MatrixXd::Zero(n + 1, n + 1), A;
+            const MatrixXd XT = params.applyTransform();
+            for (int c = 0; c < n; c++) {
+                affinity.col(c).head(n) = ((XT.rowwise() - Y.row(c)).rowwise().squaredNorm().array()
+                                                   * (-1.0 / T) + config.alpha / T).exp().matrix();
+            }
+            affinity.row(n).setConstant(1.0 / (n + 1));
+            affinity.col(n).setConstant(1.0 / (n + 1));
+            results.push_back(_time("soft_assign", dataset, n, n, options.reps, [&] { A = affinity; }, [&] {
+                rpm::soft_assign(A, config);
+            }));
+
+            rpm::ThinPlateSplineParams solved(params);
+            results.push_back(_time("estimate_transform", dataset, n, n, options.reps, nullptr, [&] {
+                rpm::estimate_transform(X, Y, M, lambda, solved, config);
+            }));
+
+            results.push_back(_time("apply_transform", dataset, n, n, options.reps, nullptr, [&] {
+                MatrixXd XT_ = solved.applyTransform();
+            }));
+
+            const MatrixXd P = Y.leftCols(rpm::D);
+            results.push_back(_time("apply_transform_points", dataset, n, n, options.reps, nullptr, [&] {
+                MatrixXd PT = solved.applyTransform(P);
+            }));
+
+            results.push_back(_time("apply_transform_point", dataset, n, n, options.reps, nullptr, [&] {
+                for (int i = 0; i < P.rows(); i++) {
+                    Vector2d p = P.row(i).transpose();
+                    Vector2d pt = solved.applyTransform(p, true);
+                    (void) pt;
+                }
+            }));
+        }
+    }
+
+    BenchResult _bench_estimate(const string &name, const string &dataset, const MatrixXd &X, const MatrixXd &Y,
+                                int reps, const rpm::RpmConfig &config_, bool counters) {
+        BenchResult result;
+        result.group = "end_to_end";
+        result.name = name;
+        result.dataset = dataset;
+        result.K = X.rows();
+        result.N = Y.rows();
+
+        rpm::RpmStats stats;
+        rpm::RpmInstrumentation instrumentation;
+        instrumentation.stats = &stats;
+        instrumentation.hardware_counters = counters;
+        rpm::RpmConfig config = config_;
+        config.instrumentation = &instrumentation;
+
+        vector<double> times;
+        for (int i = 0; i < reps; i++) {
+            MatrixXd M;
+            rpm::ThinPlateSplineParams params(X);
+            rpm::RpmOutcome outcome;
+
+            auto t1 = Clock::now();
+            result.ok = rpm::estimate_anytime(X, Y, M, params, config, rpm::RpmBudget(), outcome);
+            auto t2 = Clock::now();
+            times.push_back(std::chrono::duration<double>(t2 - t1).count());
+
+            result.iterations = outcome.iterations;
+            result.quality = outcome.quality;
+            if (!result.ok) {
+                break;
+            }
+        }
+        _summarize(times, result);
+
+        // Stage breakdown of the last rep.
+        for (const auto &iteration : stats.iterations) {
+            result.apply_time += iteration.apply_time;
+            result.affinity_time += iteration.affinity_time;
+            result.sinkhorn_time += iteration.sinkhorn_time;
+            result.solve_time += iteration.solve_time;
+            result.sinkhorn_iterations += iteration.sinkhorn_iterations;
+        }
+        result.stage_counters = stats.stage_counters;
+        return result;
+    }
+
+    void _bench_end_to_end(const BenchOptions &options, vector<BenchResult> &results) {
+        const bool counters = options.counters;
+        const rpm::RpmConfig config;
+        // Softassign warm-started across temperatures, stopping once the row sums are within 1%.
+        rpm::RpmConfig warm_config;
+        warm_config.sinkhorn_warm_start = true;
+        warm_config.sinkhorn_tolerance = 1e-2;
+        // Coherent point drift EM, fast Gauss transform E-steps.
+        rpm::RpmConfig cpd_config;
+        cpd_config.use_cpd = true;
+        // Softassign on the tiled affinity, M is never stored.
+        rpm::RpmConfig matrix_free_config;
+        matrix_free_config.matrix_free_correspondence = true;
+        // Affine only, truncated sparse correspondence.
+        rpm::RpmConfig affine_config;
+        affine_config.affine_only = true;
+
+        for (const char *name : {"fish", "fish_outlier", "fish2", "fish2_outlier", "curve", "curve_outlier"}) {
+            MatrixXd X, Y;
+            if (!data_generate::load(X, options.data_dir + name + "_source.txt")
+                || !data_generate::load(Y, options.data_dir + name + "_target.txt")) {
+                results.push_back(_skipped("end_to_end", "estimate", name, 0, 0, "data file missing"));
+                continue;
+            }
+            results.push_back(_bench_estimate("estimate", name, X, Y, options.reps, config, counters));
+            results.push_back(_bench_estimate("estimate_warm_sinkhorn", name, X, Y, options.reps, warm_config,
+                                              counters));
+            results.push_back(_bench_estimate("estimate_matrix_free", name, X, Y, options.reps, matrix_free_config,
+                                              counters));
+            results.push_back(_bench_estimate("estimate_cpd", name, X, Y, options.reps, cpd_config, counters));
+            results.push_back(_bench_estimate("estimate_affine", name, X, Y, options.reps, affine_config, counters));
+        }
+
+        for (int n : options.sizes) {
+            const string dataset = "synthetic_" + std::to_string(n);
+            MatrixXd X, Y;
+            _synthetic_pair(n, X, Y);
+            if (n > options.max_estimate) {
+                results.push_back(_skipped("end_to_end", "estimate", dataset, n, n, "exceeds --max-estimate"));
+
+                rpm::RpmConfig large_config = cpd_config;
+                large_config.output_correspondence = false;
+                const MatrixXd X_source = X.topRows(options.max_estimate);
+                results.push_back(_bench_estimate("estimate_cpd", dataset, X_source, Y, 1, large_config, counters));
+
+                rpm::RpmConfig large_affine_config = affine_config;
+                large_affine_config.output_correspondence = false;
+                results.push_back(_bench_estimate("estimate_affine", dataset, X, Y, 1, large_affine_config,
+                                                  counters));
+                continue;
+            }
+
+            results.push_back(_bench_estimate("estimate", dataset, X, Y, std::max(1, options.reps / 5), config,
+                                              counters));
+            results.push_back(_bench_estimate("estimate_warm_sinkhorn", dataset, X, Y, std::max(1, options.reps / 5),
+                                              warm_config, counters));
+            results.push_back(_bench_estimate("estimate_matrix_free", dataset, X, Y, std::max(1, options.reps / 5),
+                                              matrix_free_config, counters));
+            results.push_back(_bench_estimate("estimate_cpd", dataset, X, Y, std::max(1, options.reps / 5), cpd_config,
+                                              counters));
+            results.push_back(_bench_estimate("estimate_affine", dataset, X, Y, std::max(1, options.reps / 5),
+                                              affine_config, counters));
+        }
+    }
+
+    string _escape(const string &s) {
+        string out;
+        for (char c : s) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+            }
+            out += c;
+        }
+        return out;
+    }
+
+    void _write_json(std::ostream &os, const vector<BenchResult> &results) {
+        os << "{\n  \"threads\": " << rpm::parallel::num_threads() << ",\n  \"benchmarks\": [\n";
+        for (size_t i = 0; i < results.size(); i++) {
+            const BenchResult &r = results[i];
+            os << "    {\"group\": \"" << r.group << "\", \"name\": \"" << r.name
+               << "\", \"dataset\": \"" << _escape(r.dataset) << "\", \"K\": " << r.K << ", \"N\": " << r.N
+               << ", \"ok\": " << (r.ok ? "true" : "false") << ", \"reps\": " << r.reps
+               << ", \"min\": " << r.min << ", \"median\": " << r.median << ", \"mean\": " << r.mean;
+            if (r.group == "end_to_end") {
+                os << ", \"iterations\": " << r.iterations << ", \"sinkhorn_iterations\": " << r.sinkhorn_iterations
+                   << ", \"quality\": " << r.quality
+                   << ", \"apply_time\": " << r.apply_time << ", \"affinity_time\": " << r.affinity_time
+                   << ", \"sinkhorn_time\": " << r.sinkhorn_time << ", \"solve_time\": " << r.solve_time;
+            }
+            if (!r.stage_counters.empty()) {
+                os << ", \"counters\": {";
+                for (int s = 0; s < int(r.stage_counters.size()); s++) {
+                    const rpm::perf_counters::Counts &c = r.stage_counters[s];
+                    os << (s ? ", " : "") << "\"" << rpm::perf_counters::to_string(rpm::perf_counters::Stage(s))
+                       << "\": {\"calls\": " << c.calls << ", \"cycles\": " << c.cycles
+                       << ", \"instructions\": " << c.instructions << ", \"llc_misses\": " << c.llc_misses
+                       << ", \"branch_misses\": " << c.branch_misses << ", \"ipc\": " << c.ipc()
+                       << ", \"llc_mpki\": " << c.llc_mpki() << ", \"branch_mpki\": " << c.branch_mpki() << "}";
+                }
+                os << "}";
+            }
+            os << ", \"note\": \"" << _escape(r.note) << "\"}" << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        os << "  ]\n}\n";
+    }
+
+    void _write_csv(std::ostream &os, const vector<BenchResult> &results) {
+        os << "group,name,dataset,K,N,ok,reps,min,median,mean,iterations,sinkhorn_iterations,quality,"
+              "apply_time,affinity_time,sinkhorn_time,solve_time,note\n";
+        for (const BenchResult &r : results) {
+            os << r.group << "," << r.name << "," << r.dataset << "," << r.K << "," << r.N << ","
+               << (r.ok ? 1 : 0) << "," << r.reps << "," << r.min << "," << r.median << "," << r.mean << ","
+               << r.iterations << "," << r.sinkhorn_iterations << "," << r.quality << "," << r.apply_time << "," << r.affinity_time << ","
+               << r.sinkhorn_time << "," << r.solve_time << "," << r.note << "\n";
+        }
+    }
+
+    vector<int> _parse_sizes(const string &s) {
+        vector<int> sizes;
+        std::stringstream ss(s);
+        string item;
+        while (std::getline(ss, item, ',')) {
+            if (!item.empty()) {
+                sizes.push_back(std::stoi(item));
+            }
+        }
+        return sizes;
+    }
+}
+
+int main(int argc, char **argv) {
+    BenchOptions options;
+    for (int i = 1; i < argc; i++) {
+        const string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--format" && has_value) {
+            options.format = argv[++i];
+        } else if (arg == "--data-dir" && has_value) {
+            options.data_dir = argv[++i];
+            if (!options.data_dir.empty() && options.data_dir.back() != '/') {
+                options.data_dir += '/';
+            }
+        } else if (arg == "--sizes" && has_value) {
+            options.sizes = _parse_sizes(argv[++i]);
+        } else if (arg == "--reps" && has_value) {
+            options.reps = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--max-dense" && has_value) {
+            options.max_dense = std::stoi(argv[++i]);
+        } else if (arg == "--max-estimate" && has_value) {
+            options.max_estimate = std::stoi(argv[++i]);
+        } else if (arg == "--out" && has_value) {
+            options.out = argv[++i];
+        } else if (arg == "--trace" && has_value) {
+            options.trace = argv[++i];
+        } else if (arg == "--counters") {
+            options.counters = true;
+        } else {
+            std::cerr << "usage: rpm_bench [--format json|csv] [--data-dir DIR] [--sizes 100,1000,...]"
+                         " [--reps N] [--max-dense POINTS] [--max-estimate POINTS] [--out FILE] [--trace FILE]"
+                         " [--counters]"
+                      << std::endl;
+            return 2;
+        }
+    }
+
+    if (!options.trace.empty()) {
+        rpm::trace::start();
+    }
+
+    if (options.counters && !rpm::perf_counters::available()) {
+        std::cerr << "hardware counters are not available, the counts are -1" << std::endl;
+    }
+
+    vector<BenchResult> results;
+    _bench_stages(options, results);
+    _bench_end_to_end(options, results);
+
+    if (!options.trace.empty()) {
+        rpm::trace::stop();
+        if (!rpm::trace::instrumented()) {
+            std::cerr << "rpm_core built without RPM_TRACE, the trace holds no stages" << std::endl;
+        }
+        if (!rpm::trace::save_chrome_json(options.trace)) {
+            std::cerr << "can not open file : " << options.trace << std::endl;
+            return 1;
+        }
+    }
+
+    std::ofstream file;
+    if (!options.out.empty()) {
+        file.open(options.out);
+        if (!file.is_open()) {
+            std::cerr << "can not open file : " << options.out << std::endl;
+            return 1;
+        }
+    }
+    std::ostream &os = options.out.empty() ? std::cout : file;
+
+    if (options.format == "csv") {
+        _write_csv(os, results);
+    } else {
+        _write_json(os, results);
+    }
+
+    return 0;
+}
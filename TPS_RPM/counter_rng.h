@@ -0,0 +1,55 @@
+// This file is for the counter-based random number generator used by the data generators.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+namespace rpm {
+    // Stateless generator, every value is a hash of (seed, stream, counter).
+    //
+    // Kernels draw the values of element i from counter i, so the output does not depend
+    // on the number of threads or on the order the elements are visited in. Different
+    // streams of the same seed are independent.
+    class CounterRng {
+    public:
+        explicit CounterRng(uint64_t seed, uint64_t stream = 0)
+                : key(_mix(_mix(seed) ^ (stream * 0xd1b54a32d192ed03ULL))) {}
+
+        uint64_t bits(uint64_t counter) const {
+            return _mix(key ^ _mix(counter));
+        }
+
+        // Uniform in [0, 1).
+        double uniform(uint64_t counter) const {
+            return (bits(counter) >> 11) * (1.0 / 9007199254740992.0);
+        }
+
+        double uniform(uint64_t counter, double a, double b) const {
+            return a + (b - a) * uniform(counter);
+        }
+
+        // Box-Muller, both uniforms come from the one counter.
+        double normal(uint64_t counter, double mu = 0, double sigma = 1) const {
+            const uint64_t b = bits(counter);
+            const double u1 = 1.0 - (b >> 11) * (1.0 / 9007199254740992.0);
+            const double u2 = (_mix(b) >> 11) * (1.0 / 9007199254740992.0);
+            return mu + sigma * std::sqrt(-2.0 * std::log(u1)) * std::cos(6.283185307179586 * u2);
+        }
+
+    private:
+        // splitmix64 finalizer.
+        static uint64_t _mix(uint64_t z) {
+            z += 0x9e3779b97f4a7c15ULL;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            return z ^ (z >> 31);
+        }
+
+        uint64_t key;
+    };
+}
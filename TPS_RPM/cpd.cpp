@@ -0,0 +1,94 @@
+// This file is for the coherent point drift posterior of the EM backend of rpm::estimate.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "cpd.h"
+
+#include <cmath>
+#include <limits>
+
+#include "gauss_transform.h"
+#include "parallel.h"
+
+namespace {
+    inline double _outlier_constant(const int K, const int N, const double sigma2, const double w) {
+        return std::pow(2 * M_PI * sigma2, rpm::D / 2.0) * w / (1 - w) * K / N;
+    }
+
+    void _check(const MatrixXd &XT, const MatrixXd &Y, const double sigma2, const double w) {
+        if (XT.cols() != rpm::D + 1 || Y.cols() != rpm::D + 1) {
+            throw std::invalid_argument("Current only support 3d homogeneou points!");
+        }
+        if (XT.rows() == 0 || Y.rows() == 0 || !(sigma2 > 0) || !(w >= 0 && w < 1)) {
+            throw std::invalid_argument("cpd needs non-empty points, sigma2 > 0 and w in [0, 1)!");
+        }
+    }
+}
+
+void rpm::cpd_posterior(const MatrixXd &XT, const MatrixXd &Y, const double sigma2, const double w,
+                        const double epsilon, CpdPosterior &posterior) {
+    _check(XT, Y, sigma2, w);
+
+    const int K = XT.rows(), N = Y.rows();
+    const double h = std::sqrt(2 * sigma2);
+    const double c = _outlier_constant(K, N, sigma2, w);
+
+    // Denominators: sum over the sources X of each y_n.
+    MatrixXd g;
+    GaussTransform(XT, h, epsilon).evaluate(MatrixXd::Ones(K, 1), Y, g);
+
+    VectorXd inv_den(N);
+    posterior.Pt1.resize(N);
+    posterior.negative_log_likelihood = N * D / 2.0 * std::log(sigma2);
+    for (int n = 0; n < N; n++) {
+        const double g_n = std::max(g(n, 0), 0.0);
+        const double den = g_n + c;
+        inv_den(n) = den > 0 ? 1 / den : 0;
+        posterior.Pt1(n) = g_n * inv_den(n);
+        posterior.negative_log_likelihood -= std::log(std::max(den, std::numeric_limits<double>::min()));
+    }
+
+    // P * [1, y] in one pass over the sources Y.
+    MatrixXd weights(N, D + 1);
+    weights.col(0) = inv_den;
+    for (int d = 0; d < D; d++) {
+        weights.col(d + 1) = Y.col(d).cwiseProduct(inv_den);
+    }
+    MatrixXd sums;
+    GaussTransform(Y, h, epsilon).evaluate(weights, XT, sums);
+
+    posterior.P1 = sums.col(0).cwiseMax(0.0);
+    posterior.PY.resize(K, D + 1);
+    posterior.PY.leftCols(D) = sums.rightCols(D);
+    posterior.PY.col(D) = posterior.P1;
+    posterior.Np = posterior.P1.sum();
+}
+
+void rpm::cpd_correspondence(const MatrixXd &XT, const MatrixXd &Y, const double sigma2, const double w,
+                             MatrixXd &P) {
+    _check(XT, Y, sigma2, w);
+
+    const int K = XT.rows(), N = Y.rows();
+    const double c = _outlier_constant(K, N, sigma2, w);
+    P.resize(K, N);
+    parallel::parallel_for(0, N, parallel::grain_for(K * 8), [&](int begin, int end) {
+        for (int n = begin; n < end; n++) {
+            P.col(n) = (-(XT.leftCols(D).rowwise() - Y.row(n).leftCols(D)).rowwise().squaredNorm()
+                    / (2 * sigma2)).array().exp().matrix();
+            P.col(n) /= P.col(n).sum() + c;
+        }
+    });
+}
+
+double rpm::cpd_sigma2(const MatrixXd &XT, const MatrixXd &Y, const CpdPosterior &posterior) {
+    if (!(posterior.Np > 0)) {
+        return 0;
+    }
+
+    const double yy = posterior.Pt1.dot(Y.leftCols(D).rowwise().squaredNorm());
+    const double xx = posterior.P1.dot(XT.leftCols(D).rowwise().squaredNorm());
+    const double xy = XT.leftCols(D).cwiseProduct(posterior.PY.leftCols(D)).sum();
+    return std::max(yy - 2 * xy + xx, 0.0) / (posterior.Np * D);
+}
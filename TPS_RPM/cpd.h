@@ -0,0 +1,44 @@
+// This file is for the coherent point drift posterior of the EM backend of rpm::estimate.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include "rpm.h"
+
+namespace rpm {
+    // Sums of the K * N CPD posterior
+    //   P(k, n) = exp(-||y_n - x_k||^2 / (2 sigma2)) / (sum_k' exp(-||y_n - x_k'||^2 / (2 sigma2)) + c),
+    //   c = (2 pi sigma2)^(D / 2) * w / (1 - w) * K / N,
+    // the Gaussian mixture of the transformed X with a uniform outlier component of weight w.
+    struct CpdPosterior {
+        VectorXd P1;   // P * 1, K
+        VectorXd Pt1;  // P' * 1, N
+        MatrixXd PY;   // P * Y, K * (D + 1), the homogeneous column is P1
+        double Np = 0; // sum of P
+        // -sum_n log(denominator_n) + N * D / 2 * log(sigma2), the EM objective up to a constant
+        double negative_log_likelihood = 0;
+    };
+
+    // E-step with two GaussTransform passes, P itself is never formed.
+    //
+    // Input:
+    //   XT, Y		transformed source and target points, homogeneous
+    //	 sigma2		variance of the mixture components
+    //	 w			outlier weight in [0, 1)
+    //	 epsilon	accuracy of the Gauss transforms
+    // Output:
+    //	 posterior	sums of P
+    //
+    void cpd_posterior(const MatrixXd &XT, const MatrixXd &Y, const double sigma2, const double w,
+                       const double epsilon, CpdPosterior &posterior);
+
+    // The dense K * N posterior, O(K * N).
+    void cpd_correspondence(const MatrixXd &XT, const MatrixXd &Y, const double sigma2, const double w,
+                            MatrixXd &P);
+
+    // M-step variance: sum P(k, n) ||y_n - x_k||^2 / (Np * D) from the sums of P.
+    double cpd_sigma2(const MatrixXd &XT, const MatrixXd &Y, const CpdPosterior &posterior);
+}
@@ -0,0 +1,678 @@
+// This file is for data processing and generating.
+//
+// Copyright (C) 2019 Yang Zhenjie <amazingzhen@foxmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "data_process.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <fstream>
+#include <limits>
+#include <unordered_map>
+
+#include "counter_rng.h"
+#include "parallel.h"
+
+namespace {
+    // Streams of rpm::CounterRng, one per kind of draw so a shared seed does not correlate them.
+    enum RandomStream {
+        STREAM_POINTS = 1,
+        STREAM_NOISE,
+        STREAM_OUTLIER,
+        STREAM_SHAPE,
+        STREAM_WARP,
+        STREAM_OCCLUSION,
+    };
+
+    // Fill X with fn(i, d), one point per index, in parallel.
+    template<typename Fn>
+    void _fill_points(MatrixXd &X, int work_per_point, const Fn &fn) {
+        rpm::parallel::parallel_for(0, int(X.rows()), rpm::parallel::grain_for(work_per_point),
+                                    [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                for (int d = 0; d < rpm::D; d++) {
+                    X(i, d) = fn(i, d);
+                }
+            }
+        });
+    }
+
+    MatrixXd _generate_shape(const data_generate::SyntheticSpec &spec) {
+        const int n = spec.point_num;
+        const rpm::CounterRng rng(spec.seed, STREAM_SHAPE);
+        MatrixXd X(n, rpm::D);
+
+        if (spec.shape == "base") {
+            X = spec.base;
+        } else if (spec.shape == "random") {
+            X = data_generate::generate_random_points(n, 0, 1, spec.seed);
+        } else if (spec.shape == "curve") {
+            // Closed wavy curve, points in order along it with a little jitter.
+            const double phase = 6.283185307179586 * rng.uniform(0);
+            _fill_points(X, 64, [&](int i, int d) {
+                const double t = 6.283185307179586 * (i + 0.5 * rng.uniform(i + 1)) / n;
+                const double r = 0.35 * (1 + 0.3 * sin(3 * t + phase));
+                return 0.5 + r * (d == 0 ? cos(t) : sin(t));
+            });
+        } else if (spec.shape == "grid") {
+            const int side = std::max(1, int(ceil(sqrt(double(n)))));
+            _fill_points(X, 8, [&](int i, int d) {
+                return (d == 0 ? i % side : i / side) / double(std::max(side - 1, 1));
+            });
+        } else {
+            throw std::invalid_argument("unknown synthetic shape : " + spec.shape);
+        }
+
+        if (X.rows() == 0 || X.cols() != rpm::D) {
+            throw std::invalid_argument("synthetic shape has no 2d points");
+        }
+
+        // Scale into the unit box.
+        MatrixXd X_copy = X;
+        data_process::preprocess(X, X_copy);
+        return X;
+    }
+
+    // Random affine warp, plus a TPS through a few source points whose non-affine
+    // coefficients lie in the null space of the controls.
+    rpm::ThinPlateSplineParams _generate_warp(const data_generate::SyntheticSpec &spec, const MatrixXd &X) {
+        const rpm::CounterRng rng(spec.seed, STREAM_WARP);
+        const double s = spec.warp_scale;
+        uint64_t counter = 0;
+
+        const bool tps = spec.warp == "tps";
+        const int controls_num = tps ? std::max(spec.warp_controls, rpm::D + 2) : rpm::D + 1;
+        MatrixXd C(controls_num, rpm::D);
+        for (int i = 0; i < controls_num; i++) {
+            const int row = std::min(int(rng.bits(counter++) % X.rows()), int(X.rows()) - 1);
+            // Jitter keeps duplicated picks apart.
+            C(i, 0) = X(row, 0) + rng.normal(counter++, 0, 1e-3);
+            C(i, 1) = X(row, 1) + rng.normal(counter++, 0, 1e-3);
+        }
+
+        rpm::ThinPlateSplineParams params(C);
+        if (spec.warp == "none") {
+            return params;
+        }
+        if (spec.warp != "affine" && !tps) {
+            throw std::invalid_argument("unknown synthetic warp : " + spec.warp);
+        }
+
+        // XT = X * d
+        params.d = MatrixXd::Identity(rpm::D + 1, rpm::D + 1);
+        for (int r = 0; r < rpm::D + 1; r++) {
+            for (int c = 0; c < rpm::D; c++) {
+                params.d(r, c) += 0.5 * s * rng.uniform(counter++, -1, 1);
+            }
+        }
+
+        if (tps) {
+            MatrixXd C_homo = C;
+            data_process::homo(C_homo);
+            HouseholderQR<MatrixXd> qr(C_homo);
+            MatrixXd Q = qr.householderQ();
+
+            MatrixXd gamma(controls_num - rpm::D - 1, rpm::D + 1);
+            gamma.setZero();
+            for (int r = 0; r < gamma.rows(); r++) {
+                for (int c = 0; c < rpm::D; c++) {
+                    gamma(r, c) = s * rng.uniform(counter++, -1, 1);
+                }
+            }
+            params.w = Q.rightCols(gamma.rows()) * gamma;
+        }
+
+        return params;
+    }
+}
+
+MatrixXd data_generate::generate_random_points(const int point_num, const double range_min, const double range_max,
+                                               const uint64_t seed) {
+    const rpm::CounterRng rng(seed, STREAM_POINTS);
+
+    MatrixXd X(point_num, rpm::D);
+    _fill_points(X, 32, [&](int i, int d) {
+        return rng.uniform(uint64_t(i) * rpm::D + d, range_min, range_max);
+    });
+
+    return X;
+}
+
+MatrixXd data_generate::add_gaussian_noise(const MatrixXd &X, const double mu, const double sigma,
+                                           const uint64_t seed) {
+    const rpm::CounterRng rng(seed, STREAM_NOISE);
+
+    MatrixXd Y = X;
+    _fill_points(Y, 64, [&](int i, int d) {
+        return X(i, d) + rng.normal(uint64_t(i) * rpm::D + d, mu, sigma);
+    });
+
+    return Y;
+}
+
+bool data_generate::load(MatrixXd &X, const string &filename) {
+    try {
+        std::ifstream f(filename);
+        if (!f.is_open()) {
+            throw std::runtime_error("can not open file : " + filename);
+        }
+
+        std::vector<Eigen::Vector2d> points;
+        while (!f.eof()) {
+            Vector2d p;
+            f >> p.x() >> p.y();
+            points.push_back(p);
+        }
+        f.close();
+        //cout << points.size() << endl;
+
+        X = MatrixXd(points.size(), 2);
+        for (int i = 0; i < int(points.size()); i++) {
+            X.row(i) = points[i];
+        }
+
+        return true;
+    }
+    catch (std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return false;
+    }
+}
+
+void data_generate::save(const Eigen::MatrixXd &X, const string &filename) {
+    std::ofstream f(filename);
+    if (!f.is_open()) {
+        throw std::runtime_error("can not open file : " + filename);
+    }
+    cout << "Save : " << filename << endl;
+
+    for (int i = 0; i < X.rows(); i++) {
+        const Vector2d &p = X.row(i);
+        f << p.x() << " " << p.y();
+        if (i != X.rows() - 1) {
+            f << endl;
+        }
+    }
+    f.close();
+}
+
+void data_generate::add_outlier(Eigen::MatrixXd &X, const int num, const uint64_t seed) {
+    if (X.cols() != rpm::D || num <= 0) {
+        return;
+    }
+
+    const RowVector2d min_p = X.colwise().minCoeff();
+    const RowVector2d max_p = X.colwise().maxCoeff();
+    const rpm::CounterRng rng(seed, STREAM_OUTLIER);
+
+    const int rows = X.rows();
+    X.conservativeResize(rows + num, Eigen::NoChange);
+
+    MatrixXd outliers(num, rpm::D);
+    _fill_points(outliers, 32, [&](int i, int d) {
+        return rng.uniform(uint64_t(i) * rpm::D + d, min_p[d], max_p[d]);
+    });
+    X.bottomRows(num) = outliers;
+}
+
+bool data_generate::generate(const SyntheticSpec &spec, SyntheticSet &set) {
+    try {
+        set.X = _generate_shape(spec);
+        const int K = set.X.rows();
+
+        const rpm::ThinPlateSplineParams warp = _generate_warp(spec, set.X);
+        set.X_warped = warp.applyTransform(set.X, true);
+
+        MatrixXd Y = set.X_warped;
+        if (spec.noise > 0) {
+            Y = add_gaussian_noise(Y, 0, spec.noise, spec.seed);
+        }
+
+        // Occlude the target points nearest to a random source point.
+        vector<char> occluded(K, 0);
+        const int occlusion = std::min(std::max(spec.occlusion, 0), K - 1);
+        if (occlusion > 0) {
+            const rpm::CounterRng rng(spec.seed, STREAM_OCCLUSION);
+            const RowVector2d center = set.X_warped.row(rng.bits(0) % K);
+
+            vector<pair<double, int> > dist(K);
+            for (int k = 0; k < K; k++) {
+                dist[k] = make_pair((set.X_warped.row(k) - center).squaredNorm(), k);
+            }
+            std::nth_element(dist.begin(), dist.begin() + occlusion, dist.end());
+            for (int i = 0; i < occlusion; i++) {
+                occluded[dist[i].second] = 1;
+            }
+        }
+
+        set.truth.assign(K, -1);
+        set.Y.resize(K - occlusion, rpm::D);
+        for (int k = 0, n = 0; k < K; k++) {
+            if (!occluded[k]) {
+                set.Y.row(n) = Y.row(k);
+                set.truth[k] = n++;
+            }
+        }
+
+        add_outlier(set.Y, spec.outliers, spec.seed);
+
+        return true;
+    }
+    catch (std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return false;
+    }
+}
+
+void data_process::sample(MatrixXd &X, int sample_num) {
+    if (X.rows() < sample_num) {
+        return;
+    }
+
+    int interval = ceil(X.rows() / (double) sample_num);
+    MatrixXd X_(sample_num, X.cols());
+
+    int count = 0;
+    for (int x_i = 0; x_i < X.rows(); x_i += interval) {
+        X_.row(count) = X.row(x_i);
+        count++;
+    }
+    X_.conservativeResize(count, X_.cols());
+    X = X_;
+}
+
+namespace {
+    // Spatial hash of 2d points in square cells, each cell a linked list of point indices.
+    class _CellHash {
+    public:
+        _CellHash(const Vector2d &origin, const double side, const int n) : origin(origin), side(side), next(n, -1) {
+            head.reserve(n);
+        }
+
+        void insert(const Vector2d &p, const int i) {
+            auto it = head.emplace(key_of(p, 0, 0), -1).first;
+            next[i] = it->second;
+            it->second = i;
+        }
+
+        // fn(i) for the points of the 3 * 3 cells around p, all the points within side of p.
+        template<typename Fn>
+        void for_near(const Vector2d &p, const Fn &fn) const {
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    auto it = head.find(key_of(p, dx, dy));
+                    if (it == head.end()) {
+                        continue;
+                    }
+                    for (int i = it->second; i >= 0; i = next[i]) {
+                        fn(i);
+                    }
+                }
+            }
+        }
+
+        // Floored cells packed as two unsigned halves, the cells left of and below the origin (the -1
+        // neighbours of the first row and column) neither shift a negative value nor merge with cell 0.
+        std::int64_t key_of(const Vector2d &p, const int dx, const int dy) const {
+            const int cx = int(std::floor((p(0) - origin(0)) / side)) + dx;
+            const int cy = int(std::floor((p(1) - origin(1)) / side)) + dy;
+            return std::int64_t((std::uint64_t(std::uint32_t(cx)) << 32) | std::uint32_t(cy));
+        }
+
+    private:
+        Vector2d origin;
+        double side;
+        std::unordered_map<std::int64_t, int> head;
+        std::vector<int> next;
+    };
+
+    // owner[i] = the point of the cell of i nearest the cell centroid.
+    void _voxel_sample(const MatrixXd &P, const Vector2d &origin, const double side, std::vector<int> &owner) {
+        const int n = P.rows();
+        const _CellHash cells(origin, side, 0);
+        std::unordered_map<std::int64_t, int> slot_of;
+        slot_of.reserve(n);
+        std::vector<int> slot(n);
+        std::vector<Vector2d> sums;
+        std::vector<int> counts;
+        for (int i = 0; i < n; i++) {
+            const Vector2d p = P.row(i).transpose();
+            auto it = slot_of.emplace(cells.key_of(p, 0, 0), int(sums.size())).first;
+            if (it->second == int(sums.size())) {
+                sums.push_back(Vector2d::Zero());
+                counts.push_back(0);
+            }
+            slot[i] = it->second;
+            sums[slot[i]] += p;
+            counts[slot[i]]++;
+        }
+
+        std::vector<int> representative(sums.size(), -1);
+        std::vector<double> best(sums.size(), std::numeric_limits<double>::infinity());
+        for (int i = 0; i < n; i++) {
+            const int s = slot[i];
+            const double dist = (P.row(i).transpose() - sums[s] / counts[s]).squaredNorm();
+            if (dist < best[s]) {
+                best[s] = dist;
+                representative[s] = i;
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            owner[i] = representative[slot[i]];
+        }
+    }
+
+    // Visit the points in order, keep a point when no kept point lies within its radius.
+    // owner[i] = the kept point nearest i.
+    void _poisson_sample(const MatrixXd &P, const Vector2d &origin, const double radius, const VectorXd &radii,
+                         const std::vector<int> &order, std::vector<int> &owner) {
+        const int n = P.rows();
+        _CellHash kept(origin, radius, n);
+        for (int i : order) {
+            const Vector2d p = P.row(i).transpose();
+            const double r = radii.size() ? radii(i) : radius;
+            bool free = true;
+            kept.for_near(p, [&](int j) {
+                free = free && (P.row(j).transpose() - p).squaredNorm() >= r * r;
+            });
+            owner[i] = free ? i : -1;
+            if (free) {
+                kept.insert(p, i);
+            }
+        }
+
+        // A dropped point has a kept one within its radius, so within the 3 * 3 cells.
+        for (int i = 0; i < n; i++) {
+            if (owner[i] == i) {
+                continue;
+            }
+            const Vector2d p = P.row(i).transpose();
+            double best = std::numeric_limits<double>::infinity();
+            kept.for_near(p, [&](int j) {
+                const double dist = (P.row(j).transpose() - p).squaredNorm();
+                if (dist < best) {
+                    best = dist;
+                    owner[i] = j;
+                }
+            });
+        }
+    }
+
+    // Surface variation l_min / (l_min + l_max) of the covariance of the points within radius,
+    // 0 on a straight line, 0.5 for an isotropic neighbourhood.
+    VectorXd _surface_variation(const MatrixXd &P, const Vector2d &origin, const double radius) {
+        const int n = P.rows();
+        _CellHash points(origin, radius, n);
+        for (int i = 0; i < n; i++) {
+            points.insert(P.row(i).transpose(), i);
+        }
+
+        VectorXd variation = VectorXd::Zero(n);
+        rpm::parallel::parallel_for(0, n, rpm::parallel::grain_for(256), [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                const Vector2d p = P.row(i).transpose();
+                Vector2d sum = Vector2d::Zero();
+                Matrix2d outer = Matrix2d::Zero();
+                int count = 0;
+                points.for_near(p, [&](int j) {
+                    const Vector2d q = P.row(j).transpose();
+                    if ((q - p).squaredNorm() <= radius * radius) {
+                        sum += q;
+                        outer += q * q.transpose();
+                        count++;
+                    }
+                });
+                if (count < 3) {
+                    continue;
+                }
+                const Vector2d mean = sum / count;
+                const Matrix2d covariance = outer / count - mean * mean.transpose();
+                const Vector2d eigenvalues = SelfAdjointEigenSolver<Matrix2d>(covariance, EigenvaluesOnly).eigenvalues();
+                const double trace = eigenvalues.sum();
+                if (trace > 0) {
+                    variation(i) = std::max(eigenvalues(0), 0.0) / trace;
+                }
+            }
+        });
+        return variation;
+    }
+
+    // Indices by descending value in 64 buckets, input order within a bucket. O(n).
+    std::vector<int> _bucket_order(const VectorXd &value) {
+        const int n = value.size(), buckets = 64;
+        const double max_value = n ? value.maxCoeff() : 0;
+        std::vector<int> bucket(n), begin(buckets + 1, 0);
+        for (int i = 0; i < n; i++) {
+            const int b = max_value > 0 ? std::min(int(value(i) / max_value * buckets), buckets - 1) : 0;
+            bucket[i] = buckets - 1 - b;
+            begin[bucket[i] + 1]++;
+        }
+        for (int b = 0; b < buckets; b++) {
+            begin[b + 1] += begin[b];
+        }
+        std::vector<int> order(n);
+        for (int i = 0; i < n; i++) {
+            order[begin[bucket[i]]++] = i;
+        }
+        return order;
+    }
+
+    // Radius of about 8 points per occupied cell, the scale of _surface_variation(): about 72 points
+    // are visited per point whatever the sampling radius, so it stays O(n).
+    double _neighbourhood_radius(const MatrixXd &P, const Vector2d &origin, const double extent) {
+        const int n = P.rows();
+        const int cells = std::max(n / 8, 1);
+        std::vector<int> owner(n);
+        double lo = extent * 1e-6, hi = extent, radius = hi;
+        for (int iter = 0; iter < 20; iter++) {
+            radius = std::sqrt(lo * hi);
+            _voxel_sample(P, origin, radius, owner);
+            int occupied = 0;
+            for (int i = 0; i < n; i++) {
+                occupied += owner[i] == i;
+            }
+            if (std::abs(occupied - cells) <= cells / 10) {
+                break;
+            }
+            (occupied > cells ? lo : hi) = radius;
+        }
+        return radius;
+    }
+
+    // One downsampling pass at radius, owner as above, returns the number of points kept.
+    int _downsample(const MatrixXd &P, const Vector2d &origin, const data_process::SampleOptions &options,
+                    const double radius, const VectorXd &variation, std::vector<int> &owner) {
+        const int n = P.rows();
+        if (options.method == data_process::SampleMethod::voxel) {
+            _voxel_sample(P, origin, radius, owner);
+        } else if (options.method == data_process::SampleMethod::poisson_disk) {
+            std::vector<int> order(n);
+            for (int i = 0; i < n; i++) {
+                order[i] = i;
+            }
+            _poisson_sample(P, origin, radius, VectorXd(), order, owner);
+        } else {
+            const double max_variation = variation.maxCoeff();
+            VectorXd radii = VectorXd::Constant(n, radius);
+            if (max_variation > 0) {
+                radii = (radius / (1 + options.curvature_gain * variation.array() / max_variation)).matrix();
+            }
+            _poisson_sample(P, origin, radius, radii, _bucket_order(variation), owner);
+        }
+
+        int kept = 0;
+        for (int i = 0; i < n; i++) {
+            kept += owner[i] == i;
+        }
+        return kept;
+    }
+}
+
+int data_process::downsample(MatrixXd &X, const SampleOptions &options, SampleMapping *mapping) {
+    if (X.cols() != rpm::D && X.cols() != rpm::D + 1) {
+        throw invalid_argument("data_process::downsample() only support 2d or homogeneous points!");
+    }
+    if (!(options.radius >= 0) || (options.radius == 0 && options.sample_num <= 0)) {
+        throw invalid_argument("data_process::downsample() needs a radius or a sample_num!");
+    }
+
+    const int n = X.rows();
+    std::vector<int> owner(n);
+    for (int i = 0; i < n; i++) {
+        owner[i] = i;
+    }
+
+    if (n > 0 && (options.radius > 0 || n > options.sample_num)) {
+        const MatrixXd P = X.leftCols(rpm::D);
+        const Vector2d origin = P.colwise().minCoeff().transpose();
+        const double extent = (P.colwise().maxCoeff().transpose() - origin).maxCoeff();
+        // Cell coordinates must fit the hash keys.
+        const double max_cells = 1 << 30;
+
+        VectorXd variation;
+        if (options.method == SampleMethod::curvature && extent > 0) {
+            variation = _surface_variation(P, origin, _neighbourhood_radius(P, origin, extent));
+        } else if (options.method == SampleMethod::curvature) {
+            variation = VectorXd::Zero(n);
+        }
+
+        if (options.radius > 0) {
+            if (extent / options.radius >= max_cells) {
+                throw invalid_argument("data_process::downsample() radius too small for the extent of the points!");
+            }
+            _downsample(P, origin, options, options.radius, variation, owner);
+        } else if (!(extent > 0)) {
+            // All the points coincide.
+            _downsample(P, origin, options, 1, variation, owner);
+        } else {
+            // The count falls as the radius grows, bisect log(radius) below the extent.
+            double lo = extent * 1e-6, hi = extent, best_radius = hi;
+            int best_diff = std::numeric_limits<int>::max(), last_diff = -1;
+            for (int iter = 0; iter < 40 && best_diff > 0; iter++) {
+                const double radius = std::sqrt(lo * hi);
+                const int kept = _downsample(P, origin, options, radius, variation, owner);
+                last_diff = std::abs(kept - options.sample_num);
+                if (last_diff < best_diff) {
+                    best_diff = last_diff;
+                    best_radius = radius;
+                }
+                (kept > options.sample_num ? lo : hi) = radius;
+            }
+            if (last_diff != best_diff) {
+                _downsample(P, origin, options, best_radius, variation, owner);
+            }
+        }
+    }
+
+    std::vector<int> kept, row_of(n, -1);
+    for (int i = 0; i < n; i++) {
+        if (owner[i] == i) {
+            row_of[i] = int(kept.size());
+            kept.push_back(i);
+        }
+    }
+    if (int(kept.size()) < n) {
+        MatrixXd X_ = X(kept, Eigen::all);
+        X = X_;
+    }
+
+    if (mapping) {
+        mapping->owner.resize(n);
+        for (int i = 0; i < n; i++) {
+            mapping->owner[i] = row_of[owner[i]];
+        }
+        mapping->kept = kept;
+    }
+    return int(kept.size());
+}
+
+void data_process::remove_rows(MatrixXd &X, int start, int end) {
+    if (start < 0 || end >= X.rows()) {
+        return;
+    }
+
+    MatrixXd X_ = X;
+    int count = 0;
+    for (int i = 0; i < start; i++) {
+        X_.row(count) = X.row(i);
+        count++;
+    }
+    for (int i = end + 1; i < X.rows(); i++) {
+        X_.row(count) = X.row(i);
+        count++;
+    }
+    X_.conservativeResize(count, X_.cols());
+
+    X = X_;
+}
+
+void data_process::homo(MatrixXd &X) {
+    if (X.cols() != rpm::D && X.cols() != rpm::D + 1) {
+        throw invalid_argument("Can not convert 2d points to 3d homogeneous points.");
+    }
+
+    if (X.cols() == rpm::D + 1) {
+        return;
+    }
+
+    X.conservativeResize(X.rows(), rpm::D + 1);
+    X.col(rpm::D).setConstant(1);
+}
+
+void data_process::hnorm(MatrixXd &X) {
+    if (X.cols() != rpm::D && X.cols() != rpm::D + 1) {
+        throw invalid_argument("Can not convert 2d points to 3d homogeneous points.");
+    }
+
+    if (X.cols() == rpm::D) {
+        return;
+    }
+
+    MatrixXd X_ = X.rowwise().hnormalized();
+    X = X_;
+}
+
+Matrix3d data_process::preprocess(MatrixXd &X, MatrixXd &Y) {
+    if (X.cols() != rpm::D || Y.cols() != rpm::D) {
+        throw invalid_argument("data_process::preprocess only support 2d points!");
+    }
+
+    double min_x = std::min(X.col(0).minCoeff(), Y.col(0).minCoeff());
+    double max_x = std::max(X.col(0).maxCoeff(), Y.col(0).maxCoeff());
+    double min_y = std::min(X.col(1).minCoeff(), Y.col(1).minCoeff());
+    double max_y = std::max(X.col(1).maxCoeff(), Y.col(1).maxCoeff());
+
+    double max_len = max((max_x - min_x), (max_y - min_y));
+
+    Matrix3d translate = Matrix3d::Identity();
+    translate.col(2) = Vector3d(-min_x, -min_y, 1);
+    Matrix3d scale = Matrix3d::Identity();
+    scale(0, 0) = scale(1, 1) = 1.0 / max_len;
+
+    Matrix3d transform = scale * translate;
+
+    apply_transform(X, transform);
+    apply_transform(Y, transform);
+
+    return transform;
+}
+
+void data_process::apply_transform(MatrixXd &m, const Matrix3d &trans) {
+    if (m.cols() != rpm::D) {
+        throw invalid_argument("data_process::apply_transform() only support 2d points!");
+    }
+
+    homo(m);
+    m = m * trans.transpose();
+    hnorm(m);
+}
+
+void data_process::apply_transform(Vector2d &X, const Matrix3d &trans) {
+    Vector3d X_ = X.homogeneous();
+    X = (trans * X_).hnormalized();
+}
@@ -0,0 +1,128 @@
+// This file is for data processing and generating, it only depends on Eigen.
+//
+// Copyright (C) 2019 Yang Zhenjie <amazingzhen@foxmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+#include <Eigen/Core>
+
+#include "rpm.h"
+
+using namespace Eigen;
+using namespace rpm;
+
+using std::cin;
+using std::cout;
+using std::endl;
+using std::string;
+
+namespace data_process {
+    void sample(MatrixXd &X, int sample_num);
+
+    enum class SampleMethod {
+        voxel,          // one point per square cell of side radius, the one nearest the cell centroid
+        poisson_disk,   // greedy, no kept point within radius of another
+        curvature       // Poisson disk, the radius shrinks where the neighbourhood bends
+    };
+
+    struct SampleOptions {
+        SampleMethod method = SampleMethod::voxel;
+        // Cell side or disk radius in the units of the points. 0 searches the radius that keeps
+        // about sample_num points, a few O(n) passes.
+        double radius = 0;
+        int sample_num = 0;
+        // The curvature radius at a point is radius / (1 + curvature_gain * c / max(c)), c the
+        // PCA surface variation of its neighbourhood (about 8 points per cell of the hash),
+        // highest c is visited first.
+        double curvature_gain = 4;
+    };
+
+    // Where the kept points came from.
+    struct SampleMapping {
+        std::vector<int> kept;   // input row of each output row, ascending
+        std::vector<int> owner;  // output row representing each input row
+    };
+
+    // Shape-preserving downsampling, O(n) expected with a spatial hash of the points. Unlike
+    // sample() the kept set does not follow the row stride, the output keeps the input row order.
+    //
+    // Input:
+    //   X			points, 2d or homogeneous (the first two columns are used)
+    //	 options	method and radius or point count
+    // Output:
+    //	 X			the kept rows
+    //	 mapping	if not null, kept rows and the owner of every input row
+    // Returns the number of points kept
+    //
+    int downsample(MatrixXd &X, const SampleOptions &options, SampleMapping *mapping = nullptr);
+
+    void remove_rows(MatrixXd &X, int start_row, int end_row);
+
+    // (x,y) -> (x,y,1)
+    void homo(MatrixXd &X);
+
+    // (x,y,w) -> (x/w, y/w)
+    void hnorm(MatrixXd &X);
+
+    // Normalize X and Y to range [0, 1].
+    // Return a 3*3 matrix represent the transform.
+    Matrix3d preprocess(MatrixXd &X, MatrixXd &Y);
+
+    void apply_transform(MatrixXd &X, const Matrix3d &trans);
+
+    void apply_transform(Vector2d &X, const Matrix3d &trans);
+}
+
+namespace data_generate {
+    // The generators draw from rpm::CounterRng, the same seed gives the same points
+    // for any number of threads.
+
+    MatrixXd generate_random_points(const int point_num, const double range_min, const double range_max,
+                                    const uint64_t seed = 0);
+
+    MatrixXd add_gaussian_noise(const MatrixXd &X, const double mu, const double sigma, const uint64_t seed = 0);
+
+    bool load(MatrixXd &X, const string &filename);
+
+    void save(const MatrixXd &X, const string &filename);
+
+    // Append num points uniformly drawn from the bounding box of X.
+    void add_outlier(MatrixXd &X, const int num, const uint64_t seed = 0);
+
+    // Synthetic registration problem with known ground truth.
+    struct SyntheticSpec {
+        string shape = "random";    // random, curve, grid, or base
+        int point_num = 100;        // source size, ignored for "base"
+        MatrixXd base;              // source points for "base", scaled to the unit box
+
+        string warp = "affine";     // none, affine, tps
+        double warp_scale = 0.1;    // relative to the unit box
+        int warp_controls = 8;      // TPS control points
+
+        double noise = 0;           // gaussian sigma, relative to the unit box
+        int outliers = 0;           // uniform points added to the target
+        int occlusion = 0;          // target points removed around a random center
+
+        uint64_t seed = 0;
+    };
+
+    struct SyntheticSet {
+        MatrixXd X;                 // source, in the unit box
+        MatrixXd Y;                 // target: warped, noisy, occluded source followed by the outliers
+        MatrixXd X_warped;          // source under the true warp, without noise
+        std::vector<int> truth;     // truth[k] is the row of Y matching X.row(k), -1 if occluded
+    };
+
+    // Input:
+    //   spec : what to generate
+    // Output:
+    //   set : the generated problem
+    bool generate(const SyntheticSpec &spec, SyntheticSet &set);
+}
@@ -0,0 +1,221 @@
+// This file is for the improved fast Gauss transform of 2d point sets.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "gauss_transform.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <stdexcept>
+
+#include "parallel.h"
+
+using namespace Eigen;
+
+namespace {
+    const int max_order = 30;
+    // Cells per axis, keeps the keys in range for a bandwidth far below the extent of the points.
+    const double max_cells_per_axis = 1 << 30;
+
+    // Powers u^0 .. u^(p - 1) of both coordinates.
+    inline void _powers(const double ux, const double uy, const int p, double *px, double *py) {
+        px[0] = py[0] = 1;
+        for (int a = 1; a < p; a++) {
+            px[a] = px[a - 1] * ux;
+            py[a] = py[a - 1] * uy;
+        }
+    }
+}
+
+rpm::GaussTransform::GaussTransform(const MatrixXd &sources_, const double h_, const double epsilon,
+                                    const double cell_scale)
+        : sources(sources_.leftCols(2)), h(h_) {
+    if (sources_.cols() < 2 || sources_.rows() == 0) {
+        throw std::invalid_argument("rpm::GaussTransform needs non-empty 2d sources!");
+    }
+    if (!(h > 0) || !(epsilon > 0 && epsilon < 1) || !(cell_scale > 0)) {
+        throw std::invalid_argument("rpm::GaussTransform needs h > 0, epsilon in (0, 1) and cell_scale > 0!");
+    }
+
+    // Half the error for the cutoff, half for the truncation. A source at u and a target at v
+    // (relative to the center, in units of h) leave a truncation error of at most
+    // (2 * |u| * |v|)^p / p! * exp(-(|u| - |v|)^2), taken at the worst |v| within the cutoff.
+    cell_side = h * cell_scale;
+    const double rho_x = cell_scale / std::sqrt(2.0);
+    const double rho_y = rho_x + std::sqrt(std::log(2 / epsilon));
+    cutoff = rho_y * h;
+    for (p = 1; p < max_order; p++) {
+        double bound = 0;
+        for (int i = 1; i <= 100; i++) {
+            const double rho = rho_y * i / 100;
+            bound = std::max(bound, std::exp(p * std::log(2 * rho_x * rho) - std::lgamma(p + 1.0)
+                                             - (rho - rho_x) * (rho - rho_x)));
+        }
+        if (bound <= epsilon / 2) {
+            break;
+        }
+    }
+
+    origin = sources.colwise().minCoeff().transpose();
+    const Vector2d extent = sources.colwise().maxCoeff().transpose() - origin;
+    if ((extent / cell_side).maxCoeff() >= max_cells_per_axis) {
+        throw std::invalid_argument("rpm::GaussTransform bandwidth too small for the extent of the sources!");
+    }
+    last_cell_x = int(extent(0) / cell_side);
+    last_cell_y = int(extent(1) / cell_side);
+
+    const int S = sources.rows();
+    std::vector<Key> keys(S);
+    for (int i = 0; i < S; i++) {
+        keys[i] = key_of(int((sources(i, 0) - origin(0)) / cell_side), int((sources(i, 1) - origin(1)) / cell_side));
+    }
+    source_order.resize(S);
+    std::iota(source_order.begin(), source_order.end(), 0);
+    std::stable_sort(source_order.begin(), source_order.end(), [&](int a, int b) { return keys[a] < keys[b]; });
+
+    for (int i = 0; i < S; i++) {
+        if (i == 0 || keys[source_order[i]] != keys[source_order[i - 1]]) {
+            cell_keys.push_back(keys[source_order[i]]);
+            cell_begin.push_back(i);
+        }
+    }
+    cell_begin.push_back(S);
+
+    centers.resize(2, cell_keys.size());
+    for (size_t c = 0; c < cell_keys.size(); c++) {
+        const int cx = int(cell_keys[c] >> 32), cy = int(cell_keys[c] & 0xffffffff);
+        centers.col(c) = origin + Vector2d(cx + 0.5, cy + 0.5) * cell_side;
+    }
+}
+
+rpm::GaussTransform::Key rpm::GaussTransform::key_of(const int cx, const int cy) const {
+    return (Key(cx) << 32) | Key(cy);
+}
+
+void rpm::GaussTransform::evaluate(const MatrixXd &weights, const MatrixXd &targets, MatrixXd &result) const {
+    if (weights.rows() != sources.rows() || targets.cols() < 2) {
+        throw std::invalid_argument("rpm::GaussTransform::evaluate() needs one weight row per source and 2d targets!");
+    }
+
+    const int C = cells(), Mw = weights.cols();
+    const int terms = p * (p + 1) / 2;
+
+    // Term constants 2^(a + b) / (a! * b!), terms ordered by a, then b < p - a.
+    VectorXd constants(terms);
+    {
+        std::vector<double> factorial(p, 1);
+        for (int a = 1; a < p; a++) {
+            factorial[a] = factorial[a - 1] * a;
+        }
+        int t = 0;
+        for (int a = 0; a < p; a++) {
+            for (int b = 0; b < p - a; b++) {
+                constants(t++) = std::pow(2.0, a + b) / (factorial[a] * factorial[b]);
+            }
+        }
+    }
+
+    // Expansion of each cell around its center, column c holds terms * Mw coefficients.
+    MatrixXd coefficients = MatrixXd::Zero(terms * Mw, C);
+    parallel::parallel_for(0, C, parallel::grain_for(terms * Mw * 4), [&](int begin, int end) {
+        std::vector<double> px(p), py(p), monomials(terms);
+        for (int c = begin; c < end; c++) {
+            auto coef = coefficients.col(c);
+            for (int i = cell_begin[c]; i < cell_begin[c + 1]; i++) {
+                const int s = source_order[i];
+                const double ux = (sources(s, 0) - centers(0, c)) / h, uy = (sources(s, 1) - centers(1, c)) / h;
+                const double e = std::exp(-(ux * ux + uy * uy));
+                _powers(ux, uy, p, px.data(), py.data());
+                int t = 0;
+                for (int a = 0; a < p; a++) {
+                    for (int b = 0; b < p - a; b++) {
+                        monomials[t++] = e * px[a] * py[b];
+                    }
+                }
+                for (int m = 0; m < Mw; m++) {
+                    const double q = weights(s, m);
+                    for (t = 0; t < terms; t++) {
+                        coef(m * terms + t) += q * monomials[t];
+                    }
+                }
+            }
+            for (int m = 0; m < Mw; m++) {
+                coef.segment(m * terms, terms).array() *= constants.array();
+            }
+        }
+    });
+
+    const int T = targets.rows();
+    const double cutoff2 = cutoff * cutoff;
+    result = MatrixXd::Zero(T, Mw);
+    parallel::parallel_for(0, T, parallel::grain_for(terms * Mw * 16), [&](int begin, int end) {
+        std::vector<double> px(p), py(p);
+        for (int j = begin; j < end; j++) {
+            const double tx = targets(j, 0), ty = targets(j, 1);
+            // Cells of the cutoff box, clamped to the grid.
+            auto cell_range = [&](double v, double o, int last_cell, int &lo, int &hi) {
+                const double first = std::floor((v - cutoff - o) / cell_side);
+                const double last = std::floor((v + cutoff - o) / cell_side);
+                lo = int(std::max(first, 0.0));
+                hi = int(std::min(last, double(last_cell)));
+                return last >= 0 && first <= last_cell;
+            };
+            int cx_lo, cx_hi, cy_lo, cy_hi;
+            if (!cell_range(tx, origin(0), last_cell_x, cx_lo, cx_hi)
+                || !cell_range(ty, origin(1), last_cell_y, cy_lo, cy_hi)) {
+                continue;
+            }
+
+            for (int cx = cx_lo; cx <= cx_hi; cx++) {
+                auto it = std::lower_bound(cell_keys.begin(), cell_keys.end(), key_of(cx, cy_lo));
+                const Key last = key_of(cx, cy_hi);
+                for (; it != cell_keys.end() && *it <= last; ++it) {
+                    const int c = int(it - cell_keys.begin());
+                    const double dx = tx - centers(0, c), dy = ty - centers(1, c);
+                    const double dist2 = dx * dx + dy * dy;
+                    if (dist2 > cutoff2) {
+                        continue;
+                    }
+
+                    const double e = std::exp(-dist2 / (h * h));
+                    _powers(dx / h, dy / h, p, px.data(), py.data());
+                    const auto coef = coefficients.col(c);
+                    for (int m = 0; m < Mw; m++) {
+                        double sum = 0;
+                        int t = m * terms;
+                        for (int a = 0; a < p; a++) {
+                            double row = 0;
+                            for (int b = 0; b < p - a; b++) {
+                                row += coef(t++) * py[b];
+                            }
+                            sum += row * px[a];
+                        }
+                        result(j, m) += e * sum;
+                    }
+                }
+            }
+        }
+    });
+}
+
+void rpm::gauss_transform_direct(const MatrixXd &sources, const MatrixXd &weights, const MatrixXd &targets,
+                                 const double h, MatrixXd &result) {
+    if (weights.rows() != sources.rows() || sources.cols() < 2 || targets.cols() < 2) {
+        throw std::invalid_argument("rpm::gauss_transform_direct() needs one weight row per source and 2d points!");
+    }
+
+    const int S = sources.rows(), T = targets.rows();
+    const double inv_h2 = 1 / (h * h);
+    result = MatrixXd::Zero(T, weights.cols());
+    parallel::parallel_for(0, T, parallel::grain_for(S * 8), [&](int begin, int end) {
+        for (int j = begin; j < end; j++) {
+            for (int i = 0; i < S; i++) {
+                const double dist2 = (sources.row(i).leftCols(2) - targets.row(j).leftCols(2)).squaredNorm();
+                result.row(j) += std::exp(-dist2 * inv_h2) * weights.row(i);
+            }
+        }
+    });
+}
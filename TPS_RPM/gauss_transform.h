@@ -0,0 +1,65 @@
+// This file is for the improved fast Gauss transform of 2d point sets.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <Eigen/Dense>
+
+namespace rpm {
+    // Discrete Gauss transform G(t_j) = sum_i q_i * exp(-||t_j - s_i||^2 / h^2) in O(sources + targets).
+    //
+    // The sources are binned into square cells of side h * cell_scale. Each cell keeps a
+    // truncated multivariate Taylor expansion of its sources around the cell center (the
+    // "improved" FGT expansion, p * (p + 1) / 2 terms in 2d), and a target only sums the
+    // cells within the cutoff radius. The cutoff r_y and the order p are chosen so that the
+    // dropped cells and the truncated terms each stay below epsilon / 2, relative to the sum of |q_i|.
+    //
+    // Only the first two columns of the points are used, homogeneous points can be passed as is.
+    class GaussTransform {
+    public:
+        // Input:
+        //   sources		points s_i
+        //	 h			bandwidth
+        //	 epsilon	wanted error relative to sum |q_i|
+        GaussTransform(const Eigen::MatrixXd &sources, const double h, const double epsilon = 1e-4,
+                       const double cell_scale = 1);
+
+        // Input:
+        //   weights	q, one column per transform, one row per source
+        //	 targets	points t_j
+        // Output:
+        //	 result		G(t_j) of each weight column, targets * weights.cols()
+        //
+        void evaluate(const Eigen::MatrixXd &weights, const Eigen::MatrixXd &targets,
+                      Eigen::MatrixXd &result) const;
+
+        int order() const { return p; }
+
+        int cells() const { return int(cell_keys.size()); }
+
+    private:
+        typedef std::int64_t Key;
+
+        Key key_of(const int cx, const int cy) const;
+
+        Eigen::MatrixXd sources;
+        double h, cell_side, cutoff;
+        int p;
+        int last_cell_x = 0, last_cell_y = 0;
+        Eigen::Vector2d origin;
+        // Non-empty cells in key order, the sources of cell c are source_order[cell_begin[c] .. cell_begin[c + 1]).
+        std::vector<Key> cell_keys;
+        std::vector<int> cell_begin, source_order;
+        Eigen::MatrixXd centers;
+    };
+
+    // The same sums directly, O(sources * targets), for reference and small sets.
+    void gauss_transform_direct(const Eigen::MatrixXd &sources, const Eigen::MatrixXd &weights,
+                                const Eigen::MatrixXd &targets, const double h, Eigen::MatrixXd &result);
+}
@@ -1,9 +1,64 @@
+#include <filesystem>
 #include <iostream>
 #include <opencv2/opencv.hpp>
 #include "rpm.h"
 #include "data.h"
+#include "pipeline.h"
+
+// Batch mode: TSP_RPM name1 name2 ... registers ../data/<name>_source.txt to
+// ../data/<name>_target.txt for every name, and writes <name>/data_result.png
+// and <name>/result.txt (the transformed source). Loading, registration and
+// writing overlap through rpm::run_pipeline.
+static int run_batch(const std::vector<std::string> &names) {
+    const std::string data_dir = "../data/";
+
+    rpm::PipelineConfig config;
+    config.load_workers = 2;
+    config.emit_workers = 2;
+
+    auto load = [&](rpm::PipelineItem &item) {
+        item.name = names[item.index];
+        return data_generate::load(item.X, data_dir + item.name + "_source.txt")
+               && data_generate::load(item.Y, data_dir + item.name + "_target.txt");
+    };
+
+    auto emit = [&](rpm::PipelineItem &item) {
+        if (!item.ok) {
+            std::cout << item.name << " : registration failed" << std::endl;
+            return;
+        }
+        std::filesystem::create_directories(item.name);
+
+        Eigen::MatrixXd X_norm = item.X, Y_norm = item.Y;
+        Eigen::Matrix3d preprocess_trans = data_process::preprocess(X_norm, Y_norm);
+        Eigen::MatrixXd XT = item.params->applyTransform(X_norm, true);
+        data_process::apply_transform(XT, preprocess_trans.inverse());
+
+        data_generate::save(XT, item.name + "/result.txt");
+        data_visualize::visualize_result(item.name + "/data_result.png", item.X, item.Y, *item.params);
+    };
+
+    rpm::PipelineStats stats;
+    const bool ok = rpm::run_pipeline(names.size(), load, emit, config, &stats);
+
+    printf("pipeline : %d items in %.3fs, %d failed\n", (int) names.size(), stats.wall_time, stats.failed);
+    const std::pair<const char *, const rpm::PipelineStageStats *> stages[] = {
+            {"load", &stats.load}, {"register", &stats.registration}, {"emit", &stats.emit}};
+    for (const auto &stage : stages) {
+        printf("  %-8s workers %d  occupancy %.2f  busy %.3fs  starved %.3fs  blocked %.3fs\n",
+               stage.first, stage.second->workers, stage.second->occupancy, stage.second->busy_time,
+               stage.second->starved_time, stage.second->blocked_time);
+    }
+    printf("  queue peaks : register %d  emit %d\n", stats.register_queue_peak, stats.emit_queue_peak);
+
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        return run_batch(std::vector<std::string>(argv + 1, argv + argc));
+    }
 
-int main() {
     const std::string data_dir = "../data/";
     const std::string source_suffix = "_source.txt";
     const std::string target_suffix = "_target.txt";
@@ -65,9 +120,23 @@ int main() {
     matched_point_indices.push_back({2, 2});
     matched_point_indices.push_back({3, 3});
 
+    rpm::RpmConfig config;
+    config.verbose = true;
+
+    // One frame per temperature, rendered and written off the annealing thread.
+    rpm::TrajectoryRecorder recorder(64, config.I0);
+    rpm::RpmInstrumentation instrumentation;
+    if (data_visualize::save_intermediate_result) {
+        recorder.open(data_visualize::res_dir + "/trajectory.bin");
+        recorder.set_sink(data_visualize::frame_writer(data_visualize::res_dir));
+        recorder.attach(instrumentation);
+        config.instrumentation = &instrumentation;
+    }
+
     rpm::ThinPlateSplineParams params(X_norm);
     Eigen::MatrixXd M;
-    bool resultStatus = rpm::estimate(X, Y, M, params, matched_point_indices);
+    bool resultStatus = rpm::estimate(X, Y, M, params, config, matched_point_indices);
+    recorder.flush();
     if (resultStatus) {
         //Mat result_image = data_visualize::visualize(params.applyTransform(false), Y, 1);
         //sprintf_s(file_buf, "%s/data_result.png", data_generate::res_dir.c_str());
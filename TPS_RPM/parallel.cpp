@@ -0,0 +1,267 @@
+// This file is for the work-stealing task scheduler used by the rpm kernels.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "parallel.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "perf_counters.h"
+#include "trace.h"
+
+using rpm::parallel::detail::RangeFunc;
+
+namespace {
+    struct Job {
+        RangeFunc func;
+        const void *body;
+        std::atomic<int> pending;
+        std::atomic<bool> failed;
+        std::exception_ptr error;
+        // perf_counters stages open on the submitter, the tasks are counted into them.
+        unsigned stages;
+    };
+
+    struct Task {
+        Job *job;
+        int begin, end;
+    };
+
+    // Fixed capacity deque, the owner works at the back and thieves take from the front.
+    // A full deque makes the submitter run the chunk inline, so pushing never allocates.
+    class TaskDeque {
+    public:
+        bool push(const Task &task) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (size == capacity) {
+                return false;
+            }
+            tasks[(head + size) % capacity] = task;
+            size++;
+            return true;
+        }
+
+        bool pop(Task &task) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (size == 0) {
+                return false;
+            }
+            size--;
+            task = tasks[(head + size) % capacity];
+            return true;
+        }
+
+        bool steal(Task &task) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (size == 0) {
+                return false;
+            }
+            task = tasks[head];
+            head = (head + 1) % capacity;
+            size--;
+            return true;
+        }
+
+    private:
+        static const int capacity = 1024;
+
+        std::mutex mutex;
+        Task tasks[capacity];
+        int head = 0, size = 0;
+    };
+
+    // Index of the current thread's deque, -1 for threads outside the pool.
+    thread_local int worker_index = -1;
+
+    class Scheduler {
+    public:
+        static Scheduler &instance() {
+            static Scheduler scheduler;
+            return scheduler;
+        }
+
+        ~Scheduler() {
+            stop();
+        }
+
+        int num_threads() const {
+            return int(workers.size()) + 1;
+        }
+
+        void resize(int n) {
+            if (n <= 0) {
+                n = std::max(1, int(std::thread::hardware_concurrency()));
+            }
+            stop();
+            start(n - 1);
+        }
+
+        void run(int begin, int end, int grain, RangeFunc func, const void *body) {
+            const int n = end - begin;
+            const int threads = num_threads();
+            grain = std::max(grain, 1);
+            if (threads <= 1) {
+                func(body, begin, end);
+                return;
+            }
+
+            // Rounded down, so every chunk holds at least grain indices.
+            const int chunks = std::min(std::max(1, n / grain), threads * 4);
+
+            Job job;
+            job.func = func;
+            job.body = body;
+            job.pending.store(chunks);
+            job.failed.store(false);
+            job.stages = rpm::perf_counters::open_stages();
+
+            // External threads share the injection deque behind the worker deques.
+            const int self = worker_index;
+            TaskDeque &deque = *deques[self >= 0 ? self : deques.size() - 1];
+
+            int pushed = 0;
+            for (int c = chunks - 1; c > 0; c--) {
+                Task task = {&job, begin + int((long long) n * c / chunks), begin + int((long long) n * (c + 1) / chunks)};
+                if (deque.push(task)) {
+                    pushed++;
+                } else {
+                    execute(task);
+                }
+            }
+            if (pushed > 0) {
+                queued.fetch_add(pushed);
+                if (sleepers.load() > 0) {
+                    { std::lock_guard<std::mutex> lock(sleep_mutex); }
+                    wake.notify_all();
+                }
+            }
+
+            execute({&job, begin, begin + int((long long) n / chunks)});
+
+            // Help with any pending work until the chunks of this job are done.
+            while (job.pending.load(std::memory_order_acquire) > 0) {
+                Task task;
+                if (acquire(self, task)) {
+                    execute(task);
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+
+            if (job.error) {
+                std::rethrow_exception(job.error);
+            }
+        }
+
+    private:
+        Scheduler() {
+            start(std::max(1, int(std::thread::hardware_concurrency())) - 1);
+        }
+
+        void start(int worker_num) {
+            stopping = false;
+            deques.clear();
+            for (int i = 0; i < worker_num + 1; i++) {
+                deques.emplace_back(new TaskDeque());
+            }
+            for (int i = 0; i < worker_num; i++) {
+                workers.emplace_back(&Scheduler::worker_loop, this, i);
+            }
+        }
+
+        void stop() {
+            {
+                std::lock_guard<std::mutex> lock(sleep_mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto &worker : workers) {
+                worker.join();
+            }
+            workers.clear();
+        }
+
+        bool acquire(int self, Task &task) {
+            bool found = self >= 0 && deques[self]->pop(task);
+
+            const int count = int(deques.size());
+            for (int i = 1; !found && i <= count; i++) {
+                found = deques[((self < 0 ? count - 1 : self) + i) % count]->steal(task);
+            }
+
+            if (found) {
+                queued.fetch_sub(1);
+            }
+            return found;
+        }
+
+        static void execute(const Task &task) {
+            RPM_TRACE_SPAN("task");
+            Job *job = task.job;
+            {
+                // Closed before pending drops so the counts are in when the submitter's stage ends.
+                rpm::perf_counters::TaskScope counted(job->stages);
+                try {
+                    job->func(job->body, task.begin, task.end);
+                }
+                catch (...) {
+                    if (!job->failed.exchange(true)) {
+                        job->error = std::current_exception();
+                    }
+                }
+            }
+            // The submitter may return as soon as pending drops to 0, job must not be touched after this.
+            job->pending.fetch_sub(1, std::memory_order_release);
+        }
+
+        void worker_loop(int index) {
+            worker_index = index;
+            rpm::trace::set_thread_name("rpm worker " + std::to_string(index));
+
+            while (true) {
+                Task task;
+                if (acquire(index, task)) {
+                    execute(task);
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> lock(sleep_mutex);
+                sleepers.fetch_add(1);
+                wake.wait(lock, [this] { return stopping || queued.load() > 0; });
+                sleepers.fetch_sub(1);
+                if (stopping && queued.load() == 0) {
+                    return;
+                }
+            }
+        }
+
+        std::vector<std::unique_ptr<TaskDeque> > deques;
+        std::vector<std::thread> workers;
+
+        std::mutex sleep_mutex;
+        std::condition_variable wake;
+        std::atomic<int> queued{0};
+        std::atomic<int> sleepers{0};
+        bool stopping = false;
+    };
+}
+
+int rpm::parallel::num_threads() {
+    return Scheduler::instance().num_threads();
+}
+
+void rpm::parallel::set_num_threads(int n) {
+    Scheduler::instance().resize(n);
+}
+
+void rpm::parallel::detail::run(int begin, int end, int grain, RangeFunc func, const void *body) {
+    Scheduler::instance().run(begin, end, grain, func, body);
+}
@@ -0,0 +1,59 @@
+// This file is for the work-stealing task scheduler used by the rpm kernels.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include <algorithm>
+
+namespace rpm {
+    namespace parallel {
+        // Below this many scalar operations a kernel runs inline on the calling thread.
+        const int min_task_work = 1 << 14;
+
+        // Number of threads able to run kernels, the calling thread included.
+        int num_threads();
+
+        // Resize the worker pool, 0 means the hardware concurrency.
+        // Must not be called while kernels are running. In builds with RPM_USE_OPENMP, Eigen's
+        // products inside the kernels start their own OpenMP threads, see CMakeLists.txt.
+        void set_num_threads(int n);
+
+        // Grain size (in indices) for a loop whose body costs work_per_index scalar operations.
+        inline int grain_for(int work_per_index) {
+            return std::max(1, min_task_work / std::max(1, work_per_index));
+        }
+
+        namespace detail {
+            typedef void (*RangeFunc)(const void *body, int begin, int end);
+
+            void run(int begin, int end, int grain, RangeFunc func, const void *body);
+
+            template<typename Body>
+            void invoke(const void *body, int begin, int end) {
+                (*static_cast<const Body *>(body))(begin, end);
+            }
+        }
+
+        // Call body(begin, end) over sub ranges of [begin, end), each holding at least grain indices.
+        //
+        // Ranges not larger than grain run inline. Otherwise the chunks are pushed onto the
+        // work-stealing deques and the calling thread keeps executing tasks until all chunks
+        // are done, so nested calls from inside a kernel or from a batch of parallel jobs
+        // share the same workers instead of oversubscribing the machine.
+        // The first exception thrown by body is rethrown on the calling thread.
+        template<typename Body>
+        void parallel_for(int begin, int end, int grain, const Body &body) {
+            if (end <= begin) {
+                return;
+            }
+            if (end - begin <= std::max(grain, 1)) {
+                body(begin, end);
+                return;
+            }
+            detail::run(begin, end, grain, &detail::invoke<Body>, &body);
+        }
+    }
+}
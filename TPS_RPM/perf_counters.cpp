@@ -0,0 +1,225 @@
+// This file is for counting hardware events per engine stage in profiled builds and runs.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "perf_counters.h"
+
+#include <atomic>
+#include <cstdint>
+
+#if defined(__linux__)
+
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#endif
+
+using rpm::perf_counters::stage_count;
+
+namespace {
+    // cycles, instructions, llc_misses, branch_misses
+    const int event_count = 4;
+
+    std::atomic<bool> active{false};
+    std::atomic<long long> calls[stage_count];
+    std::atomic<long long> totals[stage_count][event_count];
+    // Events opened by any thread, bit per event.
+    std::atomic<unsigned> supported{0};
+
+    thread_local unsigned open_mask = 0;
+
+#if defined(__linux__)
+    // The events of one thread as a group led by the first one opened, read in one syscall.
+    // Counting runs from the first use on the thread to its exit, scopes take differences.
+    class ThreadCounters {
+    public:
+        ThreadCounters() {
+            const uint64_t configs[event_count] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                   PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+            for (int e = 0; e < event_count; e++) {
+                perf_event_attr attr;
+                std::memset(&attr, 0, sizeof(attr));
+                attr.size = sizeof(attr);
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = configs[e];
+                attr.read_format = PERF_FORMAT_GROUP;
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+
+                const int fd = int(syscall(__NR_perf_event_open, &attr, 0, -1, leader, PERF_FLAG_FD_CLOEXEC));
+                if (fd < 0) {
+                    continue;
+                }
+                if (leader < 0) {
+                    leader = fd;
+                }
+                fds[e] = fd;
+                slots[e] = opened++;
+                supported.fetch_or(1u << e, std::memory_order_relaxed);
+            }
+        }
+
+        ~ThreadCounters() {
+            for (int fd : fds) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+            }
+        }
+
+        // Current values, -1 for the events not opened. Returns false when none is.
+        bool read(long long values[event_count]) const {
+            uint64_t buffer[1 + event_count];
+            if (leader < 0 || ::read(leader, buffer, sizeof(buffer)) < ssize_t(sizeof(uint64_t) * (1 + opened))) {
+                return false;
+            }
+            for (int e = 0; e < event_count; e++) {
+                values[e] = slots[e] >= 0 ? (long long) buffer[1 + slots[e]] : -1;
+            }
+            return true;
+        }
+
+    private:
+        int fds[event_count] = {-1, -1, -1, -1};
+        int slots[event_count] = {-1, -1, -1, -1};
+        int leader = -1, opened = 0;
+    };
+
+    bool _read(long long values[event_count]) {
+        thread_local ThreadCounters counters;
+        return counters.read(values);
+    }
+#else
+    bool _read(long long values[event_count]) {
+        return false;
+    }
+#endif
+
+    void _add(const unsigned stages, const long long begin[event_count], const long long end[event_count]) {
+        for (int s = 0; s < stage_count; s++) {
+            if (!(stages & (1u << s))) {
+                continue;
+            }
+            for (int e = 0; e < event_count; e++) {
+                if (begin[e] >= 0 && end[e] >= 0) {
+                    totals[s][e].fetch_add(end[e] - begin[e], std::memory_order_relaxed);
+                }
+            }
+        }
+    }
+}
+
+const char *rpm::perf_counters::to_string(const Stage stage) {
+    switch (stage) {
+        case Stage::correspondence:
+            return "correspondence";
+        case Stage::softassign:
+            return "softassign";
+        case Stage::transform:
+            return "transform";
+        case Stage::apply:
+            return "apply";
+    }
+    return "unknown";
+}
+
+double rpm::perf_counters::Counts::ipc() const {
+    return cycles > 0 && instructions >= 0 ? double(instructions) / cycles : 0;
+}
+
+double rpm::perf_counters::Counts::llc_mpki() const {
+    return instructions > 0 && llc_misses >= 0 ? 1000.0 * llc_misses / instructions : 0;
+}
+
+double rpm::perf_counters::Counts::branch_mpki() const {
+    return instructions > 0 && branch_misses >= 0 ? 1000.0 * branch_misses / instructions : 0;
+}
+
+bool rpm::perf_counters::available() {
+    long long values[event_count];
+    return _read(values) && values[0] >= 0;
+}
+
+void rpm::perf_counters::start() {
+    for (int s = 0; s < stage_count; s++) {
+        calls[s].store(0, std::memory_order_relaxed);
+        for (int e = 0; e < event_count; e++) {
+            totals[s][e].store(0, std::memory_order_relaxed);
+        }
+    }
+    active.store(true, std::memory_order_release);
+}
+
+void rpm::perf_counters::stop() {
+    active.store(false, std::memory_order_release);
+}
+
+bool rpm::perf_counters::counting() {
+    return active.load(std::memory_order_relaxed);
+}
+
+std::array<rpm::perf_counters::Counts, stage_count> rpm::perf_counters::read() {
+    const unsigned events = supported.load(std::memory_order_relaxed);
+    std::array<Counts, stage_count> counts;
+    for (int s = 0; s < stage_count; s++) {
+        long long values[event_count];
+        for (int e = 0; e < event_count; e++) {
+            values[e] = events & (1u << e) ? totals[s][e].load(std::memory_order_relaxed) : -1;
+        }
+        counts[s].calls = calls[s].load(std::memory_order_relaxed);
+        counts[s].cycles = values[0];
+        counts[s].instructions = values[1];
+        counts[s].llc_misses = values[2];
+        counts[s].branch_misses = values[3];
+    }
+    return counts;
+}
+
+rpm::perf_counters::StageScope::StageScope(const Stage stage) : stage(stage) {
+    const unsigned bit = 1u << int(stage);
+    if (!active.load(std::memory_order_relaxed) || (open_mask & bit) || !_read(begin)) {
+        return;
+    }
+    open = true;
+    open_mask |= bit;
+}
+
+rpm::perf_counters::StageScope::~StageScope() {
+    end();
+}
+
+void rpm::perf_counters::StageScope::end() {
+    if (!open) {
+        return;
+    }
+    open = false;
+    const unsigned bit = 1u << int(stage);
+    open_mask &= ~bit;
+
+    long long values[event_count];
+    if (_read(values)) {
+        _add(bit, begin, values);
+        calls[int(stage)].fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+unsigned rpm::perf_counters::open_stages() {
+    return open_mask;
+}
+
+rpm::perf_counters::TaskScope::TaskScope(const unsigned stages_) : stages(stages_ & ~open_mask) {
+    if (stages && !_read(begin)) {
+        stages = 0;
+    }
+}
+
+rpm::perf_counters::TaskScope::~TaskScope() {
+    long long values[event_count];
+    if (stages && _read(values)) {
+        _add(stages, begin, values);
+    }
+}
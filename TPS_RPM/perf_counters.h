@@ -0,0 +1,99 @@
+// This file is for counting hardware events per engine stage in profiled builds and runs.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include <array>
+
+namespace rpm {
+    namespace perf_counters {
+        // Engine stages counted with RpmInstrumentation::hardware_counters. A stage includes the
+        // stages nested in it, estimate_correspondence() includes its softassign and applyTransform().
+        enum class Stage {
+            correspondence,     // estimate_correspondence()
+            softassign,         // the softassign sweeps and scalings
+            transform,          // estimate_transform()
+            apply               // ThinPlateSplineParams::applyTransform()
+        };
+
+        const int stage_count = 4;
+
+        const char *to_string(const Stage stage);
+
+        // User space events of a stage, summed over the threads that worked on it. -1 for an
+        // event the host does not expose.
+        struct Counts {
+            long long calls = 0;
+            long long cycles = -1, instructions = -1;
+            // Last level cache misses (the generic cache-misses event) and mispredicted branches.
+            long long llc_misses = -1, branch_misses = -1;
+
+            // Instructions per cycle, 0 when not counted.
+            double ipc() const;
+
+            // Misses per 1000 instructions, 0 when not counted.
+            double llc_mpki() const;
+
+            double branch_mpki() const;
+        };
+
+        // perf_event_open() gives the cycles of the calling thread: Linux, a PMU visible to the
+        // process (often not in virtual machines) and kernel.perf_event_paranoid <= 2.
+        bool available();
+
+        // Zero the counts and count the stages from now on. The counts are process wide, stages of
+        // concurrent estimates are summed together.
+        void start();
+
+        void stop();
+
+        bool counting();
+
+        // Counts since start(), indexed by Stage.
+        std::array<Counts, stage_count> read();
+
+        // Counts the calling thread from construction to end() or destruction into stage, with the
+        // scheduler tasks submitted meanwhile on other threads. A stage already open on the thread
+        // is not counted again. Does nothing when not counting.
+        class StageScope {
+        public:
+            explicit StageScope(const Stage stage);
+
+            ~StageScope();
+
+            void end();
+
+            StageScope(const StageScope &) = delete;
+
+            StageScope &operator=(const StageScope &) = delete;
+
+        private:
+            Stage stage;
+            bool open = false;
+            long long begin[4];  // cycles, instructions, llc_misses, branch_misses
+        };
+
+        // Stages open on the calling thread, as a bit mask, for the tasks it submits.
+        unsigned open_stages();
+
+        // Counts a scheduler task into the stages its submitter had open, except the ones the
+        // executing thread counts itself.
+        class TaskScope {
+        public:
+            explicit TaskScope(const unsigned stages);
+
+            ~TaskScope();
+
+            TaskScope(const TaskScope &) = delete;
+
+            TaskScope &operator=(const TaskScope &) = delete;
+
+        private:
+            unsigned stages;
+            long long begin[4];  // cycles, instructions, llc_misses, branch_misses
+        };
+    }
+}
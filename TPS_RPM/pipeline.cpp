@@ -0,0 +1,225 @@
+// This file is for the load -> register -> emit batch pipeline.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "pipeline.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+using rpm::PipelineItem;
+using rpm::PipelineStageStats;
+
+namespace {
+    typedef std::chrono::steady_clock Clock;
+    typedef std::unique_ptr<PipelineItem> ItemPtr;
+
+    double _seconds(Clock::time_point t1, Clock::time_point t2) {
+        return std::chrono::duration<double>(t2 - t1).count();
+    }
+
+    // Blocking queue with a fixed capacity, closed once its producers are done.
+    class BoundedQueue {
+    public:
+        explicit BoundedQueue(int capacity) : capacity(std::max(capacity, 1)) {}
+
+        // Block while full, adds the waiting time to blocked.
+        void push(ItemPtr item, double &blocked) {
+            auto t1 = Clock::now();
+            std::unique_lock<std::mutex> lock(mutex);
+            not_full.wait(lock, [this] { return int(items.size()) < capacity; });
+            blocked += _seconds(t1, Clock::now());
+
+            items.push_back(std::move(item));
+            peak = std::max(peak, int(items.size()));
+            lock.unlock();
+            not_empty.notify_one();
+        }
+
+        // Block while empty and open, adds the waiting time to starved.
+        // Return false once the queue is closed and drained.
+        bool pop(ItemPtr &item, double &starved) {
+            auto t1 = Clock::now();
+            std::unique_lock<std::mutex> lock(mutex);
+            not_empty.wait(lock, [this] { return !items.empty() || closed; });
+            starved += _seconds(t1, Clock::now());
+
+            if (items.empty()) {
+                return false;
+            }
+            item = std::move(items.front());
+            items.pop_front();
+            lock.unlock();
+            not_full.notify_one();
+            return true;
+        }
+
+        void close() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                closed = true;
+            }
+            not_empty.notify_all();
+        }
+
+        int max_size() const {
+            return peak;
+        }
+
+    private:
+        const int capacity;
+        std::mutex mutex;
+        std::condition_variable not_full, not_empty;
+        std::deque<ItemPtr> items;
+        bool closed = false;
+        int peak = 0;
+    };
+
+    // Per worker counters, merged into the stage stats after the join.
+    struct WorkerStats {
+        int items = 0;
+        double busy_time = 0, starved_time = 0, blocked_time = 0;
+    };
+
+    // Start n workers running fn(stats), the last one to finish closes output.
+    void _start_stage(int n, BoundedQueue *output, std::atomic<int> &failed,
+                      vector<WorkerStats> &stats, vector<std::thread> &threads,
+                      const std::function<void(WorkerStats &)> &fn) {
+        stats.assign(n, WorkerStats());
+        auto remaining = std::make_shared<std::atomic<int> >(n);
+        for (int i = 0; i < n; i++) {
+            threads.emplace_back([&stats, &failed, remaining, output, fn, i] {
+                try {
+                    fn(stats[i]);
+                }
+                catch (std::exception &e) {
+                    std::cerr << e.what() << std::endl;
+                    failed++;
+                }
+                if (remaining->fetch_sub(1) == 1 && output) {
+                    output->close();
+                }
+            });
+        }
+    }
+
+    void _merge(const vector<WorkerStats> &workers, double wall_time, PipelineStageStats &stage) {
+        stage = PipelineStageStats();
+        stage.workers = workers.size();
+        for (const WorkerStats &w : workers) {
+            stage.items += w.items;
+            stage.busy_time += w.busy_time;
+            stage.starved_time += w.starved_time;
+            stage.blocked_time += w.blocked_time;
+        }
+        if (stage.workers > 0 && wall_time > 0) {
+            stage.occupancy = stage.busy_time / (stage.workers * wall_time);
+        }
+    }
+}
+
+bool rpm::run_pipeline(int item_num, const PipelineLoad &load, const PipelineEmit &emit,
+                       const PipelineConfig &config, PipelineStats *stats) {
+    try {
+        if (config.register_workers > 1 && config.config.instrumentation) {
+            throw std::invalid_argument("rpm::run_pipeline() instrumentation needs a single register worker!");
+        }
+
+        const int load_workers = std::max(config.load_workers, 1);
+        const int register_workers = std::max(config.register_workers, 1);
+        const int emit_workers = std::max(config.emit_workers, 1);
+
+        BoundedQueue register_queue(config.queue_capacity), emit_queue(config.queue_capacity);
+        std::atomic<int> next_index(0), failed(0);
+        vector<WorkerStats> load_stats, register_stats, emit_stats;
+        vector<std::thread> threads;
+
+        auto t1 = Clock::now();
+
+        _start_stage(load_workers, &register_queue, failed, load_stats, threads, [&](WorkerStats &w) {
+            for (int index = next_index++; index < item_num; index = next_index++) {
+                ItemPtr item(new PipelineItem());
+                item->index = index;
+
+                auto t_start = Clock::now();
+                bool loaded = false;
+                try {
+                    loaded = load(*item);
+                }
+                catch (std::exception &e) {
+                    std::cerr << e.what() << std::endl;
+                }
+                w.busy_time += _seconds(t_start, Clock::now());
+                w.items++;
+
+                if (!loaded) {
+                    failed++;
+                    continue;
+                }
+                register_queue.push(std::move(item), w.blocked_time);
+            }
+        });
+
+        _start_stage(register_workers, &emit_queue, failed, register_stats, threads, [&](WorkerStats &w) {
+            ItemPtr item;
+            while (register_queue.pop(item, w.starved_time)) {
+                auto t_start = Clock::now();
+                item->params.reset(new ThinPlateSplineParams(item->X));
+                item->ok = estimate_anytime(item->X, item->Y, item->M, *item->params, config.config,
+                                            config.budget, item->outcome, item->matched_point_indices);
+                w.busy_time += _seconds(t_start, Clock::now());
+                w.items++;
+
+                if (!item->ok) {
+                    failed++;
+                }
+                emit_queue.push(std::move(item), w.blocked_time);
+            }
+        });
+
+        _start_stage(emit_workers, nullptr, failed, emit_stats, threads, [&](WorkerStats &w) {
+            ItemPtr item;
+            while (emit_queue.pop(item, w.starved_time)) {
+                auto t_start = Clock::now();
+                try {
+                    emit(*item);
+                }
+                catch (std::exception &e) {
+                    std::cerr << e.what() << std::endl;
+                    failed++;
+                }
+                w.busy_time += _seconds(t_start, Clock::now());
+                w.items++;
+                item.reset();
+            }
+        });
+
+        for (auto &thread : threads) {
+            thread.join();
+        }
+
+        const double wall_time = _seconds(t1, Clock::now());
+        if (stats) {
+            *stats = PipelineStats();
+            stats->wall_time = wall_time;
+            _merge(load_stats, wall_time, stats->load);
+            _merge(register_stats, wall_time, stats->registration);
+            _merge(emit_stats, wall_time, stats->emit);
+            stats->register_queue_peak = register_queue.max_size();
+            stats->emit_queue_peak = emit_queue.max_size();
+            stats->failed = failed.load();
+        }
+
+        return failed.load() == 0;
+    }
+    catch (std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return false;
+    }
+}
@@ -0,0 +1,83 @@
+// This file is for the load -> register -> emit batch pipeline.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "rpm.h"
+
+namespace rpm {
+    // One registration flowing through the pipeline.
+    struct PipelineItem {
+        int index = -1;
+        std::string name;
+        MatrixXd X, Y;
+        vector<pair<int, int> > matched_point_indices;
+
+        // Filled in by the register stage.
+        bool ok = false;
+        MatrixXd M;
+        std::unique_ptr<ThinPlateSplineParams> params;
+        RpmOutcome outcome;
+    };
+
+    // Times are seconds summed over the workers of the stage.
+    struct PipelineStageStats {
+        int workers = 0;
+        int items = 0;
+        double busy_time = 0;     // running the stage function
+        double starved_time = 0;  // waiting on an empty input queue
+        double blocked_time = 0;  // waiting on a full output queue
+        double occupancy = 0;     // busy_time / (workers * wall_time)
+    };
+
+    struct PipelineStats {
+        double wall_time = 0;
+        PipelineStageStats load, registration, emit;
+        int register_queue_peak = 0;  // items waiting for registration
+        int emit_queue_peak = 0;      // items waiting to be emitted
+        int failed = 0;               // items not loaded, not registered or not emitted
+    };
+
+    struct PipelineConfig {
+        // Load and emit workers are plain threads for I/O, registration workers share the
+        // kernel scheduler, so one registration worker already uses every core.
+        int load_workers = 1;
+        int register_workers = 1;
+        int emit_workers = 1;
+
+        // Capacity of each queue between two stages, a full queue stalls the stage before it.
+        int queue_capacity = 4;
+
+        // config.instrumentation must be null when register_workers > 1.
+        RpmConfig config;
+        RpmBudget budget;
+    };
+
+    // Fill name, X, Y (and the anchors) of item, whose index is already set.
+    // Return false to drop the item.
+    typedef std::function<bool(PipelineItem &item)> PipelineLoad;
+
+    // Consume a registered item, item.ok tells whether rpm::estimate_anytime succeeded.
+    typedef std::function<void(PipelineItem &item)> PipelineEmit;
+
+    // Run item_num items through load -> register -> emit, the stages overlap on
+    // different items. Items reach emit in completion order, not index order.
+    // Input:
+    //   item_num : number of items, load is called with index 0 .. item_num - 1
+    //   load : load stage
+    //   emit : emit stage
+    //   config : worker counts, queue capacity and registration settings
+    // Output:
+    //   stats : optional stage occupancy and queue metrics
+    // Return false if any item failed in any stage.
+    bool run_pipeline(int item_num, const PipelineLoad &load, const PipelineEmit &emit,
+                      const PipelineConfig &config, PipelineStats *stats = nullptr);
+}
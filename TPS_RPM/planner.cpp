@@ -0,0 +1,332 @@
+// This file is for planning the memory and time of rpm::estimate before running it.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "planner.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <memory>
+
+#include "alloc_counter.h"
+#include "data_process.h"
+#include "parallel.h"
+
+namespace {
+    // Effective rate of the estimate kernels on one thread, flops per second.
+    const double flops_per_thread = 1e9;
+
+    // Fewest centers of a reduced plan, 3 times the affine part.
+    const int min_centers = 3 * (rpm::D + 1);
+
+    // Annealing temperatures of the schedule, an upper bound as the pre-alignments shorten it.
+    int _temperatures(const rpm::RpmConfig &config) {
+        const double ratio = config.auto_T_start ? config.T_end_ratio : config.T_end / config.T_start;
+        if (!(ratio < 1) || !(config.r > 0 && config.r < 1)) {
+            return 1;
+        }
+        return int(std::floor(std::log(ratio) / std::log(config.r))) + 1;
+    }
+
+    // Fill plan.peak_bytes, plan.time and plan.fits from the sizes of the matrices alive at once.
+    //
+    // With k centers and n targets (doubles unless noted):
+    //   inputs			copies of X and Y, normalized and homogeneous, 9 (K + N)
+    //   spline			phi and Q, 2 k^2
+    //   basis			V and U, 2 k^2, 5 k^2 while building
+    //   dense solve	W, T, Q2' * T * Q2, its normal matrix and LDLT, 5 k^2 per iteration
+    //   correspondence	k * n, twice while conservativeResize() drops the outlier row and column,
+    //					in float 4 bytes an entry and 12 at the end when M is cast to double,
+    //					matrix free O(k + n) and k * n only for the output
+    //   gauss transform	O(k + n) per E-step
+    void _evaluate(rpm::RpmPlan &plan, const rpm::RpmConfig &config, const size_t memory_limit) {
+        const double K = plan.K, k = plan.centers, n = plan.N, kn = k * n, kk = k * k;
+        const bool basis = plan.solve_basis || plan.use_cpd || config.solve_basis;
+        const int temperatures = _temperatures(config);
+
+        double inputs = 8 * 9 * (K + n);
+        if (plan.strategy == rpm::RpmStrategy::reduced_centers) {
+            // Copy, hash and mapping of the Poisson-disk sampling.
+            inputs += 8 * 8 * K;
+        }
+        const double spline = 8 * 2 * kk;
+        // A basis of the caller is not counted.
+        const double basis_build = plan.solve_basis || plan.use_cpd ? 8 * 5 * kk : 0;
+        const double basis_steady = plan.solve_basis || plan.use_cpd ? 8 * 2 * kk : 0;
+        const double basis_flops = plan.solve_basis || plan.use_cpd ? 15 * kk * k : 0;
+        // Conjugate gradient steps on the eigen basis or the dense LDLT of the normal equations.
+        const double solve_flops = basis ? 150 * kk : 1.75 * kk * k;
+
+        double peak = 0, flops = 0;
+        if (plan.strategy == rpm::RpmStrategy::affine) {
+            const double neighbors = config.affine_neighbors;
+            peak = inputs + 8 * 8 * (k + n) + 12 * k * neighbors + (plan.output_correspondence ? 8 * kn : 0);
+            flops = temperatures * config.I0 * 60 * (k + n) * neighbors;
+        } else if (plan.use_cpd) {
+            const int iterations = std::min(temperatures, config.cpd_max_iterations);
+            peak = inputs + spline + std::max(basis_build, basis_steady + std::max(8 * 32 * (k + n),
+                                                                                    plan.output_correspondence
+                                                                                    ? 8 * kn : 0));
+            flops = basis_flops + iterations * (400 * (k + n) + solve_flops)
+                    + (plan.output_correspondence ? 30 * kn : 0);
+        } else if (plan.matrix_free_correspondence) {
+            const double solve = basis ? 0 : 8 * 5 * kk;
+            const double sums = 8 * 16 * (k + n);
+            peak = inputs + spline + std::max(basis_build, basis_steady
+                                                           + std::max(sums + solve,
+                                                                      plan.output_correspondence ? 8 * kn : 0));
+            // Every softassign sweep recomputes the affinity twice, the sums once more.
+            const double entry_flops = 20 + 30 * config.I1;
+            flops = basis_flops + temperatures * config.I0 * (entry_flops * kn + solve_flops)
+                    + (plan.output_correspondence ? 20 * kn : 0);
+        } else {
+            const double M_steady = plan.float_correspondence ? 4 * kn : 8 * kn;
+            const double M_transient = plan.float_correspondence ? 12 * kn : 16 * kn;
+            const double solve = basis ? 0 : 8 * 5 * kk;
+            peak = inputs + spline + std::max(basis_build, basis_steady + std::max(M_transient, M_steady + solve));
+            // Affinity, softassign sweeps, scalings and M * Y per entry of M, the exp and the
+            // memory bound sweeps counted at their cost in flops.
+            const double entry_flops = 30 + 10 * config.I1 + (plan.float_correspondence ? 8 : 0);
+            flops = basis_flops + temperatures * config.I0 * (entry_flops * kn + solve_flops);
+        }
+
+        plan.peak_bytes = size_t(peak);
+        plan.time = flops / (flops_per_thread * rpm::parallel::num_threads());
+        plan.fits = memory_limit == 0 || peak <= double(memory_limit);
+    }
+
+    // The reduced plan on the backend of base with the most centers that fit, fits is false when
+    // even min_centers do not.
+    rpm::RpmPlan _reduce(rpm::RpmPlan base, const rpm::RpmConfig &config, const size_t memory_limit) {
+        base.strategy = rpm::RpmStrategy::reduced_centers;
+        base.output_correspondence = false;
+        auto fits = [&](const int centers) {
+            base.centers = centers;
+            _evaluate(base, config, memory_limit);
+            return base.fits;
+        };
+
+        int lo = std::min(min_centers, base.K), hi = base.K - 1;
+        if (!fits(lo)) {
+            return base;
+        }
+        while (lo < hi) {
+            const int mid = lo + (hi - lo + 1) / 2;
+            if (fits(mid)) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        fits(lo);
+
+        // The dense backend forms M anyway, the matrix free one only when it still fits.
+        rpm::RpmPlan output = base;
+        output.output_correspondence = config.output_correspondence;
+        _evaluate(output, config, memory_limit);
+        return output.fits ? output : base;
+    }
+}
+
+const char *rpm::to_string(const RpmStrategy strategy) {
+    switch (strategy) {
+        case RpmStrategy::dense:
+            return "dense";
+        case RpmStrategy::matrix_free:
+            return "matrix_free";
+        case RpmStrategy::reduced_centers:
+            return "reduced_centers";
+        case RpmStrategy::affine:
+            return "affine";
+    }
+    return "unknown";
+}
+
+rpm::RpmPlan rpm::plan_estimate(const int K, const int N, const RpmConfig &config, const size_t memory_limit) {
+    if (K <= D + 1 || N <= 0) {
+        throw std::invalid_argument("rpm::plan_estimate() needs more than D + 1 source points and some targets!");
+    }
+
+    RpmPlan plan;
+    plan.K = K;
+    plan.N = N;
+    plan.centers = K;
+    plan.float_correspondence = config.float_correspondence;
+    plan.matrix_free_correspondence = config.matrix_free_correspondence && !config.use_cpd;
+    plan.output_correspondence = config.output_correspondence;
+    if (plan.matrix_free_correspondence) {
+        plan.strategy = RpmStrategy::matrix_free;
+    }
+
+    if (config.affine_only) {
+        plan.strategy = RpmStrategy::affine;
+        _evaluate(plan, config, memory_limit);
+        if (!plan.fits && plan.output_correspondence) {
+            plan.output_correspondence = false;
+            _evaluate(plan, config, memory_limit);
+        }
+        return plan;
+    }
+
+    // CPD is another model, it is only planned when the config asks for it. Otherwise the softassign
+    // falls back to its own matrix free form.
+    vector<RpmPlan> candidates;
+    if (!config.use_cpd) {
+        candidates.push_back(plan);
+        plan.solve_basis = true;
+        candidates.push_back(plan);
+        plan.float_correspondence = true;
+        candidates.push_back(plan);
+        plan.float_correspondence = false;
+        plan.matrix_free_correspondence = true;
+    } else {
+        plan.use_cpd = true;
+        plan.solve_basis = true;
+        plan.float_correspondence = false;
+        plan.matrix_free_correspondence = false;
+    }
+    plan.strategy = RpmStrategy::matrix_free;
+    if (config.output_correspondence) {
+        candidates.push_back(plan);
+    }
+    plan.output_correspondence = false;
+    candidates.push_back(plan);
+
+    for (RpmPlan &candidate : candidates) {
+        _evaluate(candidate, config, memory_limit);
+        if (candidate.fits) {
+            return candidate;
+        }
+    }
+
+    // Fewer centers, on the backend that keeps the most of them.
+    RpmPlan best = _reduce(plan, config, memory_limit);
+    if (!config.use_cpd) {
+        const RpmPlan dense = _reduce(candidates[2], config, memory_limit);
+        if (dense.fits && (!best.fits || dense.centers >= best.centers)) {
+            best = dense;
+        }
+    }
+    return best;
+}
+
+bool rpm::estimate_planned(
+        const MatrixXd &X_,
+        const MatrixXd &Y_,
+        MatrixXd &M,
+        ThinPlateSplineParams &params,
+        const RpmConfig &config,
+        const size_t memory_limit,
+        const RpmBudget &budget,
+        RpmPlan &plan,
+        RpmOutcome &outcome,
+        const vector<pair<int, int> > &matched_point_indices) {
+    const auto t1 = std::chrono::steady_clock::now();
+    const long long heap_start = alloc_counter::reset_peak();
+    outcome = RpmOutcome();
+    M.resize(0, 0);
+
+    try {
+        if (X_.cols() != D || Y_.cols() != D) {
+            throw std::invalid_argument("rpm::estimate_planned() only support 2d points!");
+        }
+        plan = plan_estimate(int(X_.rows()), int(Y_.rows()), config, memory_limit);
+        if (config.verbose) {
+            std::cout << "Plan : " << to_string(plan.strategy) << ", " << plan.centers << " centers, "
+                      << plan.peak_bytes / 1048576.0 << " MB, " << plan.time << " s"
+                      << (plan.fits ? "" : ", over the memory limit") << std::endl;
+        }
+        if (!plan.fits) {
+            throw std::runtime_error("rpm::estimate_planned() no plan fits the memory limit!");
+        }
+
+        // The frame estimate() would give the full sets.
+        MatrixXd X = X_, Y = Y_;
+        data_process::preprocess(X, Y);
+
+        vector<pair<int, int> > matches = matched_point_indices;
+        if (plan.strategy == RpmStrategy::reduced_centers) {
+            // The anchored rows are centers, the Poisson-disk sample fills the rest of the planned count.
+            const int K = X.rows();
+            vector<char> chosen(K, 0);
+            int chosen_num = 0;
+            for (auto point_pair : matched_point_indices) {
+                if (point_pair.first >= 0 && point_pair.first < K && !chosen[point_pair.first]) {
+                    chosen[point_pair.first] = 1;
+                    chosen_num++;
+                }
+            }
+            if (chosen_num < plan.centers) {
+                data_process::SampleOptions options;
+                options.method = data_process::SampleMethod::poisson_disk;
+                options.sample_num = plan.centers - chosen_num;
+                data_process::SampleMapping mapping;
+                MatrixXd centers = X;
+                data_process::downsample(centers, options, &mapping);
+                for (int k : mapping.kept) {
+                    if (chosen_num < plan.centers && !chosen[k]) {
+                        chosen[k] = 1;
+                        chosen_num++;
+                    }
+                }
+            }
+            vector<int> center_of(K, -1);
+            for (int k = 0; k < K; k++) {
+                if (chosen[k]) {
+                    center_of[k] = int(plan.center_rows.size());
+                    plan.center_rows.push_back(k);
+                }
+            }
+
+            matches.clear();
+            for (auto point_pair : matched_point_indices) {
+                if (point_pair.first >= 0 && point_pair.first < K) {
+                    matches.emplace_back(center_of[point_pair.first], point_pair.second);
+                }
+            }
+            MatrixXd centers = X(plan.center_rows, Eigen::all);
+            X = centers;
+
+            // More anchors than planned centers only fit when the plan had room to spare.
+            plan.centers = X.rows();
+            _evaluate(plan, config, memory_limit);
+            if (!plan.fits) {
+                throw std::runtime_error("rpm::estimate_planned() the anchored points alone exceed the memory limit!");
+            }
+        }
+
+        data_process::homo(X);
+        data_process::homo(Y);
+        params = ThinPlateSplineParams(X, config.affine_only);
+
+        RpmConfig run = config;
+        run.use_cpd = plan.use_cpd;
+        run.float_correspondence = plan.float_correspondence;
+        run.matrix_free_correspondence = plan.matrix_free_correspondence;
+        run.output_correspondence = plan.output_correspondence;
+        std::unique_ptr<TpsSolveBasis> basis;
+        if (plan.solve_basis) {
+            basis.reset(new TpsSolveBasis(params));
+            run.solve_basis = basis.get();
+        }
+
+        if (!estimate_prepared(X, Y, M, params, run, budget, outcome, matches)) {
+            return false;
+        }
+    }
+    catch (const std::exception &e) {
+        outcome.error = e.what();
+        std::cerr << e.what() << std::endl;
+        return false;
+    }
+
+    plan.actual_peak_bytes = heap_start >= 0 ? alloc_counter::peak_bytes() - heap_start : -1;
+    plan.actual_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - t1).count();
+    if (config.verbose && plan.actual_peak_bytes >= 0) {
+        std::cout << "Plan peak : " << plan.actual_peak_bytes / 1048576.0 << " MB" << std::endl;
+    }
+    return true;
+}
@@ -0,0 +1,107 @@
+// This file is for planning the memory and time of rpm::estimate before running it.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include <cstddef>
+
+#include "rpm.h"
+
+namespace rpm {
+    // How a planned estimate runs, the first three in order of preference.
+    enum class RpmStrategy {
+        // Softassign on the dense (K + 1) * (N + 1) correspondence, see estimate_anytime().
+        dense,
+        // The EM backend of RpmConfig::use_cpd or the tiled softassign of
+        // RpmConfig::matrix_free_correspondence, no K * N matrix is formed while iterating.
+        matrix_free,
+        // The spline built on a Poisson-disk subset of X, the centers, dense or matrix free.
+        reduced_centers,
+        // RpmConfig::affine_only, only taken when the config asks for it.
+        affine
+    };
+
+    const char *to_string(const RpmStrategy strategy);
+
+    // Estimated peak memory and time of one estimate, and the settings that keep it in a memory limit.
+    struct RpmPlan {
+        RpmStrategy strategy = RpmStrategy::dense;
+        int K = 0, N = 0;
+        // Source points the spline is built on, below K only with reduced_centers.
+        int centers = 0;
+
+        // Settings applied on top of the config, see RpmConfig.
+        bool use_cpd = false;
+        bool float_correspondence = false;
+        bool matrix_free_correspondence = false;
+        bool output_correspondence = true;
+        // A TpsSolveBasis is built for the O(K^2) transform solves.
+        bool solve_basis = false;
+
+        // Peak heap bytes and seconds, from the sizes and a fixed flop rate per thread.
+        // The time is an order of magnitude for comparing plans, not a deadline.
+        size_t peak_bytes = 0;
+        double time = 0;
+        // peak_bytes is within the memory limit. When false the plan is the smallest one found.
+        bool fits = true;
+
+        // Filled in by estimate_planned():
+        // rows of X used as centers with reduced_centers, empty otherwise
+        vector<int> center_rows;
+        // heap high-water mark above the bytes in use at the start, -1 unless built with
+        // RPM_COUNT_ALLOCATIONS, see alloc_counter.h
+        long long actual_peak_bytes = -1;
+        double actual_time = 0;
+    };
+
+    // Plan an estimate of K source and N target points with config under memory_limit bytes.
+    //
+    // The config is kept when it fits (0 is no limit). Otherwise the first of these that fits:
+    // a TpsSolveBasis instead of the dense K * K solve, the float correspondence, the matrix free
+    // softassign (with the final K * N correspondence when it fits), and the most centers that fit
+    // on either backend. The CPD backend is a different model and only planned with RpmConfig::use_cpd,
+    // then only its plans are considered. With RpmConfig::affine_only the plan is only estimated.
+    // A config asking for RpmConfig::matrix_free_correspondence keeps it in the dense and reduced plans.
+    //
+    RpmPlan plan_estimate(
+            const int K,
+            const int N,
+            const RpmConfig &config = RpmConfig(),
+            const size_t memory_limit = 0
+    );
+
+    // estimate_anytime() with the settings of plan_estimate().
+    //
+    // With reduced_centers the params are built on the centers, X(plan.center_rows, :), and M is
+    // centers * N. The params still map the frame data_process::preprocess() gives the full X and Y,
+    // so params.applyTransform(P) warps any point of X as after estimate(). Anchored rows are always
+    // centers and count toward the planned ones, plan is evaluated again on the centers taken.
+    // Without output_correspondence M is left empty.
+    //
+    // Input:
+    //   X, Y			source and target points set, 2d
+    //	 memory_limit	bytes, 0 for no limit
+    //	 budget			deadline and cancellation token
+    // Output:
+    //	 M				correspondence
+    //	 params			thin-plate spline params
+    //	 plan			chosen plan with the measured peak and time
+    //	 outcome		see estimate_anytime()
+    // Returns true when a model is returned, false on failure
+    //
+    bool estimate_planned(
+            const MatrixXd &X,
+            const MatrixXd &Y,
+            MatrixXd &M,
+            ThinPlateSplineParams &params,
+            const RpmConfig &config,
+            const size_t memory_limit,
+            const RpmBudget &budget,
+            RpmPlan &plan,
+            RpmOutcome &outcome,
+            const vector<pair<int, int> > &matched_point_indices = vector<pair<int, int> >()
+    );
+}
@@ -8,62 +8,55 @@
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/opencv.hpp>
 
+#include "raster.h"
+
+// Debug overlay of normalized point sets on a 3 * dstWid by 3 * dstHei image, the point
+// (x, y) lands on (x / 2 * dstWid + dstWid, y / 2 * dstHei + dstHei).
+// Drawing only queues layers on a rpm::raster::Canvas, _m_imgShow is filled by render().
 class PointsShowOnMat {
 public:
-    PointsShowOnMat() {
-        _dstWid = 300;
-        _dstHei = 300;
-        _m_imgShow = cv::Mat(_dstHei + _dstHei + _dstHei, _dstWid + _dstWid + _dstWid, CV_8UC3,
-                             cv::Scalar(255, 255, 255));
-    }
+    PointsShowOnMat() : PointsShowOnMat(300, 300) {}
 
 public:
-    PointsShowOnMat(int dstWid, int dstHei) {
+    PointsShowOnMat(int dstWid, int dstHei)
+            : _canvas(dstWid * 3, dstHei * 3, rpm::raster::Color(255, 255, 255)) {
         _dstWid = dstWid;
         _dstHei = dstHei;
-        _m_imgShow = cv::Mat(_dstHei + _dstHei + _dstHei, _dstWid + _dstWid + _dstWid, CV_8UC3,
-                             cv::Scalar(255, 255, 255));
+        _canvas.set_view(Eigen::Vector2d(_dstWid / 2.0, _dstHei / 2.0), Eigen::Vector2d(_dstWid, _dstHei));
     }
 
+    // Lines every 50 pixels (horizontally) over the whole image.
     void show_grid_on_image(cv::Scalar color = cv::Scalar(128, 128, 128)) {
-        for (int i = -_dstWid; i < _dstWid + _dstWid; i += 50) {
-            grid_vec_x.push_back(i + _dstWid);
-        }
-        for (int j = -_dstHei; j < _dstHei + _dstHei; j += 50) {
-            grid_vec_y.push_back(j + _dstHei);
-        }
-
-        for (int j = 0; j < grid_vec_y.size() - 1; j += 1) {
-            for (int i = 0; i < grid_vec_x.size() - 1; i += 1) {
-                cv::line(_m_imgShow, cv::Point2d(grid_vec_x[i], grid_vec_x[j]),
-                         cv::Point2d(grid_vec_x[i], grid_vec_x[j + 1]), color, 1);
-                cv::line(_m_imgShow, cv::Point2d(grid_vec_x[i], grid_vec_x[j]),
-                         cv::Point2d(grid_vec_x[i + 1], grid_vec_x[j]), color, 1);
-            }
-        }
+        _canvas.add_grid(Eigen::Vector2d(-2, -2), Eigen::Vector2d(4, 4), 100.0 / _dstWid, _color(color));
     }
 
-    std::vector<int> grid_vec_x;
-    std::vector<int> grid_vec_y;
-
-
-    void show_pts_on_image(Eigen::MatrixXd X_origin__t, cv::Scalar color, double radius) {
-        Eigen::MatrixXd X_origin = X_origin__t / 2.0;
-
-        for (int i = 0; i < X_origin.rows(); i++) {
-            cv::Point2d pt = getDstPt(X_origin.row(i).x(), X_origin.row(i).y());
-            cv::circle(_m_imgShow, pt, radius, color, 1);
-        }
+    void show_pts_on_image(const Eigen::MatrixXd &X_origin, cv::Scalar color, double radius) {
+        _canvas.add_points(X_origin, _color(color), (int) std::lround(radius), false);
     }
 
     cv::Point2d getDstPt(double x, double y) {
-        return cv::Point2d(x * _dstWid + _dstWid, y * _dstHei + _dstHei);
+        return cv::Point2d(x / 2 * _dstWid + _dstWid, y / 2 * _dstHei + _dstHei);
+    }
+
+    // Render the queued layers into _m_imgShow, which shares the canvas memory.
+    const cv::Mat &render() {
+        const rpm::raster::Image &image = _canvas.render();
+        _m_imgShow = cv::Mat(image.height, image.width, CV_8UC3, (void *) image.data.data());
+        return _m_imgShow;
     }
 
 public:
     cv::Mat _m_imgShow;
     int _dstWid;
     int _dstHei;
+
+private:
+    static rpm::raster::Color _color(const cv::Scalar &color) {
+        return rpm::raster::Color(cv::saturate_cast<uchar>(color[0]), cv::saturate_cast<uchar>(color[1]),
+                                  cv::saturate_cast<uchar>(color[2]));
+    }
+
+    rpm::raster::Canvas _canvas;
 };
 
 #endif // POINTSSHOWONMAT_H
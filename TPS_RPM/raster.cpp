@@ -0,0 +1,252 @@
+// This file is for the headless point and grid rasterizer used by the debug output.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "raster.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "parallel.h"
+
+using rpm::raster::Color;
+
+namespace {
+    inline void _set(rpm::raster::Image &img, int x, int y, const Color &color) {
+        uint8_t *p = &img.data[(size_t(y) * img.width + x) * 3];
+        p[0] = color.b;
+        p[1] = color.g;
+        p[2] = color.r;
+    }
+
+    // Offsets of a disk, or of a one pixel wide ring, sorted by dy.
+    vector<pair<int, int> > _stencil(int radius, bool filled) {
+        vector<pair<int, int> > stencil;
+        const double outer = (radius + 0.5) * (radius + 0.5);
+        const double inner = filled ? -1 : (radius - 0.5) * (radius - 0.5);
+        for (int dy = -radius; dy <= radius; dy++) {
+            for (int dx = -radius; dx <= radius; dx++) {
+                const double d2 = dx * dx + dy * dy;
+                if (d2 <= outer && d2 > inner) {
+                    stencil.emplace_back(dx, dy);
+                }
+            }
+        }
+        return stencil;
+    }
+
+    // Restrict [t_lo, t_hi] to the part of p0 + t * dp within [lo, hi].
+    inline void _clip(double p0, double dp, double lo, double hi, double &t_lo, double &t_hi) {
+        if (std::abs(dp) < 1e-12) {
+            if (p0 < lo || p0 > hi) {
+                t_hi = -1;
+            }
+            return;
+        }
+        double ta = (lo - p0) / dp, tb = (hi - p0) / dp;
+        if (ta > tb) {
+            std::swap(ta, tb);
+        }
+        t_lo = std::max(t_lo, ta);
+        t_hi = std::min(t_hi, tb);
+    }
+}
+
+rpm::raster::Image::Image(int width, int height, const Color &background)
+        : width(width), height(height), data(size_t(width) * height * 3) {
+    for (size_t i = 0; i < data.size(); i += 3) {
+        data[i] = background.b;
+        data[i + 1] = background.g;
+        data[i + 2] = background.r;
+    }
+}
+
+rpm::raster::Canvas::Canvas(int width, int height, const Color &background)
+        : img(width, height, background), background(background) {}
+
+void rpm::raster::Canvas::fit(const Vector2d &min, const Vector2d &max, int padding) {
+    const Vector2d size = (max - min).cwiseMax(Vector2d::Constant(1e-12));
+    const double usable_w = std::max(img.width - 2 * padding, 1);
+    const double usable_h = std::max(img.height - 2 * padding, 1);
+    scale = Vector2d::Constant(std::min(usable_w / size.x(), usable_h / size.y()));
+    offset = Vector2d::Constant(padding) - min.cwiseProduct(scale);
+}
+
+void rpm::raster::Canvas::set_view(const Vector2d &scale_, const Vector2d &offset_) {
+    scale = scale_;
+    offset = offset_;
+}
+
+void rpm::raster::Canvas::_to_pixels(const MatrixXd &P, std::vector<float> &coords, int stride, int col) const {
+    parallel::parallel_for(0, int(P.rows()), parallel::grain_for(8), [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            coords[size_t(i) * stride + col] = float(P(i, 0) * scale.x() + offset.x());
+            coords[size_t(i) * stride + col + 1] = float(P(i, 1) * scale.y() + offset.y());
+        }
+    });
+}
+
+void rpm::raster::Canvas::add_points(const MatrixXd &P, const Color &color, int radius, bool filled) {
+    if (P.cols() < rpm::D) {
+        throw std::invalid_argument("rpm::raster::Canvas::add_points() only support 2d points!");
+    }
+
+    Layer layer;
+    layer.color = color;
+    layer.radius = std::max(radius, 0);
+    layer.stencil = _stencil(layer.radius, filled || layer.radius == 0);
+    layer.coords.resize(size_t(P.rows()) * 2);
+    _to_pixels(P, layer.coords, 2, 0);
+    layers.push_back(std::move(layer));
+}
+
+void rpm::raster::Canvas::add_segments(const MatrixXd &A, const MatrixXd &B, const Color &color) {
+    if (A.rows() != B.rows() || A.cols() < rpm::D || B.cols() < rpm::D) {
+        throw std::invalid_argument("rpm::raster::Canvas::add_segments() needs two 2d point sets of one size!");
+    }
+
+    Layer layer;
+    layer.segments = true;
+    layer.color = color;
+    layer.coords.resize(size_t(A.rows()) * 4);
+    _to_pixels(A, layer.coords, 4, 0);
+    _to_pixels(B, layer.coords, 4, 2);
+    layers.push_back(std::move(layer));
+}
+
+void rpm::raster::Canvas::add_grid(const Vector2d &min, const Vector2d &max, double step, const Color &color,
+                                   const Warp &warp, int subdivisions) {
+    if (step <= 0) {
+        throw std::invalid_argument("rpm::raster::Canvas::add_grid() needs a positive step!");
+    }
+
+    const int nx = int(std::floor((max.x() - min.x()) / step)) + 1;
+    const int ny = int(std::floor((max.y() - min.y()) / step)) + 1;
+    const int sub = warp ? std::max(subdivisions, 1) : 1;
+    // Samples along each line: a straight line only needs its ends.
+    const int samples_x = warp ? (ny - 1) * sub + 1 : 2;  // along a vertical line
+    const int samples_y = warp ? (nx - 1) * sub + 1 : 2;  // along a horizontal line
+    const double end_y = min.y() + (ny - 1) * step, end_x = min.x() + (nx - 1) * step;
+
+    MatrixXd S(nx * samples_x + ny * samples_y, rpm::D);
+    int row = 0;
+    for (int i = 0; i < nx; i++) {
+        for (int s = 0; s < samples_x; s++) {
+            S(row, 0) = min.x() + i * step;
+            S(row, 1) = samples_x == 2 ? (s == 0 ? min.y() : end_y) : min.y() + s * step / sub;
+            row++;
+        }
+    }
+    for (int j = 0; j < ny; j++) {
+        for (int s = 0; s < samples_y; s++) {
+            S(row, 0) = samples_y == 2 ? (s == 0 ? min.x() : end_x) : min.x() + s * step / sub;
+            S(row, 1) = min.y() + j * step;
+            row++;
+        }
+    }
+
+    if (warp) {
+        S = warp(S);
+    }
+
+    // Consecutive samples of a line form its segments.
+    const int segments = nx * (samples_x - 1) + ny * (samples_y - 1);
+    MatrixXd A(segments, rpm::D), B(segments, rpm::D);
+    int seg = 0, first = 0;
+    for (int line = 0; line < nx + ny; line++) {
+        const int samples = line < nx ? samples_x : samples_y;
+        for (int s = 0; s + 1 < samples; s++) {
+            A.row(seg) = S.row(first + s).head(rpm::D);
+            B.row(seg) = S.row(first + s + 1).head(rpm::D);
+            seg++;
+        }
+        first += samples;
+    }
+
+    add_segments(A, B, color);
+}
+
+void rpm::raster::Canvas::clear_layers() {
+    layers.clear();
+}
+
+const rpm::raster::Image &rpm::raster::Canvas::render() {
+    const int band = std::max(1, img.height / (4 * parallel::num_threads()));
+
+    parallel::parallel_for(0, img.height, band, [&](int y_begin, int y_end) {
+        for (int y = y_begin; y < y_end; y++) {
+            for (int x = 0; x < img.width; x++) {
+                _set(img, x, y, background);
+            }
+        }
+        for (const Layer &layer : layers) {
+            if (layer.segments) {
+                _draw_segments(layer, y_begin, y_end);
+            } else {
+                _draw_points(layer, y_begin, y_end);
+            }
+        }
+    });
+
+    return img;
+}
+
+void rpm::raster::Canvas::_draw_points(const Layer &layer, int y_begin, int y_end) {
+    const int n = layer.coords.size() / 2;
+    const int r = layer.radius;
+
+    for (int i = 0; i < n; i++) {
+        const float fx = layer.coords[2 * i], fy = layer.coords[2 * i + 1];
+        if (!(fy > y_begin - r - 1.0f && fy < y_end + r + 1.0f) || !(fx > -r - 1.0f && fx < img.width + r + 1.0f)) {
+            continue;  // also skips NaN
+        }
+        const int cx = int(std::lround(fx)), cy = int(std::lround(fy));
+
+        for (const auto &offset : layer.stencil) {
+            const int y = cy + offset.second;
+            if (y < y_begin) {
+                continue;
+            }
+            if (y >= y_end) {
+                break;
+            }
+            const int x = cx + offset.first;
+            if (x >= 0 && x < img.width) {
+                _set(img, x, y, layer.color);
+            }
+        }
+    }
+}
+
+void rpm::raster::Canvas::_draw_segments(const Layer &layer, int y_begin, int y_end) {
+    const int n = layer.coords.size() / 4;
+
+    for (int i = 0; i < n; i++) {
+        const double x0 = layer.coords[4 * i], y0 = layer.coords[4 * i + 1];
+        const double dx = layer.coords[4 * i + 2] - x0, dy = layer.coords[4 * i + 3] - y0;
+        if (!std::isfinite(x0 + y0 + dx + dy)) {
+            continue;
+        }
+
+        // Part of the segment inside this band and the image columns.
+        double t_lo = 0, t_hi = 1;
+        _clip(y0, dy, y_begin - 0.5, y_end - 0.5, t_lo, t_hi);
+        _clip(x0, dx, -0.5, img.width - 0.5, t_lo, t_hi);
+        if (t_lo > t_hi) {
+            continue;
+        }
+
+        const double steps = std::max(std::ceil(std::max(std::abs(dx), std::abs(dy))), 1.0);
+        const long long s_begin = (long long) std::floor(t_lo * steps);
+        const long long s_end = (long long) std::ceil(t_hi * steps);
+        for (long long s = s_begin; s <= s_end; s++) {
+            const double t = s / steps;
+            const int x = int(std::lround(x0 + t * dx)), y = int(std::lround(y0 + t * dy));
+            if (y >= y_begin && y < y_end && x >= 0 && x < img.width) {
+                _set(img, x, y, layer.color);
+            }
+        }
+    }
+}
@@ -0,0 +1,97 @@
+// This file is for the headless point and grid rasterizer used by the debug output.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "rpm.h"
+
+namespace rpm {
+    namespace raster {
+        // Channel order matches CV_8UC3.
+        struct Color {
+            uint8_t b = 0, g = 0, r = 0;
+
+            Color() = default;
+
+            Color(uint8_t b, uint8_t g, uint8_t r) : b(b), g(g), r(r) {}
+        };
+
+        // 8 bit, 3 channel, row-major, same layout as a continuous CV_8UC3 cv::Mat.
+        struct Image {
+            int width = 0, height = 0;
+            std::vector<uint8_t> data;
+
+            Image() = default;
+
+            Image(int width, int height, const Color &background);
+        };
+
+        // Batch warp of points (rows) for Canvas::add_grid(), e.g. a ThinPlateSplineParams::applyTransform.
+        typedef std::function<MatrixXd(const MatrixXd &P)> Warp;
+
+        // Layers of point splats and line segments, rendered in one parallel pass.
+        //
+        // add_*() only converts the inputs to pixel coordinates (in parallel for large sets),
+        // render() splits the image into row bands and every band draws all layers in
+        // insertion order, so later layers are on top and the output does not depend on
+        // the thread count.
+        class Canvas {
+        public:
+            Canvas(int width, int height, const Color &background = Color(255, 255, 255));
+
+            // Map [min, max] into the image with padding pixels around, keeping the aspect ratio.
+            void fit(const Vector2d &min, const Vector2d &max, int padding = 20);
+
+            // Pixel = point .* scale + offset, per axis. The default view is the identity.
+            void set_view(const Vector2d &scale, const Vector2d &offset);
+
+            // Disk (filled) or ring of radius pixels at every row of P.
+            void add_points(const MatrixXd &P, const Color &color, int radius = 1, bool filled = true);
+
+            // Segments from the rows of A to the rows of B.
+            void add_segments(const MatrixXd &A, const MatrixXd &B, const Color &color);
+
+            // Axis aligned grid over [min, max] with spacing step. With a warp, the grid lines
+            // are drawn under the warp instead, each cell side split into subdivisions segments.
+            void add_grid(const Vector2d &min, const Vector2d &max, double step, const Color &color,
+                          const Warp &warp = Warp(), int subdivisions = 4);
+
+            void clear_layers();
+
+            // Draw the layers over the background.
+            const Image &render();
+
+            const Image &image() const { return img; }
+
+        private:
+            struct Layer {
+                bool segments = false;
+                Color color;
+                // points: pixel centers. segments: x0, y0, x1, y1 per segment.
+                std::vector<float> coords;
+                // Disk or ring stencil, sorted by dy.
+                std::vector<std::pair<int, int> > stencil;
+                int radius = 0;
+            };
+
+            void _to_pixels(const MatrixXd &P, std::vector<float> &coords, int stride, int offset) const;
+
+            void _draw_points(const Layer &layer, int y_begin, int y_end);
+
+            void _draw_segments(const Layer &layer, int y_begin, int y_end);
+
+            Image img;
+            Color background;
+            Vector2d scale = Vector2d::Ones();
+            Vector2d offset = Vector2d::Zero();
+            std::vector<Layer> layers;
+        };
+    }
+}
@@ -8,30 +8,87 @@
 
 #include "rpm.h"
 
+#include <cmath>
 #include <iostream>
 #include <chrono>
+#include <limits>
+#include <memory>
 
-#include "data.h"
+#include "affine.h"
+#include "alloc_counter.h"
+#include "cpd.h"
+#include "data_process.h"
+#include "parallel.h"
+#include "perf_counters.h"
+#include "trace.h"
 
 using std::cout;
 using std::endl;
 using namespace rpm;
 
-// Annealing params
-double rpm::T_start = 1;
-double rpm::T_end = T_start * 1e-4;
-double rpm::r = 0.90, rpm::I0 = 5, rpm::epsilon0 = 1e-2;
-double rpm::alpha = 0.1; // 5 * 5
-// Softassign params
-double rpm::I1 = 10, rpm::epsilon1 = 1e-4;
-// Thin-plate spline params
-double rpm::lambda_start = T_start;
-
 double rpm::scale = 300;
 
 //#define USE_SVD_SOLVER
 
 namespace {
+    typedef std::chrono::steady_clock Clock;
+
+    // Adds the lifetime of the scope to *target in seconds, does nothing for a null target.
+    class StageTimer {
+    public:
+        explicit StageTimer(double *target) : target(target) {
+            if (target) {
+                start = Clock::now();
+            }
+        }
+
+        ~StageTimer() {
+            if (target) {
+                *target += std::chrono::duration<double>(Clock::now() - start).count();
+            }
+        }
+
+    private:
+        double *target;
+        Clock::time_point start;
+    };
+
+    // Counts the stages of one estimate into stats->stage_counters when hardware_counters is set.
+    class _CounterSession {
+    public:
+        _CounterSession(const RpmInstrumentation *instrumentation, const bool verbose)
+                : stats(instrumentation && instrumentation->hardware_counters ? instrumentation->stats : nullptr),
+                  verbose(verbose) {
+            if (stats) {
+                if (!perf_counters::available() && verbose) {
+                    std::cout << "Hardware counters are not available, stage counts stay -1.\n";
+                }
+                perf_counters::start();
+            }
+        }
+
+        ~_CounterSession() {
+            if (!stats) {
+                return;
+            }
+            perf_counters::stop();
+            const auto counts = perf_counters::read();
+            stats->stage_counters.assign(counts.begin(), counts.end());
+            if (verbose) {
+                for (int s = 0; s < perf_counters::stage_count; s++) {
+                    const perf_counters::Counts &c = counts[s];
+                    std::cout << perf_counters::to_string(perf_counters::Stage(s)) << ": " << c.calls
+                              << " calls, " << c.cycles << " cycles, IPC " << c.ipc() << ", LLC MPKI "
+                              << c.llc_mpki() << ", branch MPKI " << c.branch_mpki() << "\n";
+                }
+            }
+        }
+
+    private:
+        RpmStats *stats;
+        bool verbose;
+    };
+
     inline bool _matrices_equal(
             const MatrixXd &m1,
             const MatrixXd &m2,
@@ -43,186 +100,724 @@ namespace {
         return ((m1 - m2).cwiseAbs().maxCoeff() <= tol);
     }
 
-    inline void _soft_assign(
-            MatrixXd &assignment_matrix) {
-        int iter = 0;
-        while (iter++ < I1) {
-            // normalizing across all rows
-#pragma omp parallel for
-            for (int r = 0; r < assignment_matrix.rows() - 1; r++) {
-                double row_sum = assignment_matrix.row(r).sum();
-                if (row_sum < epsilon1) {
-                    continue;
+    inline double _distance(const MatrixXd &Y_, const MatrixXd &M, const rpm::ThinPlateSplineParams &params) {
+        MatrixXd Y = rpm::apply_correspondence(Y_, M);
+        MatrixXd XT = params.applyTransform(true);
+
+        if (XT.rows() != Y.rows() || XT.cols() != Y.cols()) {
+            throw std::invalid_argument("X size not same as Y in _distance!");
+        }
+
+        MatrixXd diff = (Y - XT).cwiseAbs();
+        return diff.maxCoeff();
+    }
+
+    // Symmetric mean squared nearest-neighbour (chamfer) distance between the transformed X and Y.
+    // Unlike the soft-assign residual it does not depend on the temperature the model was reached at.
+    inline double _quality(
+            const MatrixXd &Y,
+            const rpm::ThinPlateSplineParams &params) {
+        const MatrixXd XT = params.applyTransform(true);
+        const int K = XT.rows(), N = Y.rows();
+
+        // Nearest neighbours from grids over both sets, O(K + N) for sets that overlap.
+        const NeighborGrid grid_x(XT), grid_y(Y);
+        VectorXd nearest_x(K), nearest_y(N);
+        parallel::parallel_for(0, N, parallel::grain_for(64), [&](int begin, int end) {
+            vector<pair<double, int> > nearest;
+            for (int n = begin; n < end; n++) {
+                grid_x.nearest(Y.row(n).leftCols(D).transpose(), 1, nearest);
+                nearest_y(n) = nearest[0].first;
+            }
+        });
+        parallel::parallel_for(0, K, parallel::grain_for(64), [&](int begin, int end) {
+            vector<pair<double, int> > nearest;
+            for (int k = begin; k < end; k++) {
+                grid_y.nearest(XT.row(k).transpose(), 1, nearest);
+                nearest_x(k) = nearest[0].first;
+            }
+        });
+
+        return 0.5 * (nearest_x.mean() + nearest_y.mean());
+    }
+
+    // Known matches as hard constraints. Pairs out of range are dropped, a later pair replaces
+    // the earlier ones sharing its k or n.
+    struct _Anchors {
+        vector<pair<int, int> > pairs;
+        // Points of X and Y left to the softassign.
+        vector<int> free_rows, free_cols;
+    };
+
+    _Anchors _reduce_anchors(const int K, const int N, const vector<pair<int, int> > &matched_point_indices) {
+        _Anchors anchors;
+        vector<char> row_taken(K, 0), col_taken(N, 0);
+        for (auto it = matched_point_indices.rbegin(); it != matched_point_indices.rend(); ++it) {
+            const int k = it->first, n = it->second;
+            if (k < 0 || k >= K || n < 0 || n >= N || row_taken[k] || col_taken[n]) {
+                continue;
+            }
+            row_taken[k] = col_taken[n] = 1;
+            anchors.pairs.push_back(*it);
+        }
+        if (anchors.pairs.empty()) {
+            return anchors;
+        }
+
+        for (int k = 0; k < K; k++) {
+            if (!row_taken[k]) {
+                anchors.free_rows.push_back(k);
+            }
+        }
+        for (int n = 0; n < N; n++) {
+            if (!col_taken[n]) {
+                anchors.free_cols.push_back(n);
+            }
+        }
+        return anchors;
+    }
+
+    // K * N correspondence from the softassign A of the free points, anchors get a 1 in their row and column.
+    template<typename Matrix>
+    void _scatter_free(const Matrix &A, const _Anchors &anchors, const int K, const int N, Matrix &M) {
+        const vector<int> &rows = anchors.free_rows, &cols = anchors.free_cols;
+        M.setZero(K, N);
+        parallel::parallel_for(0, int(cols.size()), parallel::grain_for(rows.size()), [&](int begin, int end) {
+            for (int j = begin; j < end; j++) {
+                for (size_t i = 0; i < rows.size(); i++) {
+                    M(rows[i], cols[j]) = A(i, j);
                 }
-                assignment_matrix.row(r) /= row_sum;
             }
+        });
+        for (auto point_pair : anchors.pairs) {
+            M(point_pair.first, point_pair.second) = 1;
+        }
+    }
 
-            // normalizing across all cols
-#pragma omp parallel for
-            for (int c = 0; c < assignment_matrix.cols() - 1; c++) {
-                double col_sum = assignment_matrix.col(c).sum();
-                if (col_sum < epsilon1) {
-                    continue;
+    // Defined with the public overloads below, on anchors reduced once per estimate.
+    bool _estimate_correspondence(const MatrixXd &X, const MatrixXd &Y, const _Anchors &anchors,
+                                  const ThinPlateSplineParams &params, double T, MatrixXd &M, const RpmConfig &config,
+                                  RpmIterationStats *iteration_stats, SinkhornState *warm);
+    bool _estimate_correspondence(const MatrixXd &X, const MatrixXd &Y, const _Anchors &anchors,
+                                  const ThinPlateSplineParams &params, double T, MatrixXf &M, const RpmConfig &config,
+                                  RpmIterationStats *iteration_stats, SinkhornState *warm);
+    bool _estimate_correspondence(const MatrixXd &X, const MatrixXd &Y, const _Anchors &anchors,
+                                  const ThinPlateSplineParams &params, double T, CorrespondenceSums &sums,
+                                  const RpmConfig &config, RpmIterationStats *iteration_stats, SinkhornState *warm);
+    void _form_correspondence(const CorrespondenceSums &sums, const MatrixXd &Y, const _Anchors &anchors, MatrixXd &M,
+                              const RpmConfig &config);
+    bool _solve_transform(const MatrixXd &X, const VectorXd &row_sums, const MatrixXd &MY, int N, double lambda,
+                          ThinPlateSplineParams &params, const RpmConfig &config, RpmIterationStats *iteration_stats,
+                          const vector<pair<int, int> > &anchors);
+    template<typename Matrix>
+    bool _estimate_transform(const MatrixXd &X, const MatrixXd &Y, const Matrix &M, double lambda,
+                             ThinPlateSplineParams &params, const RpmConfig &config, RpmIterationStats *iteration_stats,
+                             const _Anchors &anchors);
+
+    // The softassign annealing: I0 iterations per temperature from T_start down to T_end, each one
+    // run by iterate(T, lambda, iteration_stats), which returns false to end the schedule after it.
+    // energy(T, lambda) is only called when instrumented.
+    // Returns true when stopped by the budget.
+    template<typename Iterate, typename Energy>
+    bool _anneal(
+            const RpmConfig &config,
+            const RpmBudget &budget,
+            const Clock::time_point deadline,
+            RpmInstrumentation *instrumentation,
+            const ThinPlateSplineParams &params,
+            const MatrixXd &Y,
+            RpmOutcome &outcome,
+            const Iterate &iterate,
+            const Energy &energy) {
+        RpmStats *stats = instrumentation ? instrumentation->stats : nullptr;
+        double T_cur = config.T_start;
+        double lambda = config.lambda_start;
+        bool stopped = false, converged = false;
+
+        int indi = 0;
+        while (T_cur >= config.T_end && !stopped && !converged) {
+            RPM_TRACE_SPAN_ARG("temperature", "T", T_cur);
+            int iter = 0;
+            int temperature_sinkhorn_iterations = 0;
+
+            while (iter++ < config.I0 && !stopped && !converged) {
+                RPM_TRACE_SPAN_ARG("iteration", "iter", iter);
+                RpmIterationStats iteration;
+                RpmIterationStats *iteration_stats = instrumentation ? &iteration : nullptr;
+                if (iteration_stats) {
+                    iteration.temperature_index = indi;
+                    iteration.iter = iter;
+                    iteration.T = T_cur;
+                    iteration.lambda = lambda;
+                    iteration.allocations = alloc_counter::count();
+                }
+
+                converged = !iterate(T_cur, lambda, iteration_stats);
+
+                if (iteration_stats) {
+                    if (iteration.allocations >= 0) {
+                        iteration.allocations = alloc_counter::count() - iteration.allocations;
+                    }
+                    iteration.energy = energy(T_cur, lambda);
+                    temperature_sinkhorn_iterations += iteration.sinkhorn_iterations;
+
+                    if (stats) {
+                        stats->iterations.push_back(iteration);
+                    }
+                    if (instrumentation->on_iteration) {
+                        instrumentation->on_iteration(iteration);
+                    }
+                    if (instrumentation->on_state) {
+                        instrumentation->on_state(iteration, params, Y);
+                    }
                 }
-                assignment_matrix.col(c) /= col_sum;
+
+                outcome.T_reached = T_cur;
+                outcome.lambda_reached = lambda;
+                outcome.iterations++;
+
+                if (budget.cancel && budget.cancel->load(std::memory_order_relaxed)) {
+                    outcome.cancelled = stopped = true;
+                } else if (budget.time_limit > 0 && Clock::now() >= deadline) {
+                    outcome.deadline_reached = stopped = true;
+                }
+            }
+            if (stats) {
+                stats->temperature_sinkhorn_iterations.push_back(temperature_sinkhorn_iterations);
             }
+            indi++;
+
+            T_cur *= config.r;
+            lambda *= config.r;
         }
+
+        return stopped;
     }
 
-    inline double _distance(const MatrixXd &Y_, const MatrixXd &M, const rpm::ThinPlateSplineParams &params) {
-        MatrixXd Y = rpm::apply_correspondence(Y_, M);
-        MatrixXd XT = params.applyTransform(true);
+    // EM iterations of RpmConfig::use_cpd on the normalized homogeneous X and Y, one per temperature
+    // of the annealing schedule with sigma2 = T / 2. The iterations stop at T_end, after
+    // cpd_max_iterations or earlier when the likelihood converged with sigma2 under the residual of the fit.
+    // Returns true when stopped by the budget.
+    bool _estimate_cpd(
+            const MatrixXd &X,
+            const MatrixXd &Y,
+            MatrixXd &M,
+            ThinPlateSplineParams &params,
+            const RpmConfig &config_,
+            const RpmBudget &budget,
+            const Clock::time_point deadline,
+            RpmInstrumentation *instrumentation,
+            RpmOutcome &outcome,
+            const _Anchors &anchors) {
+        const int N = Y.rows();
+
+        // X is fixed for all the iterations, factor it once for the O(K^2) solves.
+        RpmConfig config = config_;
+        config.I0 = 1;
+        std::unique_ptr<TpsSolveBasis> basis;
+        if (!config.solve_basis) {
+            basis.reset(new TpsSolveBasis(params));
+            config.solve_basis = basis.get();
+        }
 
-        if (XT.rows() != Y.rows() || XT.cols() != Y.cols()) {
-            throw std::invalid_argument("X size not same as Y in _distance!");
+        double previous = std::numeric_limits<double>::infinity();
+        int iterations = 0;
+        CpdPosterior posterior;
+        const bool stopped = _anneal(
+                config, budget, deadline, instrumentation, params, Y, outcome,
+                [&](double T, double lambda, RpmIterationStats *iteration_stats) {
+                    const double sigma2 = T / 2;
+                    MatrixXd XT;
+                    {
+                        StageTimer timer(iteration_stats ? &iteration_stats->apply_time : nullptr);
+                        XT = params.applyTransform();
+                    }
+                    {
+                        StageTimer timer(iteration_stats ? &iteration_stats->affinity_time : nullptr);
+                        RPM_TRACE_SPAN("e_step");
+                        cpd_posterior(XT, Y, sigma2, config.cpd_w, config.cpd_epsilon, posterior);
+                        for (auto point_pair : anchors.pairs) {
+                            posterior.P1(point_pair.first) = 1;
+                            posterior.PY.row(point_pair.first) = Y.row(point_pair.second);
+                        }
+                    }
+
+                    if (!_solve_transform(X, posterior.P1, posterior.PY, N, lambda, params, config, iteration_stats,
+                                          anchors.pairs)) {
+                        throw std::runtime_error("estimate transform failed!");
+                    }
+
+                    {
+                        StageTimer timer(iteration_stats ? &iteration_stats->apply_time : nullptr);
+                        XT = params.applyTransform();
+                    }
+                    // sigma2 follows the annealing schedule, the EM estimate only tells when the fit
+                    // reached the noise level of the data.
+                    const bool annealing = cpd_sigma2(XT, Y, posterior) < sigma2;
+                    const double energy = posterior.negative_log_likelihood;
+                    const bool converged = !annealing
+                                           && std::abs(previous - energy) <= config.cpd_tolerance * std::abs(energy);
+                    previous = energy;
+                    return !converged && ++iterations < config.cpd_max_iterations;
+                },
+                [&](double, double) {
+                    return posterior.negative_log_likelihood;
+                });
+
+        if (outcome.iterations > 0 && config.output_correspondence) {
+            const double sigma2 = outcome.T_reached * config.r / 2;
+            cpd_correspondence(params.applyTransform(), Y, std::max(sigma2, config.T_end / 2), config.cpd_w, M);
+            for (auto point_pair : anchors.pairs) {
+                M.row(point_pair.first).setZero();
+                M.col(point_pair.second).setZero();
+                M(point_pair.first, point_pair.second) = 1;
+            }
         }
 
-        MatrixXd diff = (Y - XT).cwiseAbs();
-        return diff.maxCoeff();
+        return stopped;
+    }
+
+    // Annealing of RpmConfig::affine_only on the normalized homogeneous X and Y, the schedule of the
+    // softassign loop with the sparse correspondence and affine solve of affine.h. M is only formed
+    // at the end, when output_correspondence is set.
+    // Returns true when stopped by the budget.
+    bool _estimate_affine(
+            const MatrixXd &X,
+            const MatrixXd &Y,
+            MatrixXd &M,
+            ThinPlateSplineParams &params,
+            const RpmConfig &config,
+            const RpmBudget &budget,
+            const Clock::time_point deadline,
+            RpmInstrumentation *instrumentation,
+            RpmOutcome &outcome,
+            const _Anchors &anchors,
+            const bool output_correspondence) {
+        const int N = Y.rows();
+
+        // Anchored targets are only matched by their anchor.
+        vector<char> anchored(anchors.pairs.empty() ? 0 : N, 0);
+        for (auto point_pair : anchors.pairs) {
+            anchored[point_pair.second] = 1;
+        }
+        const NeighborGrid grid(Y, anchored);
+
+        SparseCorrespondence M_sparse;
+        const bool stopped = _anneal(
+                config, budget, deadline, instrumentation, params, Y, outcome,
+                [&](double T, double lambda, RpmIterationStats *iteration_stats) {
+                    MatrixXd XT;
+                    {
+                        StageTimer timer(iteration_stats ? &iteration_stats->apply_time : nullptr);
+                        XT = params.applyTransform();
+                    }
+                    sparse_correspondence(XT, Y, grid, config.affine_neighbors, T, anchors.pairs, M_sparse, config,
+                                          iteration_stats);
+                    {
+                        StageTimer timer(iteration_stats ? &iteration_stats->solve_time : nullptr);
+                        RPM_TRACE_SPAN("affine_solve");
+                        if (!estimate_affine_transform(X, Y, M_sparse, lambda, params, config)) {
+                            throw std::runtime_error("estimate affine transform failed!");
+                        }
+                    }
+                    return true;
+                },
+                [&](double T, double) {
+                    return energy(params.applyTransform(), Y, M_sparse, T, config);
+                });
+
+        if (outcome.iterations > 0 && output_correspondence) {
+            M = M_sparse.toDense();
+        }
+
+        return stopped;
     }
 }
 
-void rpm::set_T_start(double T, double scale) {
+void rpm::set_T_start(RpmConfig &config, double T, double scale) {
     T *= scale;
 
-    T_start = T;
-    T_end = T * 1e-3;
-    lambda_start = T;
+    config.T_start = T;
+    config.T_end = T * config.T_end_ratio;
+    config.lambda_start = T;
 
-    cout << "Set T_start : " << T_start << endl;
+    if (config.verbose) {
+        cout << "Set T_start : " << config.T_start << endl;
+    }
     //getchar();
 }
 
 bool rpm::estimate(
-        const MatrixXd &X_,
-        const MatrixXd &Y_,
+        const MatrixXd &X,
+        const MatrixXd &Y,
         MatrixXd &M,
         ThinPlateSplineParams &params,
         const vector<pair<int, int> > &matched_point_indices) {
-    auto t1 = std::chrono::high_resolution_clock::now();
+    return estimate(X, Y, M, params, RpmConfig(), matched_point_indices);
+}
 
-    try {
-        if (X_.cols() != rpm::D || Y_.cols() != rpm::D) {
-            throw std::invalid_argument("rpm::estimate() only support 2d points!");
+bool rpm::estimate(
+        const MatrixXd &X,
+        const MatrixXd &Y,
+        MatrixXd &M,
+        ThinPlateSplineParams &params,
+        const RpmConfig &config,
+        const vector<pair<int, int> > &matched_point_indices) {
+    RpmOutcome outcome;
+    return estimate_anytime(X, Y, M, params, config, RpmBudget(), outcome, matched_point_indices);
+}
+
+namespace {
+    // Derive the schedule of config (T_start, T_end, lambda_start) from the normalized homogeneous X and Y.
+    // With the pre-alignments params.d is aligned first and the schedule starts at the remaining distance.
+    // Returns true when the affine prealignment was stopped by the budget, outcome tells why.
+    bool _schedule(
+            const MatrixXd &X,
+            const MatrixXd &Y,
+            ThinPlateSplineParams &params,
+            RpmConfig &config,
+            const RpmBudget &budget,
+            const Clock::time_point deadline,
+            RpmOutcome &outcome,
+            const _Anchors &anchors,
+            RpmStats *stats) {
+        RPM_TRACE_SPAN("schedule");
+        bool stopped = false;
+        double max_dist = 0, average_dist = 0;
+        distance_stats(X, Y, max_dist, average_dist);
+        if (config.verbose) {
+            std::cout << "max_dist : " << max_dist << std::endl;
+            std::cout << "average_dist : " << average_dist << std::endl;
+        }
+        if (config.auto_T_start) {
+            set_T_start(config, average_dist, 1);
         }
 
-        MatrixXd X = X_, Y = Y_;
+        const bool affine_prealign = config.use_affine_prealign && !config.affine_only;
+        if (config.use_moment_prealign || config.affine_only || affine_prealign) {
+            // The truncated correspondence of the affine registration only pulls each point toward
+            // its nearest targets, it needs the coarse alignment of the moments to start from.
+            if (!moment_prealign(X, Y, params)) {
+                throw std::runtime_error("moment prealign failed!");
+            }
+            if (affine_prealign) {
+                // The whole affine schedule, O(K + N) per iteration, uninstrumented but within the budget.
+                StageTimer timer(stats ? &stats->prealign_time : nullptr);
+                ThinPlateSplineParams affine(X, true);
+                affine.d = params.d;
+                MatrixXd M_affine;
+                RpmOutcome affine_outcome;
+                stopped = _estimate_affine(X, Y, M_affine, affine, config, budget, deadline, nullptr, affine_outcome,
+                                           anchors, false);
+                params.d = affine.d;
+                outcome.cancelled = affine_outcome.cancelled;
+                outcome.deadline_reached = affine_outcome.deadline_reached;
+                if (stats) {
+                    stats->prealign_iterations = affine_outcome.iterations;
+                }
+            }
 
-        data_process::preprocess(X, Y);
-        data_process::homo(X);
-        data_process::homo(Y);
+            // The coarse global alignment is already resolved, skip the early high-T iterations.
+            // T_end is kept, lambda follows T as if the skipped iterations had run.
+            double aligned_max_dist = 0, aligned_average_dist = 0;
+            distance_stats(params.applyTransform(), Y, aligned_max_dist, aligned_average_dist);
+            double T = std::max(std::min(config.T_start, aligned_average_dist * config.prealign_T_scale),
+                                config.T_end);
+            config.lambda_start *= T / config.T_start;
+            config.T_start = T;
+            if (config.verbose) {
+                std::cout << "Prealigned T_start : " << config.T_start << std::endl;
+            }
+        }
+        //config.alpha = average_dist * 0.1;
 
-        params = ThinPlateSplineParams(X);
+        if (stats) {
+            stats->max_dist = max_dist;
+            stats->average_dist = average_dist;
+            stats->T_start = config.T_start;
+            stats->T_end = config.T_end;
+        }
+        return stopped;
+    }
+}
 
-        double max_dist = 0, average_dist = 0;
-        int K = X.rows(), N = Y.rows();
-        for (int k = 0; k < K; k++) {
-            const VectorXd &x = X.row(k);
-            for (int n = 0; n < N; n++) {
-                const VectorXd &y = Y.row(n);
-                double dist = (y - x).squaredNorm();
+namespace {
+    // estimate_anytime() and estimate_prepared(), prepared inputs skip the normalization and the spline basis.
+    bool _estimate_anytime(
+            const MatrixXd &X_,
+            const MatrixXd &Y_,
+            MatrixXd &M,
+            ThinPlateSplineParams &params,
+            const RpmConfig &config_,
+            const RpmBudget &budget,
+            RpmOutcome &outcome,
+            const vector<pair<int, int> > &matched_point_indices,
+            const bool prepared) {
+        RPM_TRACE_SPAN("estimate");
+        auto t1 = std::chrono::high_resolution_clock::now();
+        const auto deadline = std::chrono::steady_clock::now()
+                              + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                      std::chrono::duration<double>(budget.time_limit));
+        outcome = RpmOutcome();
+        M.resize(0, 0);
+
+        RpmInstrumentation *instrumentation = config_.instrumentation;
+        if (instrumentation && !instrumentation->enabled()) {
+            instrumentation = nullptr;
+        }
+        RpmStats *stats = instrumentation ? instrumentation->stats : nullptr;
+        if (stats) {
+            *stats = RpmStats();
+        }
+        _CounterSession counters(instrumentation, config_.verbose);
 
-                max_dist = max(max_dist, dist);
-                average_dist += dist;
+        try {
+            const int dim = prepared ? rpm::D + 1 : rpm::D;
+            if (X_.cols() != dim || Y_.cols() != dim) {
+                throw std::invalid_argument(prepared ? "rpm::estimate_prepared() only support 3d homogeneous points!"
+                                                     : "rpm::estimate() only support 2d points!");
+            }
+            if (prepared && (params.w.rows() != X_.rows() || params.w.cols() != rpm::D + 1)) {
+                throw std::invalid_argument("rpm::estimate_prepared() needs params built from X!");
             }
-        }
-        average_dist /= (K * N);
-        std::cout << "max_dist : " << max_dist << std::endl;
-        std::cout << "average_dist : " << average_dist << std::endl;
-        set_T_start(average_dist, 1);
-        //rpm::alpha = average_dist * 0.1;
 
-        double T_cur = T_start;
-        double lambda = lambda_start;
+            MatrixXd X = X_, Y = Y_;
 
-        if (!init_params(X, Y, T_start, M, params)) {
-            throw std::runtime_error("init params failed!");
-        }
+            if (!prepared) {
+                {
+                    StageTimer timer(stats ? &stats->preprocess_time : nullptr);
+                    RPM_TRACE_SPAN("preprocess");
+                    data_process::preprocess(X, Y);
+                    data_process::homo(X);
+                    data_process::homo(Y);
+                }
 
-        //char file[256];
-        //if (data_visualize::save_intermediate_result) {
-        //	sprintf_s(file, "%s/data_%.8f.png", data_visualize::res_dir.c_str(), T_cur);
-        //	Mat result_image = data_visualize::visualize(params.applyTransform(), Y);
-        //	imwrite(file, result_image);
-        //}
+                {
+                    StageTimer timer(stats ? &stats->basis_time : nullptr);
+                    RPM_TRACE_SPAN("spline_basis");
+                    params = ThinPlateSplineParams(X, config_.affine_only);
+                }
+            }
 
-        int indi = 0;
-        while (T_cur >= T_end) {
-//            printf("indi= %d, T : %.2f, ",indi, T_cur);
-//            printf("lambda : %.2f ", lambda);
-//            std:: cout << " " <<   std::  endl;
+            const _Anchors anchors = _reduce_anchors(X.rows(), Y.rows(), matched_point_indices);
 
+            // Local copy, the schedule below is derived per call.
+            RpmConfig config = config_;
+            bool stopped = _schedule(X, Y, params, config, budget, deadline, outcome, anchors, stats);
 
-            int iter = 0;
+            if (!init_params(X, Y, config.T_start, M, params)) {
+                throw std::runtime_error("init params failed!");
+            }
+
+            // Carried across temperatures and inner iterations when config.sinkhorn_warm_start is set,
+            // and across calls in config.sinkhorn_state.
+            SinkhornState sinkhorn;
+            SinkhornState *warm = nullptr;
+            if (config.sinkhorn_warm_start) {
+                warm = config.sinkhorn_state ? config.sinkhorn_state : &sinkhorn;
+            }
 
-            while (iter++ < I0) {
-                //printf("	Annealing iter : %d\n", iter);
-                MatrixXd M_prev = M;
-                ThinPlateSplineParams params_prev = params;
-                if (!estimate_correspondence(X, Y, matched_point_indices, params, T_cur, T_start, M)) {
+            // With config.float_correspondence the iterations work on M_f, with
+            // config.matrix_free_correspondence on the sums of M. M is only filled at the end.
+            MatrixXf M_f;
+            CorrespondenceSums sums;
+            auto iterate = [&](auto &M_, double T, double lambda, RpmIterationStats *iteration_stats) {
+                if (!_estimate_correspondence(X, Y, anchors, params, T, M_, config, iteration_stats, warm)) {
                     throw std::runtime_error("estimate correspondence failed!");
                 }
 
-                if (!estimate_transform(X, Y, M, lambda, params)) {
+                if (!_estimate_transform(X, Y, M_, lambda, params, config, iteration_stats, anchors)) {
                     throw std::runtime_error("estimate transform failed!");
                 }
+            };
+
+            const bool softassign = !config.use_cpd && !config.affine_only;
+            if (stopped) {
+                // Out of budget in the affine prealignment already, params keep its result.
+            } else if (config.use_cpd) {
+                stopped = _estimate_cpd(X, Y, M, params, config, budget, deadline, instrumentation, outcome, anchors);
+            } else if (config.affine_only) {
+                stopped = _estimate_affine(X, Y, M, params, config, budget, deadline, instrumentation, outcome,
+                                           anchors, config.output_correspondence);
+            } else if (config.matrix_free_correspondence) {
+                stopped = _anneal(config, budget, deadline, instrumentation, params, Y, outcome,
+                                  [&](double T, double lambda, RpmIterationStats *iteration_stats) {
+                                      if (!_estimate_correspondence(X, Y, anchors, params, T, sums, config,
+                                                                    iteration_stats, warm)) {
+                                          throw std::runtime_error("estimate correspondence failed!");
+                                      }
+                                      if (!_solve_transform(X, sums.row_sums, sums.MY, Y.rows(), lambda, params,
+                                                            config, iteration_stats, anchors.pairs)) {
+                                          throw std::runtime_error("estimate transform failed!");
+                                      }
+                                      return true;
+                                  },
+                                  [&](double T, double lambda) {
+                                      return energy(X, Y, sums, params, T, lambda, config);
+                                  });
+            } else if (config.float_correspondence) {
+                stopped = _anneal(config, budget, deadline, instrumentation, params, Y, outcome,
+                                  [&](double T, double lambda, RpmIterationStats *iteration_stats) {
+                                      iterate(M_f, T, lambda, iteration_stats);
+                                      return true;
+                                  },
+                                  [&](double T, double lambda) {
+                                      return energy(X, Y, M_f, params, T, lambda, config);
+                                  });
+            } else {
+                stopped = _anneal(config, budget, deadline, instrumentation, params, Y, outcome,
+                                  [&](double T, double lambda, RpmIterationStats *iteration_stats) {
+                                      iterate(M, T, lambda, iteration_stats);
+                                      return true;
+                                  },
+                                  [&](double T, double lambda) {
+                                      return energy(X, Y, M, params, T, lambda, config);
+                                  });
+            }
+            outcome.completed = !stopped;
 
-                std::cout << "indi= " << indi << ",iter = " << iter << ",T_cur = " << T_cur << ",T_end=" << T_end
-                          << std::endl;
+            if (config.matrix_free_correspondence && softassign && outcome.iterations > 0) {
+                if (config.output_correspondence) {
+                    _form_correspondence(sums, Y, anchors, M, config);
+                }
+            } else if (config.float_correspondence && softassign && outcome.iterations > 0) {
+                M = M_f.cast<double>();
+            }
 
-                //if (_matrices_equal(M_prev, M, epsilon0)) {  // hack!!!
-                //	//M = M_prev;
-                //	//params = params_prev;
-                //	break;
-                //}
+            if (outcome.iterations > 0) {
+                outcome.quality = _quality(Y, params);
             }
-            indi++;
 
-            //if (data_visualize::save_intermediate_result) {
-            //	sprintf_s(file, "%s/data_%.8f.png", data_visualize::res_dir.c_str(), T_cur);
-            //	Mat result_image = data_visualize::visualize(params.applyTransform(), Y, scale);
-            //	imwrite(file, result_image);
+            // Re-estimate real ThinPlateSplineParams on unnormalized data.
+
+            //MatrixXd M_binary = MatrixXd::Zero(K, N);
+            //for (int k = 0; k < K; k++) {
+            //	Eigen::Index n;
+            //	double max_coeff = M.row(k).maxCoeff(&n);
+            //	if (max_coeff > 1.0 / N) {
+            //		M_binary(k, n) = 1;
+            //	}
             //}
+            //M = M_binary;
 
-            T_cur *= r;
-            lambda *= r;
+            //params = ThinPlateSplineParams(X_);
+            //	estimate_transform(X_, Y_, M, lambda, params);
+        }
+        catch (const std::exception &e) {
+            outcome.error = e.what();
+            std::cerr << e.what() << std::endl;
+            return false;
         }
 
-        // Re-estimate real ThinPlateSplineParams on unnormalized data.
+        auto t2 = std::chrono::high_resolution_clock::now();
 
-        //MatrixXd M_binary = MatrixXd::Zero(K, N);
-        //for (int k = 0; k < K; k++) {
-        //	Eigen::Index n;
-        //	double max_coeff = M.row(k).maxCoeff(&n);
-        //	if (max_coeff > 1.0 / N) {
-        //		M_binary(k, n) = 1;
-        //	}
-        //}
-        //M = M_binary;
+        auto timespan = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1);
+        outcome.elapsed = timespan.count();
+        if (stats) {
+            stats->total_time = timespan.count();
+        }
+        if (config_.verbose) {
+            std::cout << "TPS-RPM estimate time: " << timespan.count() << " seconds.\n";
+        }
 
-        //params = ThinPlateSplineParams(X_);
-        //	estimate_transform(X_, Y_, M, lambda, params);
+        return true;
     }
-    catch (const std::exception &e) {
-        std::cout << e.what();
+}
+
+bool rpm::estimate_anytime(
+        const MatrixXd &X,
+        const MatrixXd &Y,
+        MatrixXd &M,
+        ThinPlateSplineParams &params,
+        const RpmConfig &config,
+        const RpmBudget &budget,
+        RpmOutcome &outcome,
+        const vector<pair<int, int> > &matched_point_indices) {
+    return _estimate_anytime(X, Y, M, params, config, budget, outcome, matched_point_indices, false);
+}
+
+bool rpm::estimate_prepared(
+        const MatrixXd &X,
+        const MatrixXd &Y,
+        MatrixXd &M,
+        ThinPlateSplineParams &params,
+        const RpmConfig &config,
+        const RpmBudget &budget,
+        RpmOutcome &outcome,
+        const vector<pair<int, int> > &matched_point_indices) {
+    return _estimate_anytime(X, Y, M, params, config, budget, outcome, matched_point_indices, true);
+}
+
+void rpm::distance_stats(
+        const MatrixXd &X,
+        const MatrixXd &Y,
+        double &max_dist,
+        double &average_dist) {
+    if (X.cols() != Y.cols() || X.rows() == 0 || Y.rows() == 0) {
+        throw std::invalid_argument("distance_stats() needs two non-empty point sets of same dimension!");
+    }
+
+    // mean_kn ||y_n - x_k||^2 = mean ||x||^2 + mean ||y||^2 - 2 * mean(x) . mean(y)
+    const RowVectorXd mean_x = X.colwise().mean(), mean_y = Y.colwise().mean();
+    average_dist = X.rowwise().squaredNorm().mean() + Y.rowwise().squaredNorm().mean()
+                   - 2 * mean_x.dot(mean_y);
+    average_dist = std::max(average_dist, 0.0);
+
+    // Farthest corners of the two bounding boxes along each axis.
+    const RowVectorXd min_x = X.colwise().minCoeff(), max_x = X.colwise().maxCoeff();
+    const RowVectorXd min_y = Y.colwise().minCoeff(), max_y = Y.colwise().maxCoeff();
+    max_dist = (max_y - min_x).cwiseAbs().cwiseMax((max_x - min_y).cwiseAbs()).squaredNorm();
+}
+
+bool rpm::moment_prealign(
+        const MatrixXd &X,
+        const MatrixXd &Y,
+        ThinPlateSplineParams &params) {
+    if (X.cols() != D + 1 || Y.cols() != D + 1) {
+        throw std::invalid_argument("Current only support 3d homogeneou points!");
+    }
+    if (X.rows() < D + 1 || Y.rows() < D + 1) {
         return false;
     }
 
-    auto t2 = std::chrono::high_resolution_clock::now();
+    const MatrixXd X2 = X.leftCols(D), Y2 = Y.leftCols(D);
+    const Vector2d center_x = X2.colwise().mean().transpose(), center_y = Y2.colwise().mean().transpose();
+    const MatrixXd X_c = X2.rowwise() - center_x.transpose(), Y_c = Y2.rowwise() - center_y.transpose();
+    const Matrix2d cov_x = X_c.transpose() * X_c / X.rows(), cov_y = Y_c.transpose() * Y_c / Y.rows();
 
-    auto timespan = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1);
-    std::cout << "TPS-RPM estimate time: " << timespan.count() << " seconds.\n";
+    // A = cov_y ^ (1/2) * cov_x ^ (-1/2) maps the covariance of X onto that of Y.
+    SelfAdjointEigenSolver<Matrix2d> eig_x(cov_x), eig_y(cov_y);
+    if (eig_x.info() != Eigen::Success || eig_y.info() != Eigen::Success) {
+        return false;
+    }
+
+    Matrix2d A;
+    const double tol = 1e-12;
+    if (eig_x.eigenvalues().minCoeff() > tol && eig_y.eigenvalues().minCoeff() > tol) {
+        A = eig_y.operatorSqrt() * eig_x.operatorInverseSqrt();
+    } else if (cov_x.trace() > tol) {
+        // Degenerate (e.g. collinear) points, only match the isotropic scale.
+        A = Matrix2d::Identity() * std::sqrt(cov_y.trace() / cov_x.trace());
+    } else {
+        A = Matrix2d::Identity();
+    }
+    const Vector2d t = center_y - A * center_x;
+
+    // XT = X * d, so d holds the transposed affine transform.
+    params.d = MatrixXd::Identity(D + 1, D + 1);
+    params.d.block(0, 0, D, D) = A.transpose();
+    params.d.block(D, 0, 1, D) = t.transpose();
 
     return true;
 }
 
 bool rpm::init_params(
-        const MatrixXd &X,
-        const MatrixXd &Y,
-        const double T,
-        MatrixXd &M,
-        ThinPlateSplineParams &params) {
-    const int K = X.rows(), N = Y.rows();
+        const MatrixXd &/*X*/,
+        const MatrixXd &/*Y*/,
+        const double /*T*/,
+        MatrixXd &/*M*/,
+        ThinPlateSplineParams &/*params*/) {
+    //const int K = X.rows(), N = Y.rows();
 
     //estimate_transform(X, X, MatrixXd::Identity(K + 1, K + 1), T, lambda, params);
 
@@ -253,283 +848,1142 @@ bool rpm::init_params(
     return true;
 }
 
-bool rpm::estimate_correspondence(
-        const MatrixXd &X,
-        const MatrixXd &Y,
-        const vector<pair<int, int> > &matched_point_indices,
-        const ThinPlateSplineParams &params,
-        const double T,
-        const double T0,
-        MatrixXd &M) {
-    if (X.cols() != D + 1 || Y.cols() != D + 1) {
-        throw std::invalid_argument("Current only support 3d homogeneou points!");
+namespace {
+    // A * v over the rows [begin, end), accumulated in double.
+    template<typename Derived>
+    inline void _row_products(const MatrixBase<Derived> &A, const VectorXd &v, int begin, int end, VectorXd &out) {
+        out.segment(begin, end - begin).noalias() = A.block(begin, 0, end - begin, A.cols()) * v;
     }
 
-    const int K = X.rows(), N = Y.rows();
-    const double beta = 1.0 / T;
-
-    M = MatrixXd::Zero(K + 1, N + 1);
+    inline void _row_products(const MatrixXf &A, const VectorXd &v, int begin, int end, VectorXd &out) {
+        auto band = out.segment(begin, end - begin);
+        band.setZero();
+        for (int c = 0; c < A.cols(); c++) {
+            band += A.col(c).segment(begin, end - begin).cast<double>() * v(c);
+        }
+    }
 
-    MatrixXd XT = params.applyTransform();
+    // A(k, n) = exp(beta * (alpha - ||y_n - x_k||^2)) for the rows of xs and ys, the outlier row and column are left.
+    template<typename Matrix>
+    void _fill_affinity(const MatrixXd &xs, const MatrixXd &ys, const double beta, const double alpha, Matrix &A) {
+        const int K = xs.rows(), N = ys.rows();
 
-#pragma omp parallel for
-    for (int k = 0; k < K; k++) {
-        const Vector3d &x = XT.row(k);
-        for (int n = 0; n < N; n++) {
-            const Vector3d &y = Y.row(n);
+        // A is column major, fill it column by column.
+        parallel::parallel_for(0, N, parallel::grain_for(K * 8), [&](int begin, int end) {
+            for (int n = begin; n < end; n++) {
+                const Vector3d &y = ys.row(n);
+                for (int k = 0; k < K; k++) {
+                    const Vector3d &x = xs.row(k);
 
-            //assignment_matrix(p_i, v_i) = -((p[p_i] - v[v_i]).squaredNorm() - alpha);
-            double dist = ((y - x).squaredNorm());
+                    //assignment_matrix(p_i, v_i) = -((p[p_i] - v[v_i]).squaredNorm() - alpha);
+                    double dist = ((y - x).squaredNorm());
 
-            //assignment_matrix(p_i, v_i) = dist < alpha ? std::exp(-(1.0 / T) * dist) : 0;
-            M(k, n) = std::exp(beta * (alpha - dist));
-        }
-    };
+                    //assignment_matrix(p_i, v_i) = dist < alpha ? std::exp(-(1.0 / T) * dist) : 0;
+                    A(k, n) = std::exp(beta * (alpha - dist));
+                }
+            }
+        });
+    }
 
-    for (auto point_pair : matched_point_indices) {
-        int k = point_pair.first, n = point_pair.second;
-        if (k < 0 || k >= K || n < 0 || n >= N) {
-            continue;
+    // Start from ones, or from the scalings of the last softassign moved to temperature T.
+    void _init_scalings(SinkhornState &state, int rows, int cols, double T) {
+        if (state.u.size() != rows || state.v.size() != cols || state.T <= 0) {
+            state.u = VectorXd::Ones(rows);
+            state.v = VectorXd::Ones(cols);
+        } else if (state.T != T) {
+            // Keep the log-potentials T * log(u), T * log(v), restart the scalings that under or overflow.
+            const double exponent = state.T / T;
+            auto rescale = [exponent](double s) {
+                const double t = std::pow(s, exponent);
+                return std::isnormal(t) ? t : 1.0;
+            };
+            state.u = state.u.unaryExpr(rescale);
+            state.v = state.v.unaryExpr(rescale);
         }
-
-        M.row(k).setZero();
-        M.col(n).setZero();
-        M(k, n) = 1;
+        state.T = T;
     }
 
-    //Vector3d center_x(XT.col(0).mean(), XT.col(1).mean(), XT.col(2).mean());
-    //Vector3d center_y(Y.col(0).mean(), Y.col(1).mean(), Y.col(2).mean());
-
-    //	const double beta_start = 1.0 / T0;
-    //#pragma omp parallel for
-    //	for (int k = 0; k < K; k++) {
-    //		const Vector3d& x = XT.row(k);
-    //		double dist = ((center_y - x).squaredNorm());
-    //		M(k, N) = beta_start * std::exp(beta_start * -dist);
-    //	}
-    //
-    //#pragma omp parallel for
-    //	for (int n = 0; n < N; n++) {
-    //		const Vector3d& y = Y.row(n);
-    //		double dist = ((y - center_x).squaredNorm());
-    //		M(K, n) = beta_start * std::exp(beta_start * -dist);
-    //	}
+    // Softassign sweeps on M = diag(u) * A * diag(v), only u and v are updated.
+    // The outlier entries u(rows - 1) and v(cols - 1) are never normalized.
+    // row_sum is workspace, resized to rows - 1.
+    template<typename Matrix>
+    int _sinkhorn(const Matrix &A, VectorXd &u, VectorXd &v, const RpmConfig &config, VectorXd &row_sum) {
+        const double epsilon1 = config.epsilon1;
+        const int rows = A.rows(), cols = A.cols();
+        const int row_grain = parallel::grain_for(cols), col_grain = parallel::grain_for(rows);
 
-    M.row(K).setConstant(1.0 / (N + 1));
-    M.col(N).setConstant(1.0 / (K + 1));
+        row_sum.resize(rows - 1);
+        int iter = 0;
+        while (iter < config.I1) {
+            // A * v in row bands, each task walks its columns contiguously
+            parallel::parallel_for(0, rows - 1, row_grain, [&](int begin, int end) {
+                _row_products(A, v, begin, end, row_sum);
+            });
+
+            // After a full sweep the columns sum to 1, the row sums tell how far from converged M is.
+            if (config.sinkhorn_tolerance > 0 && iter > 0) {
+                double residual = 0;
+                for (int r = 0; r < rows - 1; r++) {
+                    const double sum = u(r) * row_sum(r);
+                    if (sum >= epsilon1) {
+                        residual = std::max(residual, std::abs(sum - 1));
+                    }
+                }
+                if (residual < config.sinkhorn_tolerance) {
+                    break;
+                }
+            }
 
-    _soft_assign(M);
+            // normalizing across all rows
+            for (int r = 0; r < rows - 1; r++) {
+                if (u(r) * row_sum(r) >= epsilon1) {
+                    u(r) = 1.0 / row_sum(r);
+                }
+            }
 
-    M.conservativeResize(K, N);
+            // normalizing across all cols
+            parallel::parallel_for(0, cols - 1, col_grain, [&](int begin, int end) {
+                for (int c = begin; c < end; c++) {
+                    const double col_sum = A.col(c).template cast<double>().dot(u);
+                    if (v(c) * col_sum < epsilon1) {
+                        continue;
+                    }
+                    v(c) = 1.0 / col_sum;
+                }
+            });
 
-    return true;
-}
+            iter++;
+        }
 
-bool rpm::estimate_transform(
-        const MatrixXd &X,
-        const MatrixXd &Y_,
-        const MatrixXd &M,
-        const double lambda,
-        ThinPlateSplineParams &params) {
-    //auto t1 = std::chrono::high_resolution_clock::now();
+        return iter;
+    }
 
-    try {
-        if (X.cols() != D + 1 || Y_.cols() != D + 1) {
-            throw std::invalid_argument("Current only support 3d homogeneou points!");
-        }
+    // A = diag(u) * A * diag(v).
+    template<typename Matrix>
+    void _apply_scalings(Matrix &A, const VectorXd &u, const VectorXd &v) {
+        typedef typename Matrix::Scalar Scalar;
+        parallel::parallel_for(0, int(A.cols()), parallel::grain_for(A.rows()), [&](int begin, int end) {
+            for (int c = begin; c < end; c++) {
+                A.col(c) = (A.col(c).template cast<double>().cwiseProduct(u) * v(c)).template cast<Scalar>();
+            }
+        });
+    }
 
-        const int K = X.rows(), N = Y_.rows();
-        if (M.rows() != K || M.cols() != N) {
-            throw std::invalid_argument("Matrix M size not same as X and Y!");
-        }
+    // Row scaled softassign of estimate_correspondence(MatrixXf): the affinity is diag(exp(log_scale)) * A.
+    int _soft_assign_scaled(MatrixXf &A, const VectorXd &log_scale, const double T, SinkhornState &state,
+                            const RpmConfig &config) {
+        _init_scalings(state, A.rows(), A.cols(), T);
+        VectorXd u = state.u.cwiseProduct(log_scale.array().exp().matrix());
+        VectorXd row_sum;
+        int iter = _sinkhorn(A, u, state.v, config, row_sum);
+        _apply_scalings(A, u, state.v);
+        state.u = u.cwiseProduct((-log_scale).array().exp().matrix());
+        return iter;
+    }
 
-        int dim = D + 1;
-        MatrixXd Y = apply_correspondence(Y_, M);
+    // M * Y, accumulated in double.
+    inline MatrixXd _correspondence_product(const MatrixXd &M, const MatrixXd &Y) {
+        return M * Y;
+    }
 
-        const MatrixXd &phi = params.get_phi();
-        const MatrixXd &Q = params.get_Q();
-        const MatrixXd &R_ = params.get_R();
+    // Same for a view on a larger buffer, e.g. the K x N block of RpmSession's correspondence.
+    template<typename Derived>
+    MatrixXd _correspondence_product(const Eigen::MatrixBase<Derived> &M, const MatrixXd &Y) {
+        return M * Y;
+    }
 
-        MatrixXd Q1 = Q.block(0, 0, K, dim), Q2 = Q.block(0, dim, K, K - dim);
-        MatrixXd R = R_.block(0, 0, dim, dim);
+    MatrixXd _correspondence_product(const MatrixXf &M, const MatrixXd &Y) {
+        MatrixXd MY = MatrixXd::Zero(M.rows(), Y.cols());
+        parallel::parallel_for(0, int(M.rows()), parallel::grain_for(M.cols() * Y.cols()), [&](int begin, int end) {
+            for (int n = 0; n < M.cols(); n++) {
+                for (int j = 0; j < Y.cols(); j++) {
+                    MY.col(j).segment(begin, end - begin) += M.col(n).segment(begin, end - begin).cast<double>() * Y(n, j);
+                }
+            }
+        });
+        return MY;
+    }
 
-#ifdef RPM_USE_BOTHSIDE_OUTLIER_REJECTION
-        MatrixXd W = MatrixXd::Zero(K, K);
-        for (int k = 0; k < K; k++) {
-            W(k, k) = 1.0 / std::max(M.row(k).sum(), epsilon1);
+    // The estimate_correspondence() overloads on the anchors reduced once per estimate.
+    bool _estimate_correspondence(
+            const MatrixXd &X,
+            const MatrixXd &Y,
+            const _Anchors &anchors,
+            const ThinPlateSplineParams &params,
+            const double T,
+            MatrixXd &M,
+            const RpmConfig &config,
+            RpmIterationStats *iteration_stats,
+            SinkhornState *warm) {
+        perf_counters::StageScope correspondence_stage(perf_counters::Stage::correspondence);
+        if (X.cols() != D + 1 || Y.cols() != D + 1) {
+            throw std::invalid_argument("Current only support 3d homogeneou points!");
         }
 
-        MatrixXd T = phi + N * lambda * W;
-
-        LDLT<MatrixXd> solver;
-        MatrixXd L_mat = Q2.transpose() * T * Q2;
+        const int K = X.rows(), N = Y.rows();
+        const double beta = 1.0 / T;
 
-        solver.compute(L_mat.transpose() * L_mat);
-        if (solver.info() != Eigen::Success) {
-            throw std::runtime_error("Param w ldlt decomposition failed!");
+        MatrixXd XT;
+        {
+            StageTimer timer(iteration_stats ? &iteration_stats->apply_time : nullptr);
+            XT = params.applyTransform();
         }
 
-        MatrixXd b_mat = Q2.transpose() * Y;
-        MatrixXd gamma = solver.solve(L_mat.transpose() * b_mat);
-        if (solver.info() != Eigen::Success) {
-            throw std::runtime_error("Param w ldlt solve failed!");
+        // The anchors leave the softassign, it runs on the remaining points only.
+        const bool reduced = !anchors.pairs.empty();
+        const int K_free = reduced ? int(anchors.free_rows.size()) : K;
+        const int N_free = reduced ? int(anchors.free_cols.size()) : N;
+        MatrixXd XT_free, Y_free, A_free;
+        if (reduced) {
+            XT_free = XT(anchors.free_rows, Eigen::all);
+            Y_free = Y(anchors.free_cols, Eigen::all);
+        }
+        const MatrixXd &xs = reduced ? XT_free : XT, &ys = reduced ? Y_free : Y;
+        MatrixXd &A = reduced ? A_free : M;
+
+        {
+            StageTimer timer(iteration_stats ? &iteration_stats->affinity_time : nullptr);
+            RPM_TRACE_SPAN("affinity");
+            A = MatrixXd::Zero(K_free + 1, N_free + 1);
+            _fill_affinity(xs, ys, beta, config.alpha, A);
+
+            //Vector3d center_x(XT.col(0).mean(), XT.col(1).mean(), XT.col(2).mean());
+            //Vector3d center_y(Y.col(0).mean(), Y.col(1).mean(), Y.col(2).mean());
+
+            //	const double beta_start = 1.0 / T0;
+            //#pragma omp parallel for
+            //	for (int k = 0; k < K; k++) {
+            //		const Vector3d& x = XT.row(k);
+            //		double dist = ((center_y - x).squaredNorm());
+            //		M(k, N) = beta_start * std::exp(beta_start * -dist);
+            //	}
+            //
+            //#pragma omp parallel for
+            //	for (int n = 0; n < N; n++) {
+            //		const Vector3d& y = Y.row(n);
+            //		double dist = ((y - center_x).squaredNorm());
+            //		M(K, n) = beta_start * std::exp(beta_start * -dist);
+            //	}
+
+            A.row(K_free).setConstant(1.0 / (N_free + 1));
+            A.col(N_free).setConstant(1.0 / (K_free + 1));
         }
 
-        params.w = Q2 * gamma;
-
-
-#ifdef RPM_REGULARIZE_AFFINE_PARAM  // Add regular term lambdaI * d = lambdaI * I
-        double lambda_d = N * lambda * 0.01;
-
-        L_mat = MatrixXd(R.rows() * 2, R.cols());
-        L_mat << R,
-                MatrixXd::Identity(R.rows(), R.cols()) * lambda_d;
-#else
-        L_mat = R;
-#endif // RPM_REGULARIZE_AFFINE_PARAM
+        {
+            StageTimer timer(iteration_stats ? &iteration_stats->sinkhorn_time : nullptr);
+            RPM_TRACE_SPAN("sinkhorn");
+            perf_counters::StageScope counted(perf_counters::Stage::softassign);
+            SinkhornState cold;
+            int sinkhorn_iterations = soft_assign(A, T, warm ? *warm : cold, config);
+            if (iteration_stats) {
+                iteration_stats->sinkhorn_iterations += sinkhorn_iterations;
+            }
+        }
 
-        solver.compute(L_mat.transpose() * L_mat);
-        if (solver.info() != Eigen::Success) {
-            throw std::runtime_error("Param d ldlt decomposition failed!");
+        if (reduced) {
+            _scatter_free(A_free, anchors, K, N, M);
+        } else {
+            M.conservativeResize(K, N);
         }
 
-#ifdef RPM_REGULARIZE_AFFINE_PARAM
-        b_mat = MatrixXd(R.rows() * 2, R.cols());
-        b_mat << Q1.transpose() * (Y - T * params.w),
-                MatrixXd::Identity(R.rows(), R.cols()) * lambda_d;
-#else
-        b_mat = Q1.transpose() * (Y - K * params.w);
-#endif // RPM_REGULARIZE_AFFINE_PARAM
+        return true;
+    }
+}
+
+bool rpm::estimate_correspondence(
+        const MatrixXd &X,
+        const MatrixXd &Y,
+        const vector<pair<int, int> > &matched_point_indices,
+        const ThinPlateSplineParams &params,
+        const double T,
+        const double /*T0*/,
+        MatrixXd &M,
+        const RpmConfig &config,
+        RpmIterationStats *iteration_stats,
+        SinkhornState *warm) {
+    return _estimate_correspondence(X, Y, _reduce_anchors(X.rows(), Y.rows(), matched_point_indices), params, T, M,
+                                    config, iteration_stats, warm);
+}
 
-        params.d = solver.solve(L_mat.transpose() * b_mat);
-        if (solver.info() != Eigen::Success) {
-            throw std::runtime_error("Param d ldlt solve failed!");
+namespace {
+    bool _estimate_correspondence(
+            const MatrixXd &X,
+            const MatrixXd &Y,
+            const _Anchors &anchors,
+            const ThinPlateSplineParams &params,
+            const double T,
+            MatrixXf &M,
+            const RpmConfig &config,
+            RpmIterationStats *iteration_stats,
+            SinkhornState *warm) {
+        perf_counters::StageScope correspondence_stage(perf_counters::Stage::correspondence);
+        if (X.cols() != D + 1 || Y.cols() != D + 1) {
+            throw std::invalid_argument("Current only support 3d homogeneou points!");
         }
-#else
-        LDLT<MatrixXd> solver;
-        MatrixXd L_mat = (Q2.transpose() * phi * Q2 + (MatrixXd::Identity(K - dim, K - dim) * K * lambda));
 
-        solver.compute(L_mat.transpose() * L_mat);
-        if (solver.info() != Eigen::Success) {
-            throw std::runtime_error("Param w ldlt decomposition failed!");
+        const int K = X.rows(), N = Y.rows();
+        const double beta = 1.0 / T;
+
+        MatrixXd XT;
+        {
+            StageTimer timer(iteration_stats ? &iteration_stats->apply_time : nullptr);
+            XT = params.applyTransform();
         }
 
-        MatrixXd b_mat = Q2.transpose() * Y;
-        MatrixXd gamma = solver.solve(L_mat.transpose() * b_mat);
-        if (solver.info() != Eigen::Success) {
-            throw std::runtime_error("Param w ldlt solve failed!");
+        const bool reduced = !anchors.pairs.empty();
+        const int K_free = reduced ? int(anchors.free_rows.size()) : K;
+        const int N_free = reduced ? int(anchors.free_cols.size()) : N;
+        MatrixXd XT_free, Y_free;
+        MatrixXf A_free;
+        if (reduced) {
+            XT_free = XT(anchors.free_rows, Eigen::all);
+            Y_free = Y(anchors.free_cols, Eigen::all);
         }
+        const MatrixXd &xs = reduced ? XT_free : XT, &ys = reduced ? Y_free : Y;
+        MatrixXf &A = reduced ? A_free : M;
+        const double log_outlier_x = -std::log(K_free + 1.0), log_outlier_y = -std::log(N_free + 1.0);
+
+        // Log of the largest entry of each row, outlier column included, the row is stored divided by it.
+        VectorXd log_scale(K_free + 1);
+        {
+            StageTimer timer(iteration_stats ? &iteration_stats->affinity_time : nullptr);
+            RPM_TRACE_SPAN("affinity");
+            parallel::parallel_for(0, K_free, parallel::grain_for(N_free * 4), [&](int begin, int end) {
+                for (int k = begin; k < end; k++) {
+                    double nearest = std::numeric_limits<double>::infinity();
+                    for (int n = 0; n < N_free; n++) {
+                        nearest = std::min(nearest, (ys.row(n) - xs.row(k)).squaredNorm());
+                    }
+                    log_scale(k) = std::max(beta * (config.alpha - nearest), log_outlier_x);
+                }
+            });
+            log_scale(K_free) = log_outlier_y;
+
+            A.resize(K_free + 1, N_free + 1);
+            parallel::parallel_for(0, N_free, parallel::grain_for(K_free * 8), [&](int begin, int end) {
+                for (int n = begin; n < end; n++) {
+                    const Vector3d &y = ys.row(n);
+                    for (int k = 0; k < K_free; k++) {
+                        const Vector3d &x = xs.row(k);
+                        double dist = ((y - x).squaredNorm());
+                        A(k, n) = float(std::exp(beta * (config.alpha - dist) - log_scale(k)));
+                    }
+                }
+            });
 
-        params.w = Q2 * gamma;
+            A.row(K_free).setOnes();
+            for (int k = 0; k <= K_free; k++) {
+                A(k, N_free) = float(std::exp(log_outlier_x - log_scale(k)));
+            }
+        }
+
+        {
+            StageTimer timer(iteration_stats ? &iteration_stats->sinkhorn_time : nullptr);
+            RPM_TRACE_SPAN("sinkhorn");
+            perf_counters::StageScope counted(perf_counters::Stage::softassign);
+            SinkhornState cold;
+            int sinkhorn_iterations = _soft_assign_scaled(A, log_scale, T, warm ? *warm : cold, config);
+            if (iteration_stats) {
+                iteration_stats->sinkhorn_iterations += sinkhorn_iterations;
+            }
+        }
+
+        if (reduced) {
+            _scatter_free(A_free, anchors, K, N, M);
+        } else {
+            M.conservativeResize(K, N);
+        }
+
+        return true;
+    }
+}
+
+bool rpm::estimate_correspondence(
+        const MatrixXd &X,
+        const MatrixXd &Y,
+        const vector<pair<int, int> > &matched_point_indices,
+        const ThinPlateSplineParams &params,
+        const double T,
+        const double /*T0*/,
+        MatrixXf &M,
+        const RpmConfig &config,
+        RpmIterationStats *iteration_stats,
+        SinkhornState *warm) {
+    return _estimate_correspondence(X, Y, _reduce_anchors(X.rows(), Y.rows(), matched_point_indices), params, T, M,
+                                    config, iteration_stats, warm);
+}
+
+namespace {
+    // Rows of a tile of the matrix free affinity. A tile column and its sums stay in registers and L1.
+    const int affinity_tile = 64;
+    typedef Array<double, Dynamic, 1, 0, affinity_tile, 1> _TileColumn;
+
+    // The (K + 1) * (N + 1) affinity of estimate_correspondence() for the free points xs and ys, never
+    // stored: A(k, n) = exp(beta * (alpha - ||y_n - x_k||^2)), outlier_row in row K and outlier_col
+    // in column N, recomputed a tile column at a time by each pass.
+    struct _TiledAffinity {
+        const MatrixXd &xs, &ys;
+        double beta, alpha;
+        int K, N;
+        double outlier_row, outlier_col;
+
+        // log A(k, n) of column n < N over the rows [begin, begin + log_a.size()).
+        void log_column(const int n, const int begin, _TileColumn &log_a) const {
+            const int rows = log_a.size();
+            log_a = (xs.col(0).segment(begin, rows).array() - ys(n, 0)).square()
+                    + (xs.col(1).segment(begin, rows).array() - ys(n, 1)).square()
+                    + (xs.col(2).segment(begin, rows).array() - ys(n, 2)).square();
+            log_a = beta * (alpha - log_a);
+        }
+
+        int tiles() const {
+            return (K + affinity_tile - 1) / affinity_tile;
+        }
+
+        int tile_grain() const {
+            return parallel::grain_for(affinity_tile * std::min(N, parallel::min_task_work));
+        }
+    };
+
+    // row_sum = A * v over the rows K of the points.
+    void _tiled_row_products(const _TiledAffinity &A, const VectorXd &v, VectorXd &row_sum) {
+        parallel::parallel_for(0, A.tiles(), A.tile_grain(), [&](int begin, int end) {
+            _TileColumn log_a, sum;
+            for (int t = begin; t < end; t++) {
+                const int row = t * affinity_tile, rows = std::min(affinity_tile, A.K - row);
+                log_a.resize(rows);
+                sum.setConstant(rows, A.outlier_col * v(A.N));
+                for (int n = 0; n < A.N; n++) {
+                    A.log_column(n, row, log_a);
+                    sum += log_a.exp() * v(n);
+                }
+                row_sum.segment(row, rows) = sum.matrix();
+            }
+        });
+    }
+
+    // col_sum = A' * u over the columns N of the points.
+    void _tiled_col_products(const _TiledAffinity &A, const VectorXd &u, VectorXd &col_sum) {
+        parallel::parallel_for(0, A.N, parallel::grain_for(A.K + 1), [&](int begin, int end) {
+            _TileColumn log_a;
+            for (int n = begin; n < end; n++) {
+                double sum = A.outlier_row * u(A.K);
+                for (int row = 0; row < A.K; row += affinity_tile) {
+                    const int rows = std::min(affinity_tile, A.K - row);
+                    log_a.resize(rows);
+                    A.log_column(n, row, log_a);
+                    sum += (log_a.exp() * u.segment(row, rows).array()).sum();
+                }
+                col_sum(n) = sum;
+            }
+        });
+    }
+
+    // _sinkhorn() on the tiled affinity, two passes over the entries per sweep. col_sum is left with
+    // the column sums of A' * u of the last sweep, outlier row included.
+    int _sinkhorn_tiled(const _TiledAffinity &A, VectorXd &u, VectorXd &v, const RpmConfig &config,
+                        VectorXd &row_sum, VectorXd &col_sum) {
+        const double epsilon1 = config.epsilon1;
+
+        row_sum.resize(A.K);
+        col_sum.resize(A.N);
+        int iter = 0;
+        while (iter < config.I1) {
+            _tiled_row_products(A, v, row_sum);
+
+            if (config.sinkhorn_tolerance > 0 && iter > 0) {
+                double residual = 0;
+                for (int r = 0; r < A.K; r++) {
+                    const double sum = u(r) * row_sum(r);
+                    if (sum >= epsilon1) {
+                        residual = std::max(residual, std::abs(sum - 1));
+                    }
+                }
+                if (residual < config.sinkhorn_tolerance) {
+                    break;
+                }
+            }
+
+            for (int r = 0; r < A.K; r++) {
+                if (u(r) * row_sum(r) >= epsilon1) {
+                    u(r) = 1.0 / row_sum(r);
+                }
+            }
+
+            _tiled_col_products(A, u, col_sum);
+            for (int c = 0; c < A.N; c++) {
+                if (v(c) * col_sum(c) >= epsilon1) {
+                    v(c) = 1.0 / col_sum(c);
+                }
+            }
+
+            iter++;
+        }
+        if (iter == 0) {
+            _tiled_col_products(A, u, col_sum);
+        }
+
+        return iter;
+    }
+
+    // Row sums, M * Y and sum m log m per row of M = diag(u) * A * diag(v), outlier row and column left.
+    void _tiled_sums(const _TiledAffinity &A, const VectorXd &u, const VectorXd &v, VectorXd &row_sums,
+                     MatrixXd &MY, VectorXd &entropy) {
+        const VectorXd log_v = v.array().log();
+        row_sums.resize(A.K);
+        MY.resize(A.K, A.ys.cols());
+        entropy.resize(A.K);
+        parallel::parallel_for(0, A.tiles(), A.tile_grain(), [&](int begin, int end) {
+            _TileColumn log_a, log_u, m, sum, m_log_m;
+            Matrix<double, Dynamic, D + 1, 0, affinity_tile, D + 1> my;
+            for (int t = begin; t < end; t++) {
+                const int row = t * affinity_tile, rows = std::min(affinity_tile, A.K - row);
+                log_a.resize(rows);
+                log_u = u.segment(row, rows).array().log();
+                sum.setZero(rows);
+                m_log_m.setZero(rows);
+                my.setZero(rows, D + 1);
+                for (int n = 0; n < A.N; n++) {
+                    A.log_column(n, row, log_a);
+                    m = u.segment(row, rows).array() * log_a.exp() * v(n);
+                    sum += m;
+                    m_log_m += (m > 0).select(m * (log_u + log_a + log_v(n)), 0.0);
+                    my.noalias() += m.matrix() * A.ys.row(n);
+                }
+                row_sums.segment(row, rows) = sum.matrix();
+                MY.middleRows(row, rows) = my;
+                entropy.segment(row, rows) = m_log_m.matrix();
+            }
+        });
+    }
+
+    // Free points of the anchors, xs and ys are only copied when there are anchors.
+    struct _FreePoints {
+        const _Anchors &anchors;
+        MatrixXd XT_free, Y_free;
+
+        _FreePoints(const MatrixXd &XT, const MatrixXd &Y, const _Anchors &anchors) : anchors(anchors) {
+            if (reduced()) {
+                XT_free = XT(anchors.free_rows, Eigen::all);
+                Y_free = Y(anchors.free_cols, Eigen::all);
+            }
+        }
+
+        bool reduced() const {
+            return !anchors.pairs.empty();
+        }
+    };
+
+    bool _estimate_correspondence(
+            const MatrixXd &X,
+            const MatrixXd &Y,
+            const _Anchors &anchors,
+            const ThinPlateSplineParams &params,
+            const double T,
+            CorrespondenceSums &sums,
+            const RpmConfig &config,
+            RpmIterationStats *iteration_stats,
+            SinkhornState *warm) {
+        perf_counters::StageScope correspondence_stage(perf_counters::Stage::correspondence);
+        if (X.cols() != D + 1 || Y.cols() != D + 1) {
+            throw std::invalid_argument("Current only support 3d homogeneou points!");
+        }
+
+        const int K = X.rows(), N = Y.rows();
+        {
+            StageTimer timer(iteration_stats ? &iteration_stats->apply_time : nullptr);
+            sums.XT = params.applyTransform();
+        }
+
+        const _FreePoints points(sums.XT, Y, anchors);
+        const bool reduced = points.reduced();
+        const MatrixXd &xs = reduced ? points.XT_free : sums.XT, &ys = reduced ? points.Y_free : Y;
+        const int K_free = xs.rows(), N_free = ys.rows();
+        const _TiledAffinity A{xs, ys, 1.0 / T, config.alpha, K_free, N_free, 1.0 / (N_free + 1), 1.0 / (K_free + 1)};
+
+        SinkhornState &state = sums.scalings;
+        if (warm) {
+            state = *warm;
+        } else {
+            state.reset();
+        }
+        VectorXd row_sum, col_sum;
+        {
+            StageTimer timer(iteration_stats ? &iteration_stats->sinkhorn_time : nullptr);
+            RPM_TRACE_SPAN("sinkhorn");
+            perf_counters::StageScope counted(perf_counters::Stage::softassign);
+            _init_scalings(state, K_free + 1, N_free + 1, T);
+            int sinkhorn_iterations = _sinkhorn_tiled(A, state.u, state.v, config, row_sum, col_sum);
+            if (iteration_stats) {
+                iteration_stats->sinkhorn_iterations += sinkhorn_iterations;
+            }
+        }
+        if (warm) {
+            *warm = state;
+        }
+
+        // The pass that stands in for forming M.
+        StageTimer timer(iteration_stats ? &iteration_stats->affinity_time : nullptr);
+        RPM_TRACE_SPAN("correspondence_sums");
+        VectorXd row_sums, entropy;
+        MatrixXd MY;
+        _tiled_sums(A, state.u, state.v, row_sums, MY, entropy);
+        sums.entropy = entropy.sum();
+
+        // Column sums of M from those of the last sweep, without the outlier row.
+        col_sum = ((col_sum.array() - A.outlier_row * state.u(K_free)) * state.v.head(N_free).array()).matrix();
+
+        if (!reduced) {
+            sums.row_sums = std::move(row_sums);
+            sums.col_sums = std::move(col_sum);
+            sums.MY = std::move(MY);
+            return true;
+        }
+
+        sums.row_sums.setZero(K);
+        sums.col_sums.setZero(N);
+        sums.MY.setZero(K, D + 1);
+        for (int i = 0; i < K_free; i++) {
+            sums.row_sums(anchors.free_rows[i]) = row_sums(i);
+            sums.MY.row(anchors.free_rows[i]) = MY.row(i);
+        }
+        for (int j = 0; j < N_free; j++) {
+            sums.col_sums(anchors.free_cols[j]) = col_sum(j);
+        }
+        for (auto point_pair : anchors.pairs) {
+            sums.row_sums(point_pair.first) = 1;
+            sums.col_sums(point_pair.second) = 1;
+            sums.MY.row(point_pair.first) = Y.row(point_pair.second);
+        }
+
+        return true;
+    }
+}
+
+bool rpm::estimate_correspondence(
+        const MatrixXd &X,
+        const MatrixXd &Y,
+        const vector<pair<int, int> > &matched_point_indices,
+        const ThinPlateSplineParams &params,
+        const double T,
+        const double /*T0*/,
+        CorrespondenceSums &sums,
+        const RpmConfig &config,
+        RpmIterationStats *iteration_stats,
+        SinkhornState *warm) {
+    return _estimate_correspondence(X, Y, _reduce_anchors(X.rows(), Y.rows(), matched_point_indices), params, T, sums,
+                                    config, iteration_stats, warm);
+}
+
+namespace {
+    void _form_correspondence(
+            const CorrespondenceSums &sums,
+            const MatrixXd &Y,
+            const _Anchors &anchors,
+            MatrixXd &M,
+            const RpmConfig &config) {
+        if (sums.XT.cols() != D + 1 || Y.cols() != D + 1) {
+            throw std::invalid_argument("Current only support 3d homogeneou points!");
+        }
+
+        const int K = sums.XT.rows(), N = Y.rows();
+        const _FreePoints points(sums.XT, Y, anchors);
+        const bool reduced = points.reduced();
+        const MatrixXd &xs = reduced ? points.XT_free : sums.XT, &ys = reduced ? points.Y_free : Y;
+        const int K_free = xs.rows(), N_free = ys.rows();
+        const SinkhornState &state = sums.scalings;
+        if (state.u.size() != K_free + 1 || state.v.size() != N_free + 1 || !(state.T > 0)) {
+            throw std::invalid_argument("Correspondence sums not taken from X and Y!");
+        }
+        const _TiledAffinity A{xs, ys, 1.0 / state.T, config.alpha, K_free, N_free, 1.0 / (N_free + 1),
+                               1.0 / (K_free + 1)};
+
+        M.setZero(K, N);
+        parallel::parallel_for(0, N_free, parallel::grain_for(K_free * 8), [&](int begin, int end) {
+            _TileColumn log_a;
+            for (int j = begin; j < end; j++) {
+                const int n = reduced ? points.anchors.free_cols[j] : j;
+                for (int row = 0; row < K_free; row += affinity_tile) {
+                    const int rows = std::min(affinity_tile, K_free - row);
+                    log_a.resize(rows);
+                    A.log_column(j, row, log_a);
+                    const _TileColumn m = state.u.segment(row, rows).array() * log_a.exp() * state.v(j);
+                    if (!reduced) {
+                        M.col(n).segment(row, rows) = m.matrix();
+                        continue;
+                    }
+                    for (int i = 0; i < rows; i++) {
+                        M(points.anchors.free_rows[row + i], n) = m(i);
+                    }
+                }
+            }
+        });
+        for (auto point_pair : points.anchors.pairs) {
+            M(point_pair.first, point_pair.second) = 1;
+        }
+    }
+}
+
+void rpm::form_correspondence(
+        const CorrespondenceSums &sums,
+        const MatrixXd &Y,
+        const vector<pair<int, int> > &matched_point_indices,
+        MatrixXd &M,
+        const RpmConfig &config) {
+    _form_correspondence(sums, Y, _reduce_anchors(sums.XT.rows(), Y.rows(), matched_point_indices), M, config);
+}
+
+int rpm::soft_assign(
+        MatrixXd &assignment_matrix,
+        const RpmConfig &config) {
+    SinkhornState state;
+    return soft_assign(assignment_matrix, 1, state, config);
+}
+
+int rpm::soft_assign(
+        MatrixXd &assignment_matrix,
+        const double T,
+        SinkhornState &state,
+        const RpmConfig &config) {
+    // M = diag(u) * A * diag(v). The sweeps only update u and v, M is written once at the end.
+    _init_scalings(state, assignment_matrix.rows(), assignment_matrix.cols(), T);
+    VectorXd row_sum;
+    int iter = _sinkhorn(assignment_matrix, state.u, state.v, config, row_sum);
+    _apply_scalings(assignment_matrix, state.u, state.v);
+
+    return iter;
+}
+
+namespace {
+    // The transform solve from the row sums of M and M * Y, anchors as reduced by _reduce_anchors().
+    bool _solve_transform(
+            const MatrixXd &X,
+            const VectorXd &row_sums,
+            const MatrixXd &MY,
+            const int N,
+            const double lambda,
+            ThinPlateSplineParams &params,
+            const RpmConfig &config,
+            RpmIterationStats *iteration_stats,
+            const vector<pair<int, int> > &anchors) {
+        //auto t1 = std::chrono::high_resolution_clock::now();
+        StageTimer timer(iteration_stats ? &iteration_stats->solve_time : nullptr);
+        RPM_TRACE_SPAN("transform_solve");
+        perf_counters::StageScope counted(perf_counters::Stage::transform);
+
+        try {
+            if (X.cols() != D + 1 || MY.cols() != D + 1) {
+                throw std::invalid_argument("Current only support 3d homogeneou points!");
+            }
+
+            const int K = X.rows();
+            if (row_sums.size() != K || MY.rows() != K) {
+                throw std::invalid_argument("Matrix M size not same as X and Y!");
+            }
+
+            if (params.is_affine_only()) {
+                throw std::invalid_argument("Affine only params, see estimate_affine_transform()!");
+            }
+
+            int dim = D + 1;
+            MatrixXd Y = MY;
+#ifdef RPM_USE_BOTHSIDE_OUTLIER_REJECTION
+            for (int k = 0; k < K; k++) {
+                Y.row(k) /= std::max(row_sums(k), config.epsilon1);
+            }
+#endif // RPM_USE_BOTHSIDE_OUTLIER_REJECTION
+
+            const MatrixXd &phi = params.get_phi();
+            const MatrixXd &Q = params.get_Q();
+            const MatrixXd &R_ = params.get_R();
+
+            const auto Q1 = Q.block(0, 0, K, dim), Q2 = Q.block(0, dim, K, K - dim);
+            MatrixXd R = R_.block(0, 0, dim, dim);
+
+            // Anchors are interpolated, their smoothing weight is 0.
+
+#ifdef RPM_USE_BOTHSIDE_OUTLIER_REJECTION
+            VectorXd weights(K);
+            for (int k = 0; k < K; k++) {
+                weights(k) = 1.0 / std::max(row_sums(k), config.epsilon1);
+            }
+            for (auto point_pair : anchors) {
+                weights(point_pair.first) = 0;
+            }
+
+            LDLT<MatrixXd> solver;
+            MatrixXd L_mat;
+            MatrixXd b_mat = Q2.transpose() * Y;
+            MatrixXd gamma;
+            MatrixXd Tw;  // T * w, T = phi + N * lambda * W
+
+            const TpsSolveBasis *basis = config.solve_basis;
+            if (basis && basis->size() == K) {
+                gamma = Q2.transpose() * params.w;  // the last w, Q2 has orthonormal columns
+            }
+            if (basis && basis->size() == K && basis->solve(weights, N * lambda, b_mat, gamma)) {
+                params.w = Q2 * gamma;
+                Tw = phi * params.w + N * lambda * (weights.asDiagonal() * params.w);
+            } else {
+                MatrixXd W = MatrixXd::Zero(K, K);
+                W.diagonal() = weights;
+
+                MatrixXd T = phi + N * lambda * W;
+
+                L_mat = Q2.transpose() * T * Q2;
+
+                solver.compute(L_mat.transpose() * L_mat);
+                if (solver.info() != Eigen::Success) {
+                    throw std::runtime_error("Param w ldlt decomposition failed!");
+                }
+
+                gamma = solver.solve(L_mat.transpose() * b_mat);
+                if (solver.info() != Eigen::Success) {
+                    throw std::runtime_error("Param w ldlt solve failed!");
+                }
+
+                params.w = Q2 * gamma;
+                Tw = T * params.w;
+            }
 
 
 #ifdef RPM_REGULARIZE_AFFINE_PARAM  // Add regular term lambdaI * d = lambdaI * I
-        double lambda_d = K * lambda * 0.01;
+            double lambda_d = N * lambda * 0.01;
 
-        L_mat = MatrixXd(R.rows() * 2, R.cols());
-        L_mat << R,
-                MatrixXd::Identity(R.rows(), R.cols()) * lambda_d;
+            L_mat = MatrixXd(R.rows() * 2, R.cols());
+            L_mat << R,
+                    MatrixXd::Identity(R.rows(), R.cols()) * lambda_d;
 #else
-        L_mat = R;
+            L_mat = R;
 #endif // RPM_REGULARIZE_AFFINE_PARAM
 
-        solver.compute(L_mat.transpose() * L_mat);
-        if (solver.info() != Eigen::Success) {
-            throw std::runtime_error("Param d ldlt decomposition failed!");
-        }
+            solver.compute(L_mat.transpose() * L_mat);
+            if (solver.info() != Eigen::Success) {
+                throw std::runtime_error("Param d ldlt decomposition failed!");
+            }
 
 #ifdef RPM_REGULARIZE_AFFINE_PARAM
-        b_mat = MatrixXd(R.rows() * 2, R.cols());
-        b_mat << Q1.transpose() * (Y - phi * params.w),
-                MatrixXd::Identity(R.rows(), R.cols()) * lambda_d;
+            b_mat = MatrixXd(R.rows() * 2, R.cols());
+            b_mat << Q1.transpose() * (Y - Tw),
+                    MatrixXd::Identity(R.rows(), R.cols()) * lambda_d;
 #else
-        b_mat = Q1.transpose() * (Y - phi * params.w);
+            b_mat = Q1.transpose() * (Y - K * params.w);
 #endif // RPM_REGULARIZE_AFFINE_PARAM
 
-        params.d = solver.solve(L_mat.transpose() * b_mat);
-        if (solver.info() != Eigen::Success) {
-            throw std::runtime_error("Param d ldlt solve failed!");
-        }
+            params.d = solver.solve(L_mat.transpose() * b_mat);
+            if (solver.info() != Eigen::Success) {
+                throw std::runtime_error("Param d ldlt solve failed!");
+            }
+#else
+            LDLT<MatrixXd> solver;
+            MatrixXd L_mat = (Q2.transpose() * phi * Q2 + (MatrixXd::Identity(K - dim, K - dim) * K * lambda));
+            for (auto point_pair : anchors) {
+                L_mat -= K * lambda * Q2.row(point_pair.first).transpose() * Q2.row(point_pair.first);
+            }
+
+            solver.compute(L_mat.transpose() * L_mat);
+            if (solver.info() != Eigen::Success) {
+                throw std::runtime_error("Param w ldlt decomposition failed!");
+            }
+
+            MatrixXd b_mat = Q2.transpose() * Y;
+            MatrixXd gamma = solver.solve(L_mat.transpose() * b_mat);
+            if (solver.info() != Eigen::Success) {
+                throw std::runtime_error("Param w ldlt solve failed!");
+            }
+
+            params.w = Q2 * gamma;
+
+
+#ifdef RPM_REGULARIZE_AFFINE_PARAM  // Add regular term lambdaI * d = lambdaI * I
+            double lambda_d = K * lambda * 0.01;
 
-        // Another form of regularize d.
-        //MatrixXd A = (R.transpose() * R + 0.01 * lambda * MatrixXd::Identity(dim, dim)).inverse()
-        //	* (R.transpose() * ((Q1.transpose() * (Y - phi * params.w)) - R));
-        //params.d = A + MatrixXd::Identity(dim, dim);
+            L_mat = MatrixXd(R.rows() * 2, R.cols());
+            L_mat << R,
+                    MatrixXd::Identity(R.rows(), R.cols()) * lambda_d;
+#else
+            L_mat = R;
+#endif // RPM_REGULARIZE_AFFINE_PARAM
+
+            solver.compute(L_mat.transpose() * L_mat);
+            if (solver.info() != Eigen::Success) {
+                throw std::runtime_error("Param d ldlt decomposition failed!");
+            }
+
+#ifdef RPM_REGULARIZE_AFFINE_PARAM
+            b_mat = MatrixXd(R.rows() * 2, R.cols());
+            b_mat << Q1.transpose() * (Y - phi * params.w),
+                    MatrixXd::Identity(R.rows(), R.cols()) * lambda_d;
+#else
+            b_mat = Q1.transpose() * (Y - phi * params.w);
+#endif // RPM_REGULARIZE_AFFINE_PARAM
+
+            params.d = solver.solve(L_mat.transpose() * b_mat);
+            if (solver.info() != Eigen::Success) {
+                throw std::runtime_error("Param d ldlt solve failed!");
+            }
+
+            // Another form of regularize d.
+            //MatrixXd A = (R.transpose() * R + 0.01 * lambda * MatrixXd::Identity(dim, dim)).inverse()
+            //	* (R.transpose() * ((Q1.transpose() * (Y - phi * params.w)) - R));
+            //params.d = A + MatrixXd::Identity(dim, dim);
 
 #endif // RPM_USE_BOTHSIDE_OUTLIER_REJECTION
+        }
+        catch (const std::exception &e) {
+            std::cerr << e.what() << std::endl;
+
+            return false;
+        }
+
+        //auto t2 = std::chrono::high_resolution_clock::now();
+
+        //auto span = std::chrono::duration_cast<std::chrono::duration<double> >(t2 - t1);
+        //std::cout << "Thin-plate spline params estimating time: " << span.count() << " seconds.\n";
+
+        return true;
     }
-    catch (const std::exception &e) {
-        std::cout << e.what() << std::endl;
+}
 
-        return false;
+namespace {
+    template<typename Matrix>
+    bool _estimate_transform(
+            const MatrixXd &X,
+            const MatrixXd &Y,
+            const Matrix &M,
+            const double lambda,
+            ThinPlateSplineParams &params,
+            const RpmConfig &config,
+            RpmIterationStats *iteration_stats,
+            const _Anchors &anchors) {
+        StageTimer timer(iteration_stats ? &iteration_stats->solve_time : nullptr);
+        RPM_TRACE_SPAN("estimate_transform");
+        perf_counters::StageScope counted(perf_counters::Stage::transform);
+
+        MatrixXd MY;
+        VectorXd row_sums;
+        try {
+            if (Y.cols() != D + 1) {
+                throw std::invalid_argument("Current only support 3d homogeneou points!");
+            }
+            if (M.rows() != X.rows() || M.cols() != Y.rows()) {
+                throw std::invalid_argument("Matrix M size not same as X and Y!");
+            }
+
+            MY = _correspondence_product(M, Y);
+            row_sums = M.template cast<double>().rowwise().sum();
+        }
+        catch (const std::exception &e) {
+            std::cerr << e.what() << std::endl;
+
+            return false;
+        }
+
+        return _solve_transform(X, row_sums, MY, Y.rows(), lambda, params, config, nullptr, anchors.pairs);
     }
+}
 
-    //auto t2 = std::chrono::high_resolution_clock::now();
+bool rpm::estimate_transform(
+        const MatrixXd &X,
+        const MatrixXd &Y,
+        const MatrixXd &M,
+        const double lambda,
+        ThinPlateSplineParams &params,
+        const RpmConfig &config,
+        RpmIterationStats *iteration_stats,
+        const vector<pair<int, int> > &matched_point_indices) {
+    return _estimate_transform(X, Y, M, lambda, params, config, iteration_stats,
+                               _reduce_anchors(X.rows(), Y.rows(), matched_point_indices));
+}
 
-    //auto span = std::chrono::duration_cast<std::chrono::duration<double> >(t2 - t1);
-    //std::cout << "Thin-plate spline params estimating time: " << span.count() << " seconds.\n";
+bool rpm::estimate_transform(
+        const MatrixXd &X,
+        const MatrixXd &Y,
+        const MatrixXf &M,
+        const double lambda,
+        ThinPlateSplineParams &params,
+        const RpmConfig &config,
+        RpmIterationStats *iteration_stats,
+        const vector<pair<int, int> > &matched_point_indices) {
+    return _estimate_transform(X, Y, M, lambda, params, config, iteration_stats,
+                               _reduce_anchors(X.rows(), Y.rows(), matched_point_indices));
+}
 
-    return true;
+bool rpm::estimate_transform(
+        const MatrixXd &X,
+        const VectorXd &row_sums,
+        const MatrixXd &MY,
+        const int N,
+        const double lambda,
+        ThinPlateSplineParams &params,
+        const RpmConfig &config,
+        RpmIterationStats *iteration_stats,
+        const vector<pair<int, int> > &matched_point_indices) {
+    return _solve_transform(X, row_sums, MY, N, lambda, params, config, iteration_stats,
+                            _reduce_anchors(X.rows(), N, matched_point_indices).pairs);
 }
 
-MatrixXd rpm::apply_correspondence(const MatrixXd &Y, const MatrixXd &M) {
-    if (Y.cols() != rpm::D + 1) {
-        throw std::invalid_argument("input must be 3d homogeneou points!");
+namespace {
+    template<typename Matrix>
+    double _energy(
+            const MatrixXd &X,
+            const MatrixXd &Y,
+            const Matrix &M,
+            const ThinPlateSplineParams &params,
+            const double T,
+            const double lambda,
+            const RpmConfig &config) {
+        const int K = X.rows(), N = Y.rows();
+        if (M.rows() != K || M.cols() != N) {
+            throw std::invalid_argument("Matrix M size not same as X and Y!");
+        }
+
+        const MatrixXd XT = params.applyTransform();
+
+        // sum m_kn ||y_n - x_k||^2 = sum_k r_k ||x_k||^2 + sum_n c_n ||y_n||^2 - 2 tr(XT' M Y)
+        const VectorXd row_sum = M.template cast<double>().rowwise().sum();
+        const RowVectorXd col_sum = M.template cast<double>().colwise().sum();
+        double match = row_sum.dot(XT.leftCols(D).rowwise().squaredNorm())
+                       + col_sum.dot(Y.leftCols(D).rowwise().squaredNorm())
+                       - 2 * XT.leftCols(D).cwiseProduct(_correspondence_product(M, Y.leftCols(D))).sum();
+
+        double entropy = 0;
+        for (int n = 0; n < N; n++) {
+            for (int k = 0; k < K; k++) {
+                const double m = M(k, n);
+                if (m > 0) {
+                    entropy += m * std::log(m);
+                }
+            }
+        }
+
+        const MatrixXd &phi = params.get_phi();
+        const double bending = params.is_affine_only() ? 0 : (params.w.transpose() * phi * params.w).trace();
+
+        return match + lambda * bending + T * entropy - config.alpha * row_sum.sum();
     }
+}
 
-    MatrixXd MY = M * Y;
-#ifdef RPM_USE_BOTHSIDE_OUTLIER_REJECTION
-    for (int k = 0; k < M.rows(); k++) {
-        MY.row(k) /= std::max(M.row(k).sum(), epsilon1);
+double rpm::energy(
+        const MatrixXd &X,
+        const MatrixXd &Y,
+        const MatrixXd &M,
+        const ThinPlateSplineParams &params,
+        const double T,
+        const double lambda,
+        const RpmConfig &config) {
+    return _energy(X, Y, M, params, T, lambda, config);
+}
+
+double rpm::energy(
+        const MatrixXd &X,
+        const MatrixXd &Y,
+        const MatrixXf &M,
+        const ThinPlateSplineParams &params,
+        const double T,
+        const double lambda,
+        const RpmConfig &config) {
+    return _energy(X, Y, M, params, T, lambda, config);
+}
+
+double rpm::energy(
+        const MatrixXd &X,
+        const MatrixXd &Y,
+        const CorrespondenceSums &sums,
+        const ThinPlateSplineParams &params,
+        const double T,
+        const double lambda,
+        const RpmConfig &config) {
+    const int K = X.rows(), N = Y.rows();
+    if (sums.row_sums.size() != K || sums.col_sums.size() != N || sums.MY.rows() != K) {
+        throw std::invalid_argument("Correspondence sums size not same as X and Y!");
     }
+
+    const MatrixXd XT = params.applyTransform();
+    double match = sums.row_sums.dot(XT.leftCols(D).rowwise().squaredNorm())
+                   + sums.col_sums.dot(Y.leftCols(D).rowwise().squaredNorm())
+                   - 2 * XT.leftCols(D).cwiseProduct(sums.MY.leftCols(D)).sum();
+
+    const MatrixXd &phi = params.get_phi();
+    const double bending = params.is_affine_only() ? 0 : (params.w.transpose() * phi * params.w).trace();
+
+    return match + lambda * bending + T * sums.entropy - config.alpha * sums.row_sums.sum();
+}
+
+namespace {
+    template<typename Matrix>
+    MatrixXd _apply_correspondence(const MatrixXd &Y, const Matrix &M, const RpmConfig &config) {
+        if (Y.cols() != rpm::D + 1) {
+            throw std::invalid_argument("input must be 3d homogeneou points!");
+        }
+
+        MatrixXd MY = _correspondence_product(M, Y);
+#ifdef RPM_USE_BOTHSIDE_OUTLIER_REJECTION
+        for (int k = 0; k < M.rows(); k++) {
+            MY.row(k) /= std::max(M.row(k).template cast<double>().sum(), config.epsilon1);
+        }
 #endif // RPM_USE_BOTHSIDE_OUTLIER_REJECTION
 
-    return MY;
+        return MY;
+    }
+}
+
+MatrixXd rpm::apply_correspondence(const MatrixXd &Y, const MatrixXd &M, const RpmConfig &config) {
+    return _apply_correspondence(Y, M, config);
+}
+
+MatrixXd rpm::apply_correspondence(const MatrixXd &Y, const MatrixXf &M, const RpmConfig &config) {
+    return _apply_correspondence(Y, M, config);
 }
 
-rpm::ThinPlateSplineParams::ThinPlateSplineParams(const MatrixXd &X_) {
+rpm::ThinPlateSplineParams::ThinPlateSplineParams(const MatrixXd &X_) : ThinPlateSplineParams(X_, false) {
+}
+
+rpm::ThinPlateSplineParams::ThinPlateSplineParams(const MatrixXd &X_, const bool affine_only_)
+        : affine_only(affine_only_) {
+    std::shared_ptr<Source> built = std::make_shared<Source>();
+    source = built;
+    MatrixXd &X = built->X, &phi = built->phi;
     X = X_;
     data_process::homo(X);
 
     const int K = X.rows();
 
+    w = MatrixXd::Zero(K, rpm::D + 1);
+    d = MatrixXd::Identity(rpm::D + 1, rpm::D + 1);
+    if (affine_only) {
+        return;
+    }
+
     phi = MatrixXd::Zero(K, K);  // phi(a, b) = || Xb - Xa || ^ 2 * log(|| Xb - Xa ||);
-#pragma omp parallel for
-    for (int a_i = 0; a_i < K; a_i++) {
-        VectorXd a = X.row(a_i);
+    parallel::parallel_for(0, K, parallel::grain_for(K * 8), [&](int begin, int end) {
+        for (int a_i = begin; a_i < end; a_i++) {
+            const Vector3d a = X.row(a_i);
 
-        for (int b_i = 0; b_i < K; b_i++) {
-            if (b_i == a_i) {
-                continue;
-            }
+            for (int b_i = 0; b_i < K; b_i++) {
+                if (b_i == a_i) {
+                    continue;
+                }
 
-            VectorXd b = X.row(b_i);
+                const Vector3d b = X.row(b_i);
 
-            phi(b_i, a_i) = ((b - a).squaredNorm() * log((b - a).norm()));
+                phi(b_i, a_i) = ((b - a).squaredNorm() * log((b - a).norm()));
+            }
         }
-    }
+    });
 
     HouseholderQR<MatrixXd> qr;
     qr.compute(X);
 
-    Q = qr.householderQ();
-    R = qr.matrixQR().triangularView<Upper>();
-
-    w = MatrixXd::Zero(X.rows(), rpm::D + 1);
-    d = MatrixXd::Identity(rpm::D + 1, rpm::D + 1);
-}
-
-rpm::ThinPlateSplineParams::ThinPlateSplineParams(const ThinPlateSplineParams &other) {
-    d = other.d;
-    w = other.w;
-    X = other.X;
-    phi = other.phi;
-    Q = other.Q;
-    R = other.R;
+    built->Q = qr.householderQ();
+    built->R = qr.matrixQR().triangularView<Upper>();
 }
 
 MatrixXd rpm::ThinPlateSplineParams::applyTransform(bool hnormalize) const {
-    MatrixXd XT = X * d + phi * w;
+    RPM_TRACE_SPAN("apply_transform");
+    perf_counters::StageScope counted(perf_counters::Stage::apply);
+    const MatrixXd &X = source->X;
+    MatrixXd XT = affine_only ? MatrixXd(X * d) : MatrixXd(X * d + source->phi * w);
 
     if (hnormalize) {
         data_process::hnorm(XT);
@@ -539,26 +1993,38 @@ MatrixXd rpm::ThinPlateSplineParams::applyTransform(bool hnormalize) const {
 }
 
 MatrixXd rpm::ThinPlateSplineParams::applyTransform(const MatrixXd &P_, bool hnormalize) const {
+    RPM_TRACE_SPAN("apply_transform");
+    perf_counters::StageScope counted(perf_counters::Stage::apply);
     MatrixXd P = P_;
     data_process::homo(P);
 
+    if (affine_only) {
+        MatrixXd PT = P * d;
+        if (hnormalize) {
+            data_process::hnorm(PT);
+        }
+        return PT;
+    }
+
+    const MatrixXd &X = source->X;
     const int N = P.rows();
     const int K = X.rows();
 
     MatrixXd phi_px = MatrixXd::Zero(N, K);  // phi(a, b) = || Xb - Xa || ^ 2 * log(|| Xb - Xa ||);
-#pragma omp parallel for
-    for (int p_i = 0; p_i < N; p_i++) {
-        const Vector3d &p = P.row(p_i);
-
-        for (int x_i = 0; x_i < K; x_i++) {
+    parallel::parallel_for(0, K, parallel::grain_for(N * 8), [&](int begin, int end) {
+        for (int x_i = begin; x_i < end; x_i++) {
             const Vector3d &x = X.row(x_i);
 
-            double dist = (p - x).norm();
-            if (dist > 1e-5) {
-                phi_px(p_i, x_i) = (dist * dist) * log(dist);
+            for (int p_i = 0; p_i < N; p_i++) {
+                const Vector3d &p = P.row(p_i);
+
+                double dist = (p - x).norm();
+                if (dist > 1e-5) {
+                    phi_px(p_i, x_i) = (dist * dist) * log(dist);
+                }
             }
         }
-    }
+    });
 
     MatrixXd PT = P * d + phi_px * w;
     if (hnormalize) {
@@ -567,21 +2033,439 @@ MatrixXd rpm::ThinPlateSplineParams::applyTransform(const MatrixXd &P_, bool hno
     return PT;
 }
 
-Vector2d rpm::ThinPlateSplineParams::applyTransform(const Vector2d &p, bool hnormalize) const {
+// A 2d point is always returned normalized.
+Vector2d rpm::ThinPlateSplineParams::applyTransform(const Vector2d &p, bool /*hnormalize*/) const {
     Vector3d P = p.homogeneous();
+    if (affine_only) {
+        return (d.transpose() * P).hnormalized();
+    }
 
+    const MatrixXd &X = source->X;
     const int K = X.rows();
     VectorXd phi_px = VectorXd::Zero(K);  // phi(a, b) = || Xb - Xa || ^ 2 * log(|| Xb - Xa ||);
-#pragma omp parallel for
-    for (int x_i = 0; x_i < K; x_i++) {
-        const Vector3d &x = X.row(x_i);
+    // Usually called per grid point from an outer loop, so this only splits for very large K.
+    parallel::parallel_for(0, K, parallel::grain_for(8), [&](int begin, int end) {
+        for (int x_i = begin; x_i < end; x_i++) {
+            const Vector3d &x = X.row(x_i);
 
-        double dist = (P - x).norm();
-        if (dist > 1e-5) {
-            phi_px(x_i) = (dist * dist) * log(dist);
+            double dist = (P - x).norm();
+            if (dist > 1e-5) {
+                phi_px(x_i) = (dist * dist) * log(dist);
+            }
         }
-    }
+    });
 
     Vector3d PT = d.transpose() * P + w.transpose() * phi_px;
     return PT.hnormalized();
 }
+
+rpm::TpsSolveBasis::TpsSolveBasis(const ThinPlateSplineParams &params) {
+    RPM_TRACE_SPAN("solve_basis");
+    if (params.is_affine_only()) {
+        throw std::invalid_argument("TpsSolveBasis needs the spline basis, params are affine only!");
+    }
+    const MatrixXd &Q = params.get_Q();
+    const int K = Q.rows(), dim = D + 1;
+
+    const MatrixXd Q2 = Q.block(0, dim, K, K - dim);
+    SelfAdjointEigenSolver<MatrixXd> eig(Q2.transpose() * params.get_phi() * Q2);
+    if (eig.info() != Eigen::Success) {
+        throw std::runtime_error("TpsSolveBasis eigen decomposition failed!");
+    }
+    V = eig.eigenvectors();
+    eigenvalues = eig.eigenvalues();
+    U = Q2 * V;
+}
+
+bool rpm::TpsSolveBasis::solve(const VectorXd &weights, const double c, const MatrixXd &B, MatrixXd &gamma,
+                               const double tolerance, const int max_iterations) const {
+    Workspace workspace;
+    return solve(weights, c, B, gamma, workspace, tolerance, max_iterations);
+}
+
+bool rpm::TpsSolveBasis::solve(const VectorXd &weights, const double c, const MatrixXd &B, MatrixXd &gamma,
+                               Workspace &workspace, const double tolerance, const int max_iterations) const {
+    const int size = V.rows(), cols = B.cols();
+    MatrixXd &B_ = workspace.B, &H = workspace.H, &R = workspace.R, &Z = workspace.Z, &S = workspace.S;
+    MatrixXd &AS = workspace.AS, &UH = workspace.UH;
+    VectorXd &inverse = workspace.inverse, &rz = workspace.rz, &b_norm = workspace.b_norm;
+    B_.resize(size, cols);
+    H.resize(size, cols);
+    R.resize(size, cols);
+    Z.resize(size, cols);
+    S.resize(size, cols);
+    AS.resize(size, cols);
+    UH.resize(U.rows(), cols);
+    inverse.resize(size);
+    rz.resize(cols);
+    b_norm.resize(cols);
+
+    // In eigen coordinates h = V' * gamma the system is (diag(eigenvalues) + c * U' * W * U) * h = V' * B.
+    // All the products are matrix * vector, one column at a time, they need no temporaries.
+    auto apply = [&](const MatrixXd &H_, MatrixXd &out) {
+        for (int j = 0; j < cols; j++) {
+            UH.col(j).noalias() = U * H_.col(j);
+            UH.col(j).array() *= weights.array();
+            out.col(j).noalias() = U.transpose() * UH.col(j);
+            out.col(j) = eigenvalues.cwiseProduct(H_.col(j)) + c * out.col(j);
+        }
+    };
+    // Jacobi preconditioner, its diagonal is exact when W is a multiple of the identity.
+    for (int i = 0; i < size; i++) {
+        inverse(i) = 1.0 / (eigenvalues(i) + c * U.col(i).cwiseAbs2().dot(weights));
+    }
+
+    // Conjugate gradients on every column at once, each column with its own step sizes.
+    const bool guess = gamma.rows() == size && gamma.cols() == cols;
+    for (int j = 0; j < cols; j++) {
+        B_.col(j).noalias() = V.transpose() * B.col(j);
+        if (guess) {
+            H.col(j).noalias() = V.transpose() * gamma.col(j);
+        } else {
+            H.col(j) = inverse.cwiseProduct(B_.col(j));
+        }
+        b_norm(j) = std::max(B_.col(j).norm(), std::numeric_limits<double>::min());
+    }
+    apply(H, AS);
+    R = B_ - AS;
+    Z = inverse.asDiagonal() * R;
+    S = Z;
+    for (int j = 0; j < cols; j++) {
+        rz(j) = R.col(j).dot(Z.col(j));
+    }
+
+    bool converged = false;
+    for (int iter = 0; iter <= max_iterations; iter++) {
+        double residual = 0;
+        for (int j = 0; j < cols; j++) {
+            residual = std::max(residual, R.col(j).norm() / b_norm(j));
+        }
+        converged = residual <= tolerance;
+        if (converged || iter == max_iterations) {
+            break;
+        }
+
+        apply(S, AS);
+        for (int j = 0; j < cols; j++) {
+            const double step = rz(j) / S.col(j).dot(AS.col(j));
+            H.col(j) += step * S.col(j);
+            R.col(j) -= step * AS.col(j);
+        }
+
+        Z = inverse.asDiagonal() * R;
+        for (int j = 0; j < cols; j++) {
+            const double rz_next = R.col(j).dot(Z.col(j));
+            S.col(j) = Z.col(j) + (rz_next / rz(j)) * S.col(j);
+            rz(j) = rz_next;
+        }
+    }
+
+    gamma.resize(size, cols);
+    for (int j = 0; j < cols; j++) {
+        gamma.col(j).noalias() = V * H.col(j);
+    }
+    return converged;
+}
+
+namespace {
+    // Sets whether Eigen may allocate for the lifetime of the scope, see RpmSession.
+    class _EigenMalloc {
+    public:
+        explicit _EigenMalloc(const bool allowed) {
+#ifdef EIGEN_RUNTIME_NO_MALLOC
+            previous = Eigen::internal::is_malloc_allowed();
+            Eigen::internal::set_is_malloc_allowed(allowed);
+#else
+            (void) allowed;
+#endif
+        }
+
+        ~_EigenMalloc() {
+#ifdef EIGEN_RUNTIME_NO_MALLOC
+            Eigen::internal::set_is_malloc_allowed(previous);
+#endif
+        }
+
+    private:
+        bool previous = true;
+    };
+}
+
+bool rpm::RpmSession::estimate(
+        const MatrixXd &X_,
+        const MatrixXd &Y_,
+        MatrixXd &M,
+        ThinPlateSplineParams &params,
+        const RpmConfig &config_,
+        const RpmBudget &budget,
+        RpmOutcome &outcome,
+        const vector<pair<int, int> > &matched_point_indices) {
+    if (config_.use_cpd || config_.affine_only || config_.float_correspondence
+        || config_.matrix_free_correspondence) {
+        return estimate_anytime(X_, Y_, M, params, config_, budget, outcome, matched_point_indices);
+    }
+
+    RPM_TRACE_SPAN("estimate");
+    auto t1 = std::chrono::high_resolution_clock::now();
+    const auto deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(budget.time_limit));
+    outcome = RpmOutcome();
+    M.resize(0, 0);
+
+    RpmInstrumentation *instrumentation = config_.instrumentation;
+    if (instrumentation && !instrumentation->enabled()) {
+        instrumentation = nullptr;
+    }
+    RpmStats *stats = instrumentation ? instrumentation->stats : nullptr;
+    if (stats) {
+        *stats = RpmStats();
+    }
+    _CounterSession counters(instrumentation, config_.verbose);
+
+    try {
+        if (X_.cols() != D || Y_.cols() != D) {
+            throw std::invalid_argument("rpm::RpmSession::estimate() only support 2d points!");
+        }
+
+        MatrixXd X_normalized = X_;
+        {
+            StageTimer timer(stats ? &stats->preprocess_time : nullptr);
+            RPM_TRACE_SPAN("preprocess");
+            Y = Y_;
+            data_process::preprocess(X_normalized, Y);
+            data_process::homo(X_normalized);
+            data_process::homo(Y);
+        }
+        const int K = X_normalized.rows(), N = Y.rows();
+
+        const TpsSolveBasis *solve_basis = config_.solve_basis;
+        {
+            StageTimer timer(stats ? &stats->basis_time : nullptr);
+            RPM_TRACE_SPAN("spline_basis");
+            // The spline and its factorization only depend on the normalized X, kept while it is the same.
+            if (!spline || X.rows() != K || X != X_normalized) {
+                spline.reset();
+                basis.reset();
+                X = std::move(X_normalized);
+                spline.reset(new ThinPlateSplineParams(X));
+            }
+            params = *spline;
+            if (!solve_basis || solve_basis->size() != K) {
+                if (!basis) {
+                    basis.reset(new TpsSolveBasis(params));
+                }
+                solve_basis = basis.get();
+            }
+        }
+
+        RpmConfig config = config_;
+        const _Anchors reduced = _reduce_anchors(K, N, matched_point_indices);
+        // Out of budget in the affine prealignment already skips the annealing, params keep its result.
+        const bool prealign_stopped = _schedule(X, Y, params, config, budget, deadline, outcome, reduced, stats);
+
+        anchors = reduced.pairs;
+        K_free = anchors.empty() ? K : int(reduced.free_rows.size());
+        N_free = anchors.empty() ? N : int(reduced.free_cols.size());
+
+        reserve(K, N);
+        sinkhorn.reset();
+
+        const bool stopped = prealign_stopped || _anneal(
+                config, budget, deadline, instrumentation, params, Y, outcome,
+                [&](double T, double lambda, RpmIterationStats *iteration_stats) {
+                    // The first iteration sizes the buffers.
+                    _EigenMalloc malloc(outcome.iterations == 0);
+                    iterate(params, *solve_basis, T, lambda, config, iteration_stats);
+                    return true;
+                },
+                [&](double T, double lambda) {
+                    return _energy(X, Y, Map<const MatrixXd>(correspondence.data(), K + 1, N + 1).topLeftCorner(K, N),
+                                   params, T, lambda, config);
+                });
+        outcome.completed = !stopped;
+
+        if (outcome.iterations > 0) {
+            M = Map<MatrixXd>(correspondence.data(), K + 1, N + 1).topLeftCorner(K, N);
+            outcome.quality = _quality(Y, params);
+        }
+    }
+    catch (const std::exception &e) {
+        outcome.error = e.what();
+        std::cerr << e.what() << std::endl;
+        return false;
+    }
+
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    auto timespan = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1);
+    outcome.elapsed = timespan.count();
+    if (stats) {
+        stats->total_time = timespan.count();
+    }
+    if (config_.verbose) {
+        std::cout << "TPS-RPM session estimate time: " << timespan.count() << " seconds.\n";
+    }
+
+    return true;
+}
+
+void rpm::RpmSession::reserve(const int K, const int N) {
+    const Index size = Index(K + 1) * (N + 1);
+    if (correspondence.size() < size) {
+        correspondence.resize(size);
+    }
+}
+
+size_t rpm::RpmSession::bytes() const {
+    size_t count = X.size() + Y.size() + correspondence.size() + XT.size() + MY.size() + targets.size()
+                   + Tw.size() + B.size() + gamma.size() + row_sums.size() + weights.size() + ones.size()
+                   + sweep_sums.size() + sinkhorn.u.size() + sinkhorn.v.size();
+    const TpsSolveBasis::Workspace &w = solve_workspace;
+    count += w.B.size() + w.H.size() + w.R.size() + w.Z.size() + w.S.size() + w.AS.size() + w.UH.size()
+             + w.inverse.size() + w.rz.size() + w.b_norm.size();
+    if (spline) {
+        count += spline->get_phi().size() + spline->get_Q().size() + spline->get_R().size();
+    }
+    if (basis) {
+        count += basis->V.size() + basis->U.size() + basis->eigenvalues.size();
+    }
+    return sizeof(double) * count;
+}
+
+void rpm::RpmSession::iterate(
+        ThinPlateSplineParams &params,
+        const TpsSolveBasis &basis,
+        const double T,
+        const double lambda,
+        const RpmConfig &config,
+        RpmIterationStats *iteration_stats) {
+    perf_counters::StageScope correspondence_stage(perf_counters::Stage::correspondence);
+    const int K = X.rows(), N = Y.rows(), dim = D + 1;
+    Map<MatrixXd> A(correspondence.data(), K + 1, N + 1);
+    const MatrixXd &phi = params.get_phi();
+
+    {
+        StageTimer timer(iteration_stats ? &iteration_stats->apply_time : nullptr);
+        RPM_TRACE_SPAN("apply_transform");
+        perf_counters::StageScope counted(perf_counters::Stage::apply);
+        // X * d + phi * w by rows, phi is symmetric so its row k is its column k.
+        XT.resize(K, dim);
+        parallel::parallel_for(0, K, parallel::grain_for(K * dim), [&](int begin, int end) {
+            for (int k = begin; k < end; k++) {
+                XT.row(k).noalias() = X.row(k) * params.d;
+                XT.row(k).transpose().noalias() += params.w.transpose() * phi.col(k);
+            }
+        });
+    }
+
+    {
+        StageTimer timer(iteration_stats ? &iteration_stats->affinity_time : nullptr);
+        RPM_TRACE_SPAN("affinity");
+        _fill_affinity(XT, Y, 1.0 / T, config.alpha, A);
+        A.row(K).setConstant(1.0 / (N_free + 1));
+        A.col(N).setConstant(1.0 / (K_free + 1));
+
+        // Anchored rows and columns hold only their 1, the softassign leaves them as they are
+        // and runs on the free points as in estimate_correspondence().
+        for (auto point_pair : anchors) {
+            A.row(point_pair.first).setZero();
+            A.col(point_pair.second).setZero();
+        }
+        for (auto point_pair : anchors) {
+            A(point_pair.first, point_pair.second) = 1;
+        }
+    }
+
+    {
+        StageTimer timer(iteration_stats ? &iteration_stats->sinkhorn_time : nullptr);
+        RPM_TRACE_SPAN("sinkhorn");
+        perf_counters::StageScope counted(perf_counters::Stage::softassign);
+        if (!config.sinkhorn_warm_start) {
+            sinkhorn.T = 0;
+        }
+        _init_scalings(sinkhorn, K + 1, N + 1, T);
+        const int sinkhorn_iterations = _sinkhorn(A, sinkhorn.u, sinkhorn.v, config, sweep_sums);
+        _apply_scalings(A, sinkhorn.u, sinkhorn.v);
+        if (iteration_stats) {
+            iteration_stats->sinkhorn_iterations += sinkhorn_iterations;
+        }
+    }
+
+    correspondence_stage.end();
+    StageTimer timer(iteration_stats ? &iteration_stats->solve_time : nullptr);
+    RPM_TRACE_SPAN("transform_solve");
+    perf_counters::StageScope counted(perf_counters::Stage::transform);
+    const auto M = A.topLeftCorner(K, N);
+    MY.resize(K, dim);
+    ones.setOnes(N);
+    for (int j = 0; j < dim; j++) {
+        MY.col(j).noalias() = M * Y.col(j);
+    }
+    row_sums.noalias() = M * ones;
+
+#ifdef RPM_USE_BOTHSIDE_OUTLIER_REJECTION
+    const double c = N * lambda;
+    targets.resize(K, dim);
+    weights.resize(K);
+    for (int k = 0; k < K; k++) {
+        weights(k) = 1.0 / std::max(row_sums(k), config.epsilon1);
+        targets.row(k) = MY.row(k) * weights(k);
+    }
+    for (auto point_pair : anchors) {
+        weights(point_pair.first) = 0;
+    }
+
+    const MatrixXd &Q = params.get_Q();
+    const auto Q1 = Q.leftCols(dim), Q2 = Q.rightCols(K - dim);
+    B.resize(K - dim, dim);
+    gamma.resize(K - dim, dim);
+    for (int j = 0; j < dim; j++) {
+        B.col(j).noalias() = Q2.transpose() * targets.col(j);
+        gamma.col(j).noalias() = Q2.transpose() * params.w.col(j);
+    }
+    if (!basis.solve(weights, c, B, gamma, solve_workspace)) {
+        // Not converged, the dense solve of estimate_transform() allocates but is exact.
+        _EigenMalloc malloc(true);
+        RpmConfig dense = config;
+        dense.solve_basis = nullptr;
+        if (!_solve_transform(X, row_sums, MY, N, lambda, params, dense, nullptr, anchors)) {
+            throw std::runtime_error("estimate transform failed!");
+        }
+        return;
+    }
+
+    // w = Q2 * gamma, then the targets left to the affine part, Y' - (phi + c * W) * w.
+    Tw.resize(K, dim);
+    for (int j = 0; j < dim; j++) {
+        params.w.col(j).noalias() = Q2 * gamma.col(j);
+        Tw.col(j).noalias() = phi * params.w.col(j);
+        Tw.col(j) = targets.col(j) - Tw.col(j) - c * weights.cwiseProduct(params.w.col(j));
+    }
+    Matrix3d QtY;
+    for (int i = 0; i < dim; i++) {
+        for (int j = 0; j < dim; j++) {
+            QtY(i, j) = Q1.col(i).dot(Tw.col(j));
+        }
+    }
+
+    const Matrix3d R = params.get_R().topRows(dim);
+#ifdef RPM_REGULARIZE_AFFINE_PARAM
+    // (R' * R + lambda_d^2 * I) * d = R' * Q1' * (Y' - T * w) + lambda_d^2 * I, the normal equations
+    // of estimate_transform() with the rows of lambda_d * I below R.
+    const double lambda_d = N * lambda * 0.01;
+    LDLT<Matrix3d> solver(R.transpose() * R + Matrix3d::Identity() * lambda_d * lambda_d);
+    params.d = solver.solve(R.transpose() * QtY + Matrix3d::Identity() * lambda_d * lambda_d);
+#else
+    LDLT<Matrix3d> solver(R.transpose() * R);
+    params.d = solver.solve(R.transpose() * QtY);
+#endif // RPM_REGULARIZE_AFFINE_PARAM
+    if (solver.info() != Eigen::Success) {
+        throw std::runtime_error("Param d ldlt solve failed!");
+    }
+#else
+    _EigenMalloc malloc(true);
+    if (!_solve_transform(X, row_sums, MY, N, lambda, params, config, nullptr, anchors)) {
+        throw std::runtime_error("estimate transform failed!");
+    }
+#endif // RPM_USE_BOTHSIDE_OUTLIER_REJECTION
+}
@@ -1,9 +1,15 @@
 #pragma once
 
 #include <Eigen/Dense>
+#include <atomic>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <string>
 #include <vector>
 
+#include "perf_counters.h"
+
 using namespace Eigen;
 using namespace std;
 
@@ -12,25 +18,193 @@ using namespace std;
 
 namespace rpm {
     const int D = 2;
-    // Annealing params
-    extern double T_start, T_end;
-    extern double r, I0, epsilon0;
-    extern double alpha; // 5 * 5
-    // Softassign params
-    extern double I1, epsilon1;
-    // Thin-plate spline params
-    extern double lambda_start;
-    extern double r_lambda;
+
+    class ThinPlateSplineParams;
+
+    class TpsSolveBasis;
+
+    struct SinkhornState;
+
+    // Timings (seconds) and counters of one annealing iteration.
+    struct RpmIterationStats {
+        int temperature_index = 0, iter = 0;
+        double T = 0, lambda = 0;
+        // applyTransform() of the source, affinity build, softassign, transform solve
+        double apply_time = 0, affinity_time = 0, sinkhorn_time = 0, solve_time = 0;
+        int sinkhorn_iterations = 0;
+        // TPS-RPM energy of the iteration's M and params
+        double energy = 0;
+        // Heap allocations of the whole process during the iteration, -1 when not counted
+        long long allocations = -1;
+    };
+
+    // Collected by estimate() when RpmInstrumentation::stats is set.
+    struct RpmStats {
+        double preprocess_time = 0, basis_time = 0, total_time = 0;
+        // Time and iterations of the affine registration of RpmConfig::use_affine_prealign.
+        double prealign_time = 0;
+        int prealign_iterations = 0;
+        double max_dist = 0, average_dist = 0;
+        double T_start = 0, T_end = 0;
+        vector<RpmIterationStats> iterations;
+        // Softassign sweeps of all the iterations at each temperature, in schedule order.
+        vector<int> temperature_sinkhorn_iterations;
+        // With RpmInstrumentation::hardware_counters, the events of each perf_counters::Stage,
+        // indexed by it. Empty when not counted.
+        vector<perf_counters::Counts> stage_counters;
+    };
+
+    // Observer of estimate(). With no stats and no callback nothing is timed or counted.
+    struct RpmInstrumentation {
+        RpmStats *stats = nullptr;
+        // Called after every annealing iteration on the estimating thread.
+        std::function<void(const RpmIterationStats &)> on_iteration;
+        // Same, with the current params and the normalized homogeneous target, see TrajectoryRecorder.
+        // Only valid during the call, copy what is kept.
+        std::function<void(const RpmIterationStats &, const ThinPlateSplineParams &, const MatrixXd &Y)> on_state;
+        // Count cycles, instructions, cache and branch misses per stage into stats, see perf_counters.h.
+        // The counting is process wide, concurrent estimates must not both enable it.
+        bool hardware_counters = false;
+
+        bool enabled() const { return stats != nullptr || bool(on_iteration) || bool(on_state); }
+    };
+
+    // Per-call registration settings. A config is a plain value, so concurrent
+    // estimates each own their schedule instead of sharing globals.
+    struct RpmConfig {
+        // Annealing params
+        double T_start = 1, T_end = 1e-4;
+        double r = 0.90, I0 = 5, epsilon0 = 1e-2;
+        double alpha = 0.1; // 5 * 5
+        // Softassign params
+        double I1 = 10, epsilon1 = 1e-4;
+        // Start each softassign from the row and column scalings of the previous one, see SinkhornState.
+        bool sinkhorn_warm_start = false;
+        // Not owned. With sinkhorn_warm_start, the scalings to start from and leave the last ones in,
+        // carried across calls (see RpmTracker). Null starts every call from ones.
+        SinkhornState *sinkhorn_state = nullptr;
+        // Stop the sweeps early once every row sum is within this of 1, 0 always does I1 sweeps.
+        double sinkhorn_tolerance = 0;
+        // Build and normalize M in float, half the memory and bandwidth of the K * N matrix.
+        // M * Y and the row sums are still accumulated in double and the TPS solve stays double.
+        bool float_correspondence = false;
+        // Never form M while iterating: keep the softassign scalings and recompute the affinity in
+        // cache sized tiles for every sweep and for M * Y and the row sums, see CorrespondenceSums.
+        // Memory is O(K + N) for an exp of every entry in every sweep. Takes precedence over
+        // float_correspondence.
+        bool matrix_free_correspondence = false;
+        // Thin-plate spline params
+        double lambda_start = 1;
+        // Not owned. Factorization of the source points for faster transform solves, must be built
+        // from the same X as the params, see TpsSolveBasis. Null solves densely.
+        const TpsSolveBasis *solve_basis = nullptr;
+
+        // Derive T_start, T_end and lambda_start from the average squared distance of the inputs.
+        bool auto_T_start = true;
+        double T_end_ratio = 1e-3;
+
+        // Moment-matching pre-alignment
+        bool use_moment_prealign = false;
+        double prealign_T_scale = 0.1;
+
+        // Coherent point drift EM instead of the annealed softassign, see cpd.h. The E-step sums
+        // are fast Gauss transforms, so no K * N matrix is formed while iterating. The TPS params
+        // stay the deformation model. 2 * sigma2 takes the place of T in the annealing schedule
+        // (one EM iteration per temperature) and lambda follows it.
+        bool use_cpd = false;
+        double cpd_w = 0.1;             // weight of the uniform outlier component
+        int cpd_max_iterations = 150;
+        double cpd_tolerance = 1e-5;    // relative change of the negative log-likelihood
+        double cpd_epsilon = 1e-3;      // accuracy of the Gauss transforms
+
+        // Affine registration only, see affine.h. The params are built affine only (no K * K phi)
+        // and every row of M keeps its affine_neighbors nearest targets, so an iteration costs
+        // O((K + N) * affine_neighbors) and only the 3 * 3 system of d is solved. The truncated M
+        // only acts locally, the schedule starts from the moment pre-alignment.
+        bool affine_only = false;
+        int affine_neighbors = 16;
+        // Register affine only first and continue the TPS schedule from the result, see prealign_T_scale.
+        bool use_affine_prealign = false;
+
+        // With use_cpd, affine_only or matrix_free_correspondence, form the final K * N correspondence as M,
+        // false leaves M empty for sets too large for it.
+        bool output_correspondence = true;
+
+        // Print the schedule and total time to std::cout, never from inside the annealing loop.
+        bool verbose = false;
+        // Not owned, null disables instrumentation.
+        RpmInstrumentation *instrumentation = nullptr;
+    };
+
+    // Wall-clock budget and cancellation of estimate_anytime(), checked between annealing iterations.
+    struct RpmBudget {
+        // Seconds from the start of the call, <= 0 means no deadline.
+        double time_limit = 0;
+        // Set to true from any thread to stop the estimate, may be null.
+        const std::atomic<bool> *cancel = nullptr;
+    };
+
+    // How far estimate_anytime() got before the schedule ended or it was stopped.
+    struct RpmOutcome {
+        bool completed = false;
+        bool cancelled = false;
+        bool deadline_reached = false;
+        // Temperature and lambda of the last finished iteration.
+        double T_reached = 0;
+        double lambda_reached = 0;
+        int iterations = 0;
+        // Symmetric mean squared nearest-neighbour distance between the transformed X and Y,
+        // in normalized coordinates. Lower is better.
+        double quality = 0;
+        double elapsed = 0;
+        // Why the call returned false, empty otherwise. Also written to std::cerr.
+        std::string error;
+    };
+
+    // Scalings of the last softassign, M = diag(u) * A * diag(v) with A the (K + 1) * (N + 1) affinity.
+    // As log-potentials T * log(u) and T * log(v) they change slowly with T, so the next
+    // softassign starts from u ^ (T_prev / T) and v ^ (T_prev / T) instead of from ones.
+    struct SinkhornState {
+        VectorXd u, v;
+        double T = 0;
+
+        void reset() {
+            u.resize(0);
+            v.resize(0);
+            T = 0;
+        }
+    };
+
+    // Correspondence of RpmConfig::matrix_free_correspondence. M = diag(u) * A * diag(v) is kept as the
+    // scalings and the transformed X the affinity A is recomputed from, with the sums of M the
+    // transform solve and the energy read. Everything is O(K + N).
+    struct CorrespondenceSums {
+        VectorXd row_sums;      // M * 1, K
+        VectorXd col_sums;      // M' * 1, N
+        MatrixXd MY;            // M * Y, K * (D + 1)
+        double entropy = 0;     // sum m_kn log m_kn
+
+        // Scalings of the softassign of the points left by the anchors, and the X they were taken at.
+        SinkhornState scalings;
+        MatrixXd XT;
+    };
 
     extern double scale;  // for visualize
 
-    void set_T_start(double T, double scale);
+    void set_T_start(RpmConfig &config, double T, double scale);
 
     class ThinPlateSplineParams {
     public:
         ThinPlateSplineParams(const MatrixXd &X);
 
-        ThinPlateSplineParams(const ThinPlateSplineParams &other);
+        // With affine_only, phi, Q and R are not built (O(K) instead of O(K^2)) and w stays 0, only d
+        // can be estimated, see estimate_affine_transform(). d can seed the params of a full TPS of X.
+        ThinPlateSplineParams(const MatrixXd &X, const bool affine_only);
+
+        // Copies share X, phi, Q and R, which never change once built, only d and w are copied.
+        ThinPlateSplineParams(const ThinPlateSplineParams &other) = default;
+
+        ThinPlateSplineParams &operator=(const ThinPlateSplineParams &other) = default;
 
         // (D + 1) * (D + 1) matrix representing the affine transformation.
         MatrixXd d;
@@ -43,20 +217,134 @@ namespace rpm {
 
         Vector2d applyTransform(const Vector2d &p, bool hnormalize = false) const;
 
-        MatrixXd get_phi() { return phi; };
+        const MatrixXd &get_phi() const { return source->phi; };
+
+        const MatrixXd &get_Q() const { return source->Q; };
 
-        MatrixXd get_Q() { return Q; };
+        const MatrixXd &get_R() const { return source->R; };
 
-        MatrixXd get_R() { return R; };
+        bool is_affine_only() const { return affine_only; };
 
     private:
-        MatrixXd X;
+        struct Source {
+            MatrixXd X;
 
-        // K * K matrix
-        MatrixXd phi;
+            // K * K matrix
+            MatrixXd phi;
 
-        // Q, R
-        MatrixXd Q, R;
+            // Q, R
+            MatrixXd Q, R;
+        };
+
+        std::shared_ptr<const Source> source;
+
+        bool affine_only = false;
+    };
+
+    // Source-side factorization for many transform solves against one set of source points.
+    //
+    // estimate_transform() solves (Q2' * (phi + N * lambda * W) * Q2) * gamma = Q2' * Y with a new
+    // diagonal W = diag(1 / row sums of M) every iteration, an O(K^3) solve. With the eigen
+    // decomposition Q2' * phi * Q2 = V * diag(eigenvalues) * V' computed once, the system becomes
+    // diag(eigenvalues) + N * lambda * U' * W * U with U = Q2 * V, solved by Jacobi preconditioned
+    // conjugate gradients in O(K^2) per step, few steps while W stays close to a multiple of I.
+    class TpsSolveBasis {
+    public:
+        explicit TpsSolveBasis(const ThinPlateSplineParams &params);
+
+        int size() const { return U.rows(); }
+
+        // Solve the w system above for the columns of B = Q2' * Y, c = N * lambda, weights = diag(W).
+        // gamma is the initial guess when it already has the size of the solution.
+        // Returns false when the iterations do not reach tolerance, gamma is then only approximate.
+        bool solve(const VectorXd &weights, const double c, const MatrixXd &B, MatrixXd &gamma,
+                   const double tolerance = 1e-10, const int max_iterations = 100) const;
+
+        // Buffers of solve(), sized on the first call. Later calls of the same size do not allocate.
+        struct Workspace {
+            MatrixXd B, H, R, Z, S, AS, UH;
+            VectorXd inverse, rz, b_norm;
+        };
+
+        // Same as above with the buffers taken from workspace.
+        bool solve(const VectorXd &weights, const double c, const MatrixXd &B, MatrixXd &gamma,
+                   Workspace &workspace, const double tolerance = 1e-10, const int max_iterations = 100) const;
+
+        MatrixXd V, U;
+        VectorXd eigenvalues;
+    };
+
+    // Buffers of the softassign estimate, kept across annealing iterations and across calls.
+    //
+    // Every iteration of estimate_anytime() allocates the correspondence, its products with Y and
+    // the K * K matrices of the dense transform solve. A session sizes its buffers on the first
+    // iteration of a call, the (K + 1) * (N + 1) correspondence keeps its capacity across calls so a
+    // problem of the same or a smaller size reuses it. The transform is solved on a TpsSolveBasis
+    // (config.solve_basis, or one the session keeps while the normalized X stays the same) with the
+    // weights as a vector, and the products with the large matrices go column by column, so the later
+    // iterations make no heap allocation.
+    //
+    // Built with EIGEN_RUNTIME_NO_MALLOC and assertions, Eigen asserts on any of its allocations after
+    // the first iteration of a call (process wide, for checking builds only). The allocations of the
+    // rest are counted in RpmIterationStats::allocations with RPM_COUNT_ALLOCATIONS. The rpm_alloc_check
+    // target is built that way.
+    //
+    // Only the double softassign runs on the buffers, configs with use_cpd, affine_only,
+    // float_correspondence or matrix_free_correspondence go to estimate_anytime(). A session serves
+    // one thread at a time.
+    class RpmSession {
+    public:
+        RpmSession() = default;
+
+        RpmSession(const RpmSession &) = delete;
+
+        RpmSession &operator=(const RpmSession &) = delete;
+
+        // Same as estimate_anytime().
+        bool estimate(
+                const MatrixXd &X,
+                const MatrixXd &Y,
+                MatrixXd &M,
+                ThinPlateSplineParams &params,
+                const RpmConfig &config,
+                const RpmBudget &budget,
+                RpmOutcome &outcome,
+                const vector<pair<int, int> > &matched_point_indices = vector<pair<int, int> >()
+        );
+
+        // Grow the correspondence buffer for K source and N target points ahead of the first call.
+        void reserve(const int K, const int N);
+
+        // Bytes held by the buffers, the spline and the basis built by the session.
+        size_t bytes() const;
+
+    private:
+        // One annealing iteration on the buffers, params.d and params.w are updated in place.
+        void iterate(
+                ThinPlateSplineParams &params,
+                const TpsSolveBasis &basis,
+                const double T,
+                const double lambda,
+                const RpmConfig &config,
+                RpmIterationStats *iteration_stats
+        );
+
+        // Normalized homogeneous inputs.
+        MatrixXd X, Y;
+        // Storage of the (K + 1) * (N + 1) correspondence, never shrinks.
+        VectorXd correspondence;
+        // Transformed X, M * Y, the weighted targets, T * w, Q2' * targets and the solution in Q2 coordinates.
+        MatrixXd XT, MY, targets, Tw, B, gamma;
+        VectorXd row_sums, weights, ones, sweep_sums;
+        SinkhornState sinkhorn;
+        TpsSolveBasis::Workspace solve_workspace;
+        // Spline of X at d = I and w = 0, and the basis built when config.solve_basis does not match X.
+        // Both are kept for the next call with the same normalized X.
+        std::unique_ptr<ThinPlateSplineParams> spline;
+        std::unique_ptr<TpsSolveBasis> basis;
+        // Known matches of the call, the free point counts set the outlier entries.
+        vector<pair<int, int> > anchors;
+        int K_free = 0, N_free = 0;
     };
 
     // Compute the thin-plate spline params and 2d point correspondence from two point sets.
@@ -76,6 +364,81 @@ namespace rpm {
             const vector<pair<int, int> > &matched_point_indices = vector<pair<int, int> >()
     );
 
+    // Same as above, with the annealing schedule and solver settings taken from config.
+    bool estimate(
+            const MatrixXd &X,
+            const MatrixXd &Y,
+            MatrixXd &M,
+            ThinPlateSplineParams &params,
+            const RpmConfig &config,
+            const vector<pair<int, int> > &matched_point_indices = vector<pair<int, int> >()
+    );
+
+    // Compute the squared distance statistics between two point sets in O(K + N).
+    //
+    // Input:
+    //   X, Y		source and target points set (any matching column count).
+    // Output:
+    //	 max_dist		upper bound of the max squared distance, from the bounding boxes
+    //	 average_dist	exact average squared distance, from the means and variances
+    //
+    void distance_stats(
+            const MatrixXd &X,
+            const MatrixXd &Y,
+            double &max_dist,
+            double &average_dist
+    );
+
+    // Initialize the affine part params.d by matching the centroid and covariance of X to those of Y.
+    //
+    // Input:
+    //   X, Y		source and target points set, 3d homogeneous.
+    // Output:
+    //	 params		params.d set to the moment-matching affine transform, params.w untouched
+    // Returns true on success, false on failure
+    //
+    bool moment_prealign(
+            const MatrixXd &X,
+            const MatrixXd &Y,
+            ThinPlateSplineParams &params
+    );
+
+    // Anytime variant of estimate(), stopping between annealing iterations when the budget runs out.
+    //
+    // Input:
+    //   X, Y		source and target points set.
+    //	 budget		deadline and cancellation token
+    // Output:
+    //	 M			correspondence of the last finished iteration, empty if none finished
+    //	 params		thin-plate spline params of the last finished iteration
+    //	 outcome	temperature reached, iteration count and quality of the returned model
+    // Returns true when a model is returned (possibly from a stopped schedule), false on failure
+    //
+    bool estimate_anytime(
+            const MatrixXd &X,
+            const MatrixXd &Y,
+            MatrixXd &M,
+            ThinPlateSplineParams &params,
+            const RpmConfig &config,
+            const RpmBudget &budget,
+            RpmOutcome &outcome,
+            const vector<pair<int, int> > &matched_point_indices = vector<pair<int, int> >()
+    );
+
+    // Same as estimate_anytime() on inputs already normalized to a common frame and made homogeneous,
+    // with params built from that X by the caller. The schedule starts from params.d and params.w, the
+    // spline basis (phi, Q, R) and config.solve_basis are reused as is, see TemplateLibrary.
+    bool estimate_prepared(
+            const MatrixXd &X,
+            const MatrixXd &Y,
+            MatrixXd &M,
+            ThinPlateSplineParams &params,
+            const RpmConfig &config,
+            const RpmBudget &budget,
+            RpmOutcome &outcome,
+            const vector<pair<int, int> > &matched_point_indices = vector<pair<int, int> >()
+    );
+
     bool init_params(
             const MatrixXd &X,
             const MatrixXd &Y,
@@ -88,10 +451,14 @@ namespace rpm {
     //
     // Input:
     //   X, Y		source and target points set.
+    //	 matched_point_indices	known matches (k, n), they get m_kn = 1 and the softassign only
+    //				runs on the remaining rows and columns
     //	 params		thin-plate spline params
     //	 T			temperature
+    //	 warm		if not null, scalings of the previous softassign to start from, updated on return
     // Output:
     //	 M			correspondence between X and Y
+    //	 iteration_stats	if not null, stage timings and softassign iterations are added to it
     // Returns true on success, false on failure
     //
     bool estimate_correspondence(
@@ -101,7 +468,80 @@ namespace rpm {
             const ThinPlateSplineParams &params,
             const double T,
             const double T0,
-            MatrixXd &M
+            MatrixXd &M,
+            const RpmConfig &config = RpmConfig(),
+            RpmIterationStats *iteration_stats = nullptr,
+            SinkhornState *warm = nullptr
+    );
+
+    // Same as above with M in float, see RpmConfig::float_correspondence. Each row of the
+    // affinity is scaled to a max of 1 before it is rounded, the scales go into the softassign
+    // scalings, so large 1 / T do not overflow.
+    bool estimate_correspondence(
+            const MatrixXd &X,
+            const MatrixXd &Y,
+            const vector<pair<int, int> > &matched_point_indices,
+            const ThinPlateSplineParams &params,
+            const double T,
+            const double T0,
+            MatrixXf &M,
+            const RpmConfig &config = RpmConfig(),
+            RpmIterationStats *iteration_stats = nullptr,
+            SinkhornState *warm = nullptr
+    );
+
+    // Same as above without forming M, see RpmConfig::matrix_free_correspondence. The affinity is
+    // recomputed in tiles for each softassign sweep and once more for the sums, the scalings and
+    // XT are left in sums for form_correspondence().
+    bool estimate_correspondence(
+            const MatrixXd &X,
+            const MatrixXd &Y,
+            const vector<pair<int, int> > &matched_point_indices,
+            const ThinPlateSplineParams &params,
+            const double T,
+            const double T0,
+            CorrespondenceSums &sums,
+            const RpmConfig &config = RpmConfig(),
+            RpmIterationStats *iteration_stats = nullptr,
+            SinkhornState *warm = nullptr
+    );
+
+    // The K * N correspondence the sums were taken from, O(K * N).
+    //
+    // Input:
+    //   sums		result of the matrix free estimate_correspondence()
+    //	 Y			target points set, the one given to estimate_correspondence()
+    //	 matched_point_indices	the known matches given to estimate_correspondence()
+    // Output:
+    //	 M			correspondence between X and Y
+    //
+    void form_correspondence(
+            const CorrespondenceSums &sums,
+            const MatrixXd &Y,
+            const vector<pair<int, int> > &matched_point_indices,
+            MatrixXd &M,
+            const RpmConfig &config = RpmConfig());
+
+    // Softassign: alternately normalize the rows and columns of M, except the outlier row and column.
+    //
+    // Input:
+    //   M			(K + 1) * (N + 1) affinity matrix, outlier row and column last
+    // Output:
+    //	 M			normalized in place
+    // Returns the number of normalization sweeps done
+    //
+    int soft_assign(
+            MatrixXd &M,
+            const RpmConfig &config = RpmConfig()
+    );
+
+    // Same as above, starting from the scalings in state (ones when their size does not match M)
+    // and leaving the final scalings there. M must be the unnormalized affinity at temperature T.
+    int soft_assign(
+            MatrixXd &M,
+            const double T,
+            SinkhornState &state,
+            const RpmConfig &config = RpmConfig()
     );
 
     // Compute the thin-plate spline parameters from two point sets.
@@ -109,8 +549,10 @@ namespace rpm {
     // Input:
     //   X, Y		source and target points set.
     //	 M			correspondence between X and Y
+    //	 matched_point_indices	known matches, X[k] is interpolated onto Y[n] instead of smoothed
     // Output:
     //	 params		thin-plate spline params
+    //	 iteration_stats	if not null, the solve time is added to it
     // Returns true on success, false on failure
     //
     bool estimate_transform(
@@ -118,12 +560,76 @@ namespace rpm {
             const MatrixXd &Y,
             const MatrixXd &M,
             const double lambda,
-            ThinPlateSplineParams &params
+            ThinPlateSplineParams &params,
+            const RpmConfig &config = RpmConfig(),
+            RpmIterationStats *iteration_stats = nullptr,
+            const vector<pair<int, int> > &matched_point_indices = vector<pair<int, int> >()
     );
 
+    bool estimate_transform(
+            const MatrixXd &X,
+            const MatrixXd &Y,
+            const MatrixXf &M,
+            const double lambda,
+            ThinPlateSplineParams &params,
+            const RpmConfig &config = RpmConfig(),
+            RpmIterationStats *iteration_stats = nullptr,
+            const vector<pair<int, int> > &matched_point_indices = vector<pair<int, int> >()
+    );
+
+    // Same as above from the row sums of M and the product M * Y, for a correspondence that is
+    // never formed (see CpdPosterior). N is the number of target points.
+    bool estimate_transform(
+            const MatrixXd &X,
+            const VectorXd &row_sums,
+            const MatrixXd &MY,
+            const int N,
+            const double lambda,
+            ThinPlateSplineParams &params,
+            const RpmConfig &config = RpmConfig(),
+            RpmIterationStats *iteration_stats = nullptr,
+            const vector<pair<int, int> > &matched_point_indices = vector<pair<int, int> >()
+    );
+
+    // TPS-RPM energy: sum m_kn ||y_n - f(x_k)||^2 + lambda * tr(w' phi w) + T * sum m_kn log m_kn - alpha * sum m_kn
+    double energy(
+            const MatrixXd &X,
+            const MatrixXd &Y,
+            const MatrixXd &M,
+            const ThinPlateSplineParams &params,
+            const double T,
+            const double lambda,
+            const RpmConfig &config = RpmConfig());
+
+    double energy(
+            const MatrixXd &X,
+            const MatrixXd &Y,
+            const MatrixXf &M,
+            const ThinPlateSplineParams &params,
+            const double T,
+            const double lambda,
+            const RpmConfig &config = RpmConfig());
+
+    // Same as above from the sums of a correspondence that is never formed.
+    double energy(
+            const MatrixXd &X,
+            const MatrixXd &Y,
+            const CorrespondenceSums &sums,
+            const ThinPlateSplineParams &params,
+            const double T,
+            const double lambda,
+            const RpmConfig &config = RpmConfig());
+
+    MatrixXd apply_correspondence(
+            const MatrixXd &Y,
+            const MatrixXd &M,
+            const RpmConfig &config = RpmConfig());
+
+    // M * Y accumulated in double, no double copy of M is made.
     MatrixXd apply_correspondence(
             const MatrixXd &Y,
-            const MatrixXd &M);
+            const MatrixXf &M,
+            const RpmConfig &config = RpmConfig());
 }
 
 
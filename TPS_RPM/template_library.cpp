@@ -0,0 +1,217 @@
+// This file is for registering a stream of targets against a fixed set of templates.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "template_library.h"
+
+#include "data_process.h"
+
+struct rpm::TemplateLibrary::Basis {
+    explicit Basis(const MatrixXd &X) : params(X), solve(params) {
+        bytes = sizeof(double) * (params.get_phi().size() + params.get_Q().size() + params.get_R().size()
+                                  + solve.V.size() + solve.U.size() + solve.eigenvalues.size());
+    }
+
+    // d = I and w = 0, the start of every estimate.
+    ThinPlateSplineParams params;
+    TpsSolveBasis solve;
+    size_t bytes = 0;
+};
+
+rpm::TemplateLibrary::TemplateLibrary(const size_t memory_limit) : limit(memory_limit) {
+}
+
+int rpm::TemplateLibrary::add(const MatrixXd &X_) {
+    if (X_.cols() != rpm::D || X_.rows() <= rpm::D) {
+        throw std::invalid_argument("rpm::TemplateLibrary::add() needs at least 3 2d points!");
+    }
+
+    // Normalize by the box of the template alone, every target shares it.
+    Template entry;
+    entry.X = X_;
+    MatrixXd X_copy = X_;
+    entry.norm = data_process::preprocess(entry.X, X_copy);
+    entry.norm_inv = entry.norm.inverse();
+    data_process::homo(entry.X);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    const int id = next_id++;
+    templates[id] = entry;
+    return id;
+}
+
+bool rpm::TemplateLibrary::remove(const int id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = templates.find(id);
+    if (it == templates.end()) {
+        return false;
+    }
+    if (it->second.basis) {
+        bytes -= it->second.basis->bytes;
+        lru.erase(it->second.lru);
+    }
+    templates.erase(it);
+    return true;
+}
+
+bool rpm::TemplateLibrary::prepare(const int id) {
+    try {
+        bool hit = false;
+        acquire(id, hit);
+    }
+    catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool rpm::TemplateLibrary::estimate(
+        const int id,
+        const MatrixXd &Y_,
+        TemplateMatch &match,
+        const RpmConfig &config,
+        const RpmBudget &budget,
+        const vector<pair<int, int> > &matched_point_indices) {
+    match = TemplateMatch();
+
+    try {
+        if (Y_.cols() != rpm::D) {
+            throw std::invalid_argument("rpm::TemplateLibrary::estimate() only support 2d points!");
+        }
+
+        MatrixXd X;
+        Matrix3d norm, norm_inv;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = templates.find(id);
+            if (it == templates.end()) {
+                throw std::invalid_argument("rpm::TemplateLibrary::estimate() unknown template id!");
+            }
+            X = it->second.X;
+            norm = it->second.norm;
+            norm_inv = it->second.norm_inv;
+        }
+
+        // Affine only registrations never touch the spline basis.
+        std::shared_ptr<const Basis> basis;
+        if (!config.affine_only) {
+            basis = acquire(id, match.cache_hit);
+        }
+
+        MatrixXd Y = Y_;
+        data_process::apply_transform(Y, norm);
+        data_process::homo(Y);
+
+        RpmConfig rpm_config = config;
+        rpm_config.solve_basis = basis ? &basis->solve : nullptr;
+        // A copy of the cached params shares their phi, Q and R, only d and w belong to the match.
+        ThinPlateSplineParams params = basis ? ThinPlateSplineParams(basis->params) : ThinPlateSplineParams(X, true);
+
+        if (!estimate_prepared(X, Y, match.M, params, rpm_config, budget, match.outcome, matched_point_indices)) {
+            return false;
+        }
+
+        match.d = params.d;
+        match.w = params.w;
+        match.XT = params.applyTransform(true);
+        data_process::apply_transform(match.XT, norm_inv);
+    }
+    catch (const std::exception &e) {
+        match.outcome.error = e.what();
+        std::cerr << e.what() << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+Matrix3d rpm::TemplateLibrary::normalization(const int id) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = templates.find(id);
+    if (it == templates.end()) {
+        throw std::invalid_argument("rpm::TemplateLibrary::normalization() unknown template id!");
+    }
+    return it->second.norm;
+}
+
+void rpm::TemplateLibrary::set_memory_limit(const size_t memory_limit) {
+    std::lock_guard<std::mutex> lock(mutex);
+    limit = memory_limit;
+    evict();
+}
+
+size_t rpm::TemplateLibrary::memory_limit() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return limit;
+}
+
+rpm::TemplateLibraryStats rpm::TemplateLibrary::stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    TemplateLibraryStats result;
+    result.hits = hits;
+    result.misses = misses;
+    result.evictions = evictions;
+    result.cached = int(lru.size());
+    result.bytes = bytes;
+    return result;
+}
+
+size_t rpm::TemplateLibrary::basis_bytes(const int K) {
+    const size_t k = size_t(K), dim = rpm::D + 1;
+    // phi, Q, R, then V, U and the eigenvalues of the K - dim projected kernel
+    return sizeof(double) * (k * k + k * k + k * dim + (k - dim) * (k - dim) + k * (k - dim) + (k - dim));
+}
+
+std::shared_ptr<const rpm::TemplateLibrary::Basis> rpm::TemplateLibrary::acquire(const int id, bool &hit) {
+    MatrixXd X;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = templates.find(id);
+        if (it == templates.end()) {
+            throw std::invalid_argument("rpm::TemplateLibrary unknown template id!");
+        }
+        if (it->second.basis) {
+            hits++;
+            lru.splice(lru.begin(), lru, it->second.lru);
+            hit = true;
+            return it->second.basis;
+        }
+        misses++;
+        X = it->second.X;
+    }
+
+    // O(K^3), other templates stay usable meanwhile.
+    std::shared_ptr<const Basis> built = std::make_shared<const Basis>(X);
+    hit = false;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = templates.find(id);
+    if (it == templates.end()) {
+        // Removed while building, used once and dropped.
+        return built;
+    }
+    if (it->second.basis) {
+        // Built by another call meanwhile.
+        lru.splice(lru.begin(), lru, it->second.lru);
+        return it->second.basis;
+    }
+    it->second.basis = built;
+    lru.push_front(id);
+    it->second.lru = lru.begin();
+    bytes += built->bytes;
+    evict();
+    return built;
+}
+
+void rpm::TemplateLibrary::evict() {
+    while (limit > 0 && bytes > limit && lru.size() > 1) {
+        Template &victim = templates[lru.back()];
+        bytes -= victim.basis->bytes;
+        victim.basis.reset();
+        lru.pop_back();
+        evictions++;
+    }
+}
@@ -0,0 +1,123 @@
+// This file is for registering a stream of targets against a fixed set of templates.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "rpm.h"
+
+namespace rpm {
+    struct TemplateMatch {
+        // Template under the estimated transform, in the coordinates of the input.
+        MatrixXd XT;
+        // K * N correspondence between the template and the target.
+        MatrixXd M;
+        // Spline params in the normalized coordinates of the template, see TemplateLibrary::normalization().
+        MatrixXd d, w;
+        RpmOutcome outcome;
+        // The basis was taken from the cache instead of being built for this call.
+        bool cache_hit = false;
+    };
+
+    struct TemplateLibraryStats {
+        long long hits = 0, misses = 0, evictions = 0;
+        // Templates with a cached basis and the bytes those bases take.
+        int cached = 0;
+        size_t bytes = 0;
+    };
+
+    // Registers targets against a fixed set of templates, keeping the source-side basis of each
+    // template across calls.
+    //
+    // As in RpmTracker a template is normalized by its own bounding box, so its basis does not
+    // depend on the target: the K * K kernel phi, the QR of X and the TpsSolveBasis (projected
+    // kernel and its eigen decomposition) are built once, O(K^3), and later estimates copy them
+    // and only do O(K^2) transform solves.
+    //
+    // Bases are built on first use and kept in an LRU cache bounded by the memory limit, the
+    // template points are always kept. All methods may be called from several threads, an
+    // evicted basis stays alive until the estimates using it return.
+    class TemplateLibrary {
+    public:
+        // memory_limit	bytes of cached bases, 0 for no limit. The most recently used basis
+        //				is kept even when it alone is above the limit.
+        explicit TemplateLibrary(const size_t memory_limit = 0);
+
+        TemplateLibrary(const TemplateLibrary &) = delete;
+
+        TemplateLibrary &operator=(const TemplateLibrary &) = delete;
+
+        // Add the points of a template (2d, at least D + 1), returns its id.
+        int add(const MatrixXd &X);
+
+        // Drop a template and its basis, false for an unknown id.
+        bool remove(const int id);
+
+        // Build the basis of a template now, e.g. before the targets start coming.
+        // Returns false for an unknown id or a failed build.
+        bool prepare(const int id);
+
+        // Register a target to a template, see estimate_anytime(). config.solve_basis is
+        // replaced by the cached one, with config.affine_only no basis is used.
+        //
+        // Input:
+        //   id			template
+        //	 Y			target points, 2d
+        // Output:
+        //	 match		transformed template, correspondence, params and outcome
+        // Returns true when a model is returned, false on failure
+        //
+        bool estimate(
+                const int id,
+                const MatrixXd &Y,
+                TemplateMatch &match,
+                const RpmConfig &config = RpmConfig(),
+                const RpmBudget &budget = RpmBudget(),
+                const vector<pair<int, int> > &matched_point_indices = vector<pair<int, int> >()
+        );
+
+        // Input coordinates -> normalized coordinates of a template.
+        Matrix3d normalization(const int id) const;
+
+        void set_memory_limit(const size_t memory_limit);
+
+        size_t memory_limit() const;
+
+        TemplateLibraryStats stats() const;
+
+        // Bytes of the basis of a K point template, for sizing the memory limit.
+        static size_t basis_bytes(const int K);
+
+    private:
+        struct Basis;
+
+        struct Template {
+            MatrixXd X;  // normalized, homogeneous
+            Matrix3d norm, norm_inv;
+            std::shared_ptr<const Basis> basis;
+            std::list<int>::iterator lru;
+        };
+
+        // The cached basis of id, built when missing.
+        std::shared_ptr<const Basis> acquire(const int id, bool &hit);
+
+        // Drop least recently used bases until within the limit, mutex held.
+        void evict();
+
+        mutable std::mutex mutex;
+        std::map<int, Template> templates;
+        // Ids with a cached basis, most recently used first.
+        std::list<int> lru;
+        size_t limit = 0, bytes = 0;
+        long long hits = 0, misses = 0, evictions = 0;
+        int next_id = 0;
+    };
+}
@@ -0,0 +1,176 @@
+// This file is for tracing the stages of rpm::estimate across the scheduler threads.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+namespace {
+    struct Event {
+        const char *name, *arg_name;
+        double arg;
+        int64_t begin, end;
+    };
+
+    // Ring of one thread. Only the owner writes, written is published with release so a reader
+    // after stop() sees complete events. Buffers live as long as the process, a thread keeps
+    // its pointer across start() calls.
+    struct ThreadBuffer {
+        std::vector<Event> events;
+        std::atomic<uint64_t> written{0};
+        int index = 0;
+        std::string name;
+    };
+
+    std::atomic<bool> active{false};
+    // Steady clock nanoseconds of the last start().
+    std::atomic<int64_t> origin{0};
+
+    // Registration and export only, never taken while recording an event.
+    std::mutex registry_mutex;
+    std::vector<std::unique_ptr<ThreadBuffer> > registry;
+    size_t capacity = 1 << 16;
+
+    thread_local ThreadBuffer *local = nullptr;
+    thread_local std::string local_name;
+
+    inline int64_t _now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    ThreadBuffer *_buffer() {
+        if (!local) {
+            std::lock_guard<std::mutex> lock(registry_mutex);
+            registry.emplace_back(new ThreadBuffer());
+            local = registry.back().get();
+            local->events.resize(capacity);
+            local->index = int(registry.size()) - 1;
+            local->name = local_name.empty() ? "thread " + std::to_string(local->index) : local_name;
+        }
+        return local;
+    }
+
+    void _escaped(std::ostream &out, const char *s) {
+        for (; *s; s++) {
+            if (*s == '"' || *s == '\\') {
+                out << '\\';
+            }
+            out << *s;
+        }
+    }
+}
+
+bool rpm::trace::instrumented() {
+#ifdef RPM_TRACE
+    return true;
+#else
+    return false;
+#endif
+}
+
+void rpm::trace::start(const size_t events_per_thread) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    capacity = std::max<size_t>(events_per_thread, 1);
+    for (auto &buffer : registry) {
+        buffer->events.resize(capacity);
+        buffer->written.store(0, std::memory_order_relaxed);
+    }
+    origin.store(_now(), std::memory_order_relaxed);
+    active.store(true, std::memory_order_release);
+}
+
+void rpm::trace::stop() {
+    active.store(false, std::memory_order_release);
+}
+
+bool rpm::trace::recording() {
+    return active.load(std::memory_order_relaxed);
+}
+
+long long rpm::trace::dropped() {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    long long count = 0;
+    for (auto &buffer : registry) {
+        const uint64_t written = buffer->written.load(std::memory_order_acquire);
+        count += written > buffer->events.size() ? written - buffer->events.size() : 0;
+    }
+    return count;
+}
+
+void rpm::trace::set_thread_name(const std::string &name) {
+    local_name = name;
+    if (local) {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        local->name = name;
+    }
+}
+
+void rpm::trace::write_chrome_json(std::ostream &out) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    const int64_t start = origin.load(std::memory_order_relaxed);
+
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    bool first = true;
+    for (auto &buffer : registry) {
+        const uint64_t written = buffer->written.load(std::memory_order_acquire);
+        if (written == 0) {
+            continue;
+        }
+        out << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "
+            << buffer->index << ", \"args\": {\"name\": \"";
+        _escaped(out, buffer->name.c_str());
+        out << "\"}}";
+        first = false;
+
+        const uint64_t size = buffer->events.size();
+        for (uint64_t i = written > size ? written - size : 0; i < written; i++) {
+            const Event &event = buffer->events[i % size];
+            out << ",\n{\"name\": \"";
+            _escaped(out, event.name);
+            out << "\", \"cat\": \"rpm\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer->index
+                << ", \"ts\": " << (event.begin - start) / 1000.0 << ", \"dur\": " << (event.end - event.begin) / 1000.0;
+            if (event.arg_name) {
+                out << ", \"args\": {\"";
+                _escaped(out, event.arg_name);
+                out << "\": " << event.arg << "}";
+            }
+            out << "}";
+        }
+    }
+    out << "\n]}\n";
+}
+
+bool rpm::trace::save_chrome_json(const std::string &filename) {
+    std::ofstream file(filename);
+    if (!file.is_open()) {
+        return false;
+    }
+    write_chrome_json(file);
+    return bool(file);
+}
+
+rpm::trace::Span::Span(const char *name, const char *arg_name, const double arg)
+        : name(name), arg_name(arg_name), arg(arg), begin(active.load(std::memory_order_relaxed) ? _now() : 0) {
+}
+
+rpm::trace::Span::~Span() {
+    if (!begin || !active.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    ThreadBuffer *buffer = _buffer();
+    const uint64_t i = buffer->written.load(std::memory_order_relaxed);
+    buffer->events[i % buffer->events.size()] = {name, arg_name, arg, begin, _now()};
+    buffer->written.store(i + 1, std::memory_order_release);
+}
@@ -0,0 +1,74 @@
+// This file is for tracing the stages of rpm::estimate across the scheduler threads.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+
+namespace rpm {
+    namespace trace {
+        // The rpm stages carry RPM_TRACE_SPAN()s, i.e. the library was built with RPM_TRACE.
+        // Without it the spans compile to nothing and a trace only holds the caller's own spans.
+        bool instrumented();
+
+        // Drop the spans recorded so far and record from now on, at most events_per_thread
+        // per thread. A full ring overwrites its oldest spans.
+        // Must not be called while spans are open, e.g. during an estimate.
+        void start(size_t events_per_thread = 1 << 16);
+
+        // Stop recording, the spans are kept for write_chrome_json().
+        void stop();
+
+        bool recording();
+
+        // Spans overwritten by full rings since start().
+        long long dropped();
+
+        // Name of the calling thread in the trace, "thread <index>" by default.
+        void set_thread_name(const std::string &name);
+
+        // The recorded spans as Chrome trace JSON (complete events, microseconds from start()),
+        // for chrome://tracing or ui.perfetto.dev. Call after stop().
+        void write_chrome_json(std::ostream &out);
+
+        // Same as above into a file, returns false when it can not be written.
+        bool save_chrome_json(const std::string &filename);
+
+        // One span from construction to destruction, recorded on the calling thread. Nothing is
+        // timed when not recording. name and arg_name must outlive the trace, e.g. literals.
+        class Span {
+        public:
+            explicit Span(const char *name, const char *arg_name = nullptr, double arg = 0);
+
+            ~Span();
+
+            Span(const Span &) = delete;
+
+            Span &operator=(const Span &) = delete;
+
+        private:
+            const char *name, *arg_name;
+            double arg;
+            int64_t begin;
+        };
+    }
+}
+
+#define RPM_TRACE_CONCAT_(a, b) a##b
+#define RPM_TRACE_CONCAT(a, b) RPM_TRACE_CONCAT_(a, b)
+
+// A span over the rest of the scope, and one with a numeric argument shown with it.
+#ifdef RPM_TRACE
+#define RPM_TRACE_SPAN(name) rpm::trace::Span RPM_TRACE_CONCAT(_rpm_trace_span_, __LINE__)(name)
+#define RPM_TRACE_SPAN_ARG(name, arg_name, arg) \
+    rpm::trace::Span RPM_TRACE_CONCAT(_rpm_trace_span_, __LINE__)(name, arg_name, arg)
+#else
+#define RPM_TRACE_SPAN(name) ((void) 0)
+#define RPM_TRACE_SPAN_ARG(name, arg_name, arg) ((void) 0)
+#endif
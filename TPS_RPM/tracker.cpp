@@ -0,0 +1,107 @@
+// This file is for tracking one template contour through a sequence of frames.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "tracker.h"
+
+#include <chrono>
+
+#include "data_process.h"
+
+rpm::RpmTracker::RpmTracker(const MatrixXd &X_, const TrackerConfig &config_) : config(config_) {
+    if (X_.cols() != rpm::D) {
+        throw std::invalid_argument("rpm::RpmTracker only support 2d points!");
+    }
+
+    // Normalize by the box of the template alone, every frame shares it.
+    X = X_;
+    MatrixXd X_copy = X_;
+    norm = data_process::preprocess(X, X_copy);
+    norm_inv = norm.inverse();
+    data_process::homo(X);
+
+    // Affine only registrations never touch the spline basis.
+    RpmConfig &rpm_config = config.config;
+    tps.reset(new ThinPlateSplineParams(X, rpm_config.affine_only));
+    if (!rpm_config.affine_only) {
+        basis.reset(new TpsSolveBasis(*tps));
+    }
+
+    rpm_config.sinkhorn_warm_start = true;
+    rpm_config.sinkhorn_state = &sinkhorn;
+    rpm_config.solve_basis = basis.get();
+    rpm_config.instrumentation = nullptr;
+}
+
+void rpm::RpmTracker::reset() {
+    warm = false;
+}
+
+bool rpm::RpmTracker::track(const MatrixXd &Y_, TrackedFrame &frame, const RpmBudget &budget) {
+    auto t1 = std::chrono::steady_clock::now();
+    frame = TrackedFrame();
+    frame.index = frame_num++;
+    frame.warm = warm;
+
+    try {
+        if (Y_.cols() != rpm::D) {
+            throw std::invalid_argument("rpm::RpmTracker::track() only support 2d points!");
+        }
+
+        MatrixXd Y = Y_;
+        data_process::apply_transform(Y, norm);
+        data_process::homo(Y);
+
+        // The schedule is fixed here, estimate_prepared() only adds the pre-alignments of a cold frame.
+        RpmConfig schedule = config.config;
+        schedule.auto_T_start = false;
+        if (!warm) {
+            tps->d = MatrixXd::Identity(D + 1, D + 1);
+            tps->w = MatrixXd::Zero(X.rows(), D + 1);
+            sinkhorn.reset();
+
+            if (config.config.auto_T_start) {
+                double max_dist = 0, average_dist = 0;
+                distance_stats(X, Y, max_dist, average_dist);
+                set_T_start(schedule, average_dist, 1);
+            }
+            T_start = schedule.T_start;
+            T_end = schedule.T_end;
+            lambda_start = schedule.lambda_start;
+        } else {
+            // lambda follows T as if the whole schedule had run.
+            schedule.T_start = std::min(T_end * config.track_T_scale, T_start);
+            schedule.T_end = T_end;
+            schedule.lambda_start = lambda_start * schedule.T_start / T_start;
+            schedule.r = config.track_r;
+            schedule.I0 = config.track_I0;
+            schedule.use_moment_prealign = false;
+            schedule.use_affine_prealign = false;
+        }
+        if (!(schedule.r > 0 && schedule.r < 1)) {
+            throw std::invalid_argument("rpm::RpmTracker needs an annealing rate in (0, 1)!");
+        }
+
+        if (!estimate_prepared(X, Y, frame.M, *tps, schedule, budget, frame.outcome)) {
+            // Already in frame.outcome.error and on std::cerr.
+            warm = false;
+            return false;
+        }
+
+        frame.XT = tps->applyTransform(true);
+        data_process::apply_transform(frame.XT, norm_inv);
+        // A frame stopped by the budget is returned, but the next one does not build on it.
+        warm = frame.outcome.completed;
+    }
+    catch (const std::exception &e) {
+        frame.outcome.error = e.what();
+        std::cerr << e.what() << std::endl;
+        warm = false;
+        return false;
+    }
+
+    frame.outcome.elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t1).count();
+    return true;
+}
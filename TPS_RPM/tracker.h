@@ -0,0 +1,91 @@
+// This file is for tracking one template contour through a sequence of frames.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include <memory>
+
+#include "rpm.h"
+
+namespace rpm {
+    struct TrackerConfig {
+        // Settings of every frame and the full schedule of the first one, T_start and T_end are
+        // derived from the first frame as in estimate(). Softassign warm start is always on.
+        // The pre-alignments only run on the first frame.
+        RpmConfig config;
+
+        // Later frames start from the previous frame's params and softassign scalings and
+        // anneal from T_end * track_T_scale down to T_end, track_I0 iterations per temperature.
+        double track_T_scale = 4;
+        double track_r = 0.5;
+        int track_I0 = 2;
+    };
+
+    struct TrackedFrame {
+        int index = 0;
+        // Started from the previous frame instead of the full schedule.
+        bool warm = false;
+        // Template under the estimated transform, in the coordinates of the input.
+        MatrixXd XT;
+        // K * N correspondence between the template and the frame.
+        MatrixXd M;
+        // Outcome of estimate_prepared() on the frame, elapsed includes the normalization.
+        RpmOutcome outcome;
+    };
+
+    // Registers one fixed template X to a sequence of frames Y_0, Y_1, ...
+    //
+    // The normalization comes from X alone and is the same for every frame, so the
+    // spline basis and the TpsSolveBasis of X are built once and every transform
+    // solve is O(K^2). The first frame (and the first after reset()) runs the full
+    // schedule, later frames only anneal briefly at low temperature from where the
+    // previous frame ended. Every frame runs estimate_prepared(), so the paths of the
+    // config (use_cpd, affine_only, float or matrix free correspondence) apply as they do there.
+    //
+    // The config's instrumentation is not used.
+    class RpmTracker {
+    public:
+        explicit RpmTracker(const MatrixXd &X, const TrackerConfig &config = TrackerConfig());
+
+        RpmTracker(const RpmTracker &) = delete;
+
+        RpmTracker &operator=(const RpmTracker &) = delete;
+
+        // Register the next frame.
+        //
+        // Input:
+        //   Y			frame points, 2d
+        //	 budget		deadline and cancellation token of this frame
+        // Output:
+        //	 frame		transformed template, correspondence and iteration counts
+        // Returns true when a model is returned (possibly from a stopped schedule), false on failure.
+        // After a failure or a stopped schedule the next frame starts cold.
+        //
+        bool track(const MatrixXd &Y, TrackedFrame &frame, const RpmBudget &budget = RpmBudget());
+
+        // Run the full schedule again on the next frame, e.g. after losing the target.
+        void reset();
+
+        // Spline params of the last frame, in the normalized coordinates.
+        const ThinPlateSplineParams &params() const { return *tps; }
+
+        // Input coordinates -> normalized coordinates.
+        const Matrix3d &normalization() const { return norm; }
+
+    private:
+        TrackerConfig config;
+        MatrixXd X;  // normalized, homogeneous
+        Matrix3d norm, norm_inv;
+        std::unique_ptr<ThinPlateSplineParams> tps;
+        std::unique_ptr<TpsSolveBasis> basis;
+
+        SinkhornState sinkhorn;
+        int frame_num = 0;
+        bool warm = false;
+        // Schedule of the last full run.
+        double T_start = 0, T_end = 0, lambda_start = 0;
+    };
+}
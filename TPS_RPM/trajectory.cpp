@@ -0,0 +1,180 @@
+// This file is for recording the annealing trajectory of rpm::estimate.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "trajectory.h"
+
+#include <cstdint>
+
+#include "data_process.h"
+
+namespace {
+    template<typename T>
+    void _put(std::ofstream &f, T value) {
+        f.write(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    // Rows of a 2d point matrix as float32 pairs.
+    void _put_points(std::ofstream &f, const MatrixXd &P) {
+        _put<int32_t>(f, P.rows());
+        const Matrix<float, Dynamic, 2, RowMajor> P_f = P.leftCols(2).cast<float>();
+        f.write(reinterpret_cast<const char *>(P_f.data()), sizeof(float) * P_f.size());
+    }
+}
+
+rpm::TrajectoryRecorder::TrajectoryRecorder(int capacity, int record_every)
+        : record_every(std::max(record_every, 1)), slots(std::max(capacity, 1)) {
+    writer = std::thread(&TrajectoryRecorder::_write_loop, this);
+}
+
+rpm::TrajectoryRecorder::~TrajectoryRecorder() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    not_empty.notify_all();
+    writer.join();
+}
+
+bool rpm::TrajectoryRecorder::open(const std::string &filename) {
+    try {
+        file.open(filename, std::ios::binary);
+        if (!file.is_open()) {
+            throw std::runtime_error("can not open file : " + filename);
+        }
+        file.write("RPMTRAJ1", 8);
+        return true;
+    }
+    catch (std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return false;
+    }
+}
+
+void rpm::TrajectoryRecorder::set_sink(FrameSink sink_) {
+    sink = std::move(sink_);
+}
+
+void rpm::TrajectoryRecorder::attach(RpmInstrumentation &instrumentation) {
+    instrumentation.on_state = [this](const RpmIterationStats &iteration, const ThinPlateSplineParams &params,
+                                      const MatrixXd &Y) {
+        capture(iteration, params, Y);
+    };
+}
+
+void rpm::TrajectoryRecorder::capture(const RpmIterationStats &iteration, const ThinPlateSplineParams &params,
+                                      const MatrixXd &Y) {
+    // The first iteration of an estimate starts a new run, its basis is copied once.
+    if (!run || (iteration.temperature_index == 0 && iteration.iter == 1)) {
+        MatrixXd Y_ = Y;
+        data_process::hnorm(Y_);
+        run = std::make_shared<Run>(run_num++, params, Y_);
+        run_iterations = 0;
+    }
+    if (run_iterations++ % record_every != record_every - 1) {
+        return;
+    }
+
+    int index;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (size == int(slots.size())) {
+            dropped_num++;
+            return;
+        }
+        index = (head + size) % slots.size();
+    }
+
+    // The slot is outside [head, head + size), the writer does not read it until it is published.
+    Slot &slot = slots[index];
+    slot.frame.run = run->index;
+    slot.frame.iteration = iteration;
+    slot.frame.d = params.d;
+    slot.frame.w = params.w;
+    slot.run = run;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        size++;
+        captured_num++;
+    }
+    not_empty.notify_one();
+}
+
+void rpm::TrajectoryRecorder::flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    drained.wait(lock, [this] { return size == 0; });
+    if (file.is_open()) {
+        file.flush();
+    }
+}
+
+long long rpm::TrajectoryRecorder::captured() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return captured_num;
+}
+
+long long rpm::TrajectoryRecorder::dropped() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return dropped_num;
+}
+
+void rpm::TrajectoryRecorder::_write_loop() {
+    while (true) {
+        int index;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            not_empty.wait(lock, [this] { return size > 0 || stopping; });
+            if (size == 0) {
+                return;
+            }
+            index = head;
+        }
+
+        try {
+            _write(slots[index]);
+        }
+        catch (std::exception &e) {
+            std::cerr << e.what() << std::endl;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            head = (head + 1) % slots.size();
+            size--;
+        }
+        drained.notify_all();
+    }
+}
+
+void rpm::TrajectoryRecorder::_write(Slot &slot) {
+    Run &r = *slot.run;
+    const TrajectoryFrame &frame = slot.frame;
+
+    r.basis.d = frame.d;
+    r.basis.w = frame.w;
+    const MatrixXd XT = r.basis.applyTransform(true);
+
+    if (file.is_open()) {
+        if (!r.written) {
+            _put<uint8_t>(file, 1);
+            _put<int32_t>(file, r.index);
+            _put_points(file, r.Y);
+            r.written = true;
+        }
+        _put<uint8_t>(file, 2);
+        _put<int32_t>(file, r.index);
+        _put<int32_t>(file, frame.iteration.temperature_index);
+        _put<int32_t>(file, frame.iteration.iter);
+        _put<double>(file, frame.iteration.T);
+        _put<double>(file, frame.iteration.lambda);
+        _put<double>(file, frame.iteration.energy);
+        _put_points(file, XT);
+    }
+
+    if (sink) {
+        sink(frame, XT, r.Y);
+    }
+}
@@ -0,0 +1,118 @@
+// This file is for recording the annealing trajectory of rpm::estimate.
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rpm.h"
+
+namespace rpm {
+    // One captured annealing iteration. Only the spline coefficients are copied on the
+    // estimating thread, the writer rebuilds the points from the basis of the run.
+    struct TrajectoryFrame {
+        int run = 0;
+        RpmIterationStats iteration;
+        MatrixXd d, w;
+    };
+
+    // Captures the state of every iteration into a ring buffer and writes it from a
+    // background thread, to a binary trajectory file and/or a frame sink (e.g. PNG frames).
+    //
+    // Capturing copies d and w into a preallocated slot, nothing is rendered or written
+    // on the estimating thread. When the writer falls behind, frames are dropped instead
+    // of stalling the estimate, see dropped().
+    //
+    // One estimate at a time may feed a recorder, consecutive estimates become runs.
+    //
+    // Binary trajectory, native endianness:
+    //   "RPMTRAJ1"
+    //   run record   : uint8 1, int32 run, int32 N, float32 Y[N][2]
+    //   frame record : uint8 2, int32 run, int32 temperature_index, int32 iter,
+    //                  float64 T, float64 lambda, float64 energy, int32 K, float32 XT[K][2]
+    // The points are in the normalized frame of the estimate, a run record precedes its frames.
+    class TrajectoryRecorder {
+    public:
+        // Called on the writer thread with the transformed source (K * 2) and the target (N * 2).
+        typedef std::function<void(const TrajectoryFrame &frame, const MatrixXd &XT, const MatrixXd &Y)> FrameSink;
+
+        // Input:
+        //   capacity : ring buffer size in frames
+        //   record_every : keep one iteration out of record_every, e.g. config.I0 for one per temperature
+        explicit TrajectoryRecorder(int capacity = 64, int record_every = 1);
+
+        TrajectoryRecorder(const TrajectoryRecorder &) = delete;
+
+        TrajectoryRecorder &operator=(const TrajectoryRecorder &) = delete;
+
+        // Write the remaining frames and stop the writer.
+        ~TrajectoryRecorder();
+
+        // Write the binary trajectory to filename. Call before the first capture.
+        bool open(const std::string &filename);
+
+        // Call before the first capture.
+        void set_sink(FrameSink sink);
+
+        // Route on_state of instrumentation to capture().
+        void attach(RpmInstrumentation &instrumentation);
+
+        void capture(const RpmIterationStats &iteration, const ThinPlateSplineParams &params, const MatrixXd &Y);
+
+        // Block until every captured frame has been written.
+        void flush();
+
+        long long captured() const;
+
+        long long dropped() const;
+
+    private:
+        // Basis and target of one estimate, owned by the writer once published.
+        struct Run {
+            int index;
+            ThinPlateSplineParams basis;
+            MatrixXd Y;
+            bool written = false;
+
+            Run(int index, const ThinPlateSplineParams &basis, const MatrixXd &Y)
+                    : index(index), basis(basis), Y(Y) {}
+        };
+
+        struct Slot {
+            TrajectoryFrame frame;
+            std::shared_ptr<Run> run;
+        };
+
+        void _write_loop();
+
+        void _write(Slot &slot);
+
+        const int record_every;
+        std::vector<Slot> slots;
+        int head = 0, size = 0;
+        bool stopping = false;
+        long long captured_num = 0, dropped_num = 0;
+
+        // Producer side, only touched by the estimating thread.
+        std::shared_ptr<Run> run;
+        int run_num = 0;
+        long long run_iterations = 0;
+
+        std::ofstream file;
+        FrameSink sink;
+
+        mutable std::mutex mutex;
+        std::condition_variable not_empty, drained;
+        std::thread writer;
+    };
+}